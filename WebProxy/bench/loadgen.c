@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+
+// Multi-threaded HTTP load generator for myproxy.
+// Closed loop: every thread sends its next request as soon as the previous one ends.
+// Open loop: requests are scheduled at a fixed total rate and latency is measured
+// from the scheduled start, so a stalled proxy cannot hide its queueing delay.
+
+#define RECV_SIZE (64 * 1024)
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    long long *latencies_us;
+    size_t count, cap;
+    long errors;
+    long long bytes;
+} worker;
+
+static struct sockaddr_in target;
+static char request[1024];
+static size_t request_len;
+static int unique_query = 0;     // Append ?n=<seq> so requests cannot be coalesced
+static atomic_long request_seq = 0;
+static int open_loop = 0;
+static double rate = 0;          // Total requests per second in open-loop mode
+static int threads = 4;
+static long long deadline_ns;
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(long long when_ns) {
+    struct timespec ts = { when_ns / 1000000000LL, when_ns % 1000000000LL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void record(worker *w, long long latency_ns) {
+    if (w->count == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 4096;
+        w->latencies_us = realloc(w->latencies_us, w->cap * sizeof(long long));
+    }
+    w->latencies_us[w->count++] = latency_ns / 1000;
+}
+
+// One request on a fresh connection; returns response bytes or -1 on failure
+static long long do_request() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    char unique_request[sizeof(request) + 32];
+    const char *req = request;
+    size_t req_len = request_len;
+    if (unique_query) {
+        // Splice the query in front of " HTTP/1.1" on the request line
+        const char *version = strstr(request, " HTTP/1.1\r\n");
+        req_len = snprintf(unique_request, sizeof(unique_request), "%.*s?n=%ld%s", (int)(version - request),
+                           request, atomic_fetch_add(&request_seq, 1), version);
+        req = unique_request;
+    }
+
+    if (connect(fd, (struct sockaddr *)&target, sizeof(target)) < 0 ||
+        send(fd, req, req_len, MSG_NOSIGNAL) != (ssize_t)req_len) {
+        close(fd);
+        return -1;
+    }
+
+    static __thread char buf[RECV_SIZE];
+    long long total = 0;
+    int status_ok = 0;
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        if (total == 0) status_ok = n >= 12 && strncmp(buf + 9, "200", 3) == 0;
+        total += n;
+    }
+    close(fd);
+    return (n < 0 || !status_ok) ? -1 : total;
+}
+
+static void *run_worker(void *arg) {
+    worker *w = arg;
+    double interval_ns = open_loop ? 1e9 * threads / rate : 0;
+    long long next_ns = now_ns() + (long long)(interval_ns * w->id / threads);  // Stagger threads
+
+    while (1) {
+        long long start_ns;
+        if (open_loop) {
+            if (next_ns >= deadline_ns) break;
+            sleep_until(next_ns);
+            start_ns = next_ns;  // Measure from the intended start, not the actual one
+            next_ns += (long long)interval_ns;
+        } else {
+            start_ns = now_ns();
+            if (start_ns >= deadline_ns) break;
+        }
+
+        long long bytes = do_request();
+        if (bytes < 0) {
+            w->errors++;
+            continue;
+        }
+        w->bytes += bytes;
+        record(w, now_ns() - start_ns);
+    }
+    return NULL;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static long long percentile(long long *sorted, size_t count, double p) {
+    if (count == 0) return 0;
+    size_t index = (size_t)(p * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -x <proxy_ip:port> -u <url> [-t <threads>] [-d <seconds>] [-r <req/s>] [-q] [-H <header>]\n"
+                    "  Without -x the URL's host:port is hit directly.\n"
+                    "  -r switches from closed loop to open loop at that total rate.\n"
+                    "  -q makes every URL unique so the proxy cannot coalesce them.\n"
+                    "  -H adds one request header, e.g. -H \"Cookie: a=1\".\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *proxy = NULL, *url = NULL, *extra_header = NULL;
+    int duration = 10;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-q") == 0) {
+            unique_query = 1;
+            continue;
+        }
+        if (i + 1 >= argc) usage(argv[0]);
+        if (strcmp(argv[i], "-x") == 0) proxy = argv[++i];
+        else if (strcmp(argv[i], "-u") == 0) url = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0) duration = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0) rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "-H") == 0) extra_header = argv[++i];
+        else usage(argv[0]);
+    }
+    if (!url || threads <= 0 || duration <= 0 || strncmp(url, "http://", 7) != 0) usage(argv[0]);
+    open_loop = rate > 0;
+
+    // Parse http://host:port/path
+    char host[256] = {0}, path[512] = "/";
+    int port = 80;
+    const char *authority = url + 7;
+    const char *slash = strchr(authority, '/');
+    size_t authority_len = slash ? (size_t)(slash - authority) : strlen(authority);
+    if (authority_len >= sizeof(host)) usage(argv[0]);
+    memcpy(host, authority, authority_len);
+    if (slash) snprintf(path, sizeof(path), "%s", slash);
+    char *colon = strchr(host, ':');
+    if (colon) {
+        *colon = '\0';
+        port = atoi(colon + 1);
+    }
+
+    // Through a proxy the request line carries the absolute URL
+    request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: loadgen\r\nAccept: */*\r\n%s%s\r\n",
+                           proxy ? url : path, host, extra_header ? extra_header : "", extra_header ? "\r\n" : "");
+    if (request_len >= sizeof(request)) usage(argv[0]);
+
+    char target_ip[64];
+    int target_port = port;
+    snprintf(target_ip, sizeof(target_ip), "%s", proxy ? proxy : (strcmp(host, "localhost") == 0 ? "127.0.0.1" : host));
+    colon = strchr(target_ip, ':');
+    if (proxy) {
+        if (!colon) usage(argv[0]);
+        *colon = '\0';
+        target_port = atoi(colon + 1);
+    }
+    target.sin_family = AF_INET;
+    target.sin_port = htons(target_port);
+    if (inet_pton(AF_INET, target_ip, &target.sin_addr) != 1) {
+        fprintf(stderr, "loadgen: target must be a numeric IPv4 address\n");
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    worker *workers = calloc(threads, sizeof(worker));
+    long long start_ns = now_ns();
+    deadline_ns = start_ns + duration * 1000000000LL;
+
+    for (int i = 0; i < threads; i++) {
+        workers[i].id = i;
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+
+    size_t total = 0;
+    long errors = 0;
+    long long bytes = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].count;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+
+    long long *all = malloc((total ? total : 1) * sizeof(long long));
+    size_t n = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(all + n, workers[i].latencies_us, workers[i].count * sizeof(long long));
+        n += workers[i].count;
+        free(workers[i].latencies_us);
+    }
+    qsort(all, total, sizeof(long long), compare_ll);
+
+    // One machine-readable line; run_bench.sh adds CPU per request
+    printf("mode=%s threads=%d requests=%zu errors=%ld rps=%.1f mbps=%.1f p50_us=%lld p99_us=%lld p999_us=%lld max_us=%lld\n",
+           open_loop ? "open" : "closed", threads, total, errors, total / elapsed, bytes * 8 / elapsed / 1e6,
+           percentile(all, total, 0.50), percentile(all, total, 0.99), percentile(all, total, 0.999),
+           total ? all[total - 1] : 0);
+
+    free(all);
+    free(workers);
+    return 0;
+}
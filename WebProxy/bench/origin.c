@@ -0,0 +1,271 @@
+#define _GNU_SOURCE  // strcasestr()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+
+// Local origin stand-in for benchmarks.
+// GET /<bytes> returns that many bytes of text over plain HTTP or over HTTPS with
+// a self-signed certificate generated at startup, so no files or network are needed.
+// Every 16-byte line holds its own line number, so any byte range can be checked, and
+// single "Range: bytes=" requests are answered with 206 and a matching If-None-Match with 304.
+
+#define PATTERN_SIZE (256 * 1024)
+#define REQUEST_SIZE 8192
+
+typedef struct {
+    int fd;
+    SSL_CTX *ssl_ctx;  // NULL for the plain HTTP listener
+} origin_conn;
+
+static char pattern[PATTERN_SIZE];
+static int max_age = -1;  // Cache-Control: max-age sent with every response (-1 = none)
+
+// Resolve a single byte range against the object size; returns 0 to send the whole object
+static int parse_range(const char *request, long long size, long long *first, long long *last) {
+    const char *range = strcasestr(request, "\r\nRange: bytes=");
+    if (!range) return 0;
+    range += strlen("\r\nRange: bytes=");
+
+    char *end;
+    if (*range == '-') {
+        long long suffix = strtoll(range + 1, NULL, 10);
+        if (suffix <= 0) return 0;
+        *first = suffix > size ? 0 : size - suffix;
+        *last = size - 1;
+    } else {
+        *first = strtoll(range, &end, 10);
+        if (*end != '-') return 0;
+        *last = end[1] >= '0' && end[1] <= '9' ? strtoll(end + 1, NULL, 10) : size - 1;
+        if (*last >= size) *last = size - 1;
+    }
+    return *first <= *last ? 1 : -1;
+}
+
+static SSL_CTX *create_self_signed_ctx() {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    if (!key || !cert) return NULL;
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 7 * 24 * 3600);
+    X509_set_pubkey(cert, key);
+
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_sign(cert, key, EVP_sha256());
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx || SSL_CTX_use_certificate(ctx, cert) != 1 || SSL_CTX_use_PrivateKey(ctx, key) != 1) {
+        ERR_print_errors_fp(stderr);
+        return NULL;
+    }
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ctx;
+}
+
+static int conn_write(int fd, SSL *ssl, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = ssl ? SSL_write(ssl, buf, len) : send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && !ssl && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static void *serve_connection(void *arg) {
+    origin_conn *conn = arg;
+    SSL *ssl = NULL;
+    char request[REQUEST_SIZE];
+    size_t received = 0;
+
+    if (conn->ssl_ctx) {
+        ssl = SSL_new(conn->ssl_ctx);
+        SSL_set_fd(ssl, conn->fd);
+        if (SSL_accept(ssl) != 1) goto done;
+    }
+
+    // Read the request head; bodies are never expected
+    while (received < sizeof(request) - 1) {
+        ssize_t n = ssl ? SSL_read(ssl, request + received, sizeof(request) - 1 - received)
+                        : recv(conn->fd, request + received, sizeof(request) - 1 - received, 0);
+        if (n <= 0) goto done;
+        received += n;
+        request[received] = '\0';
+        if (strstr(request, "\r\n\r\n")) break;
+    }
+
+    char method[16], path[256];
+    if (sscanf(request, "%15s %255s", method, path) != 2) goto done;
+
+    long long size = atoll(path[0] == '/' ? path + 1 : path);
+    if (size < 0) size = 0;
+
+    long long first = 0, last = size - 1;
+    int ranged = parse_range(request, size, &first, &last);
+    char cache_control[64] = "";
+    if (max_age >= 0) snprintf(cache_control, sizeof(cache_control), "Cache-Control: max-age=%d\r\n", max_age);
+
+    char header[512];
+    int header_len;
+    if (ranged < 0) {
+        header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                              "Content-Range: bytes */%lld\r\n"
+                              "Content-Length: 0\r\n"
+                              "Connection: close\r\n\r\n", size);
+        conn_write(conn->fd, ssl, header, header_len);
+        goto done;
+    }
+
+    // Answer revalidations like a real origin: the ETag only changes with the size
+    char etag[48];
+    snprintf(etag, sizeof(etag), "\"%lld\"", size);
+    const char *if_none_match = strcasestr(request, "\r\nIf-None-Match:");
+    const char *match = if_none_match ? strstr(if_none_match, etag) : NULL;
+    if (match && match < strstr(if_none_match + 2, "\r\n")) {
+        header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 304 Not Modified\r\n"
+                              "ETag: %s\r\n"
+                              "%s"
+                              "Connection: close\r\n\r\n", etag, cache_control);
+        conn_write(conn->fd, ssl, header, header_len);
+        goto done;
+    }
+
+    char content_range[96] = "";
+    if (ranged) snprintf(content_range, sizeof(content_range), "Content-Range: bytes %lld-%lld/%lld\r\n", first, last, size);
+    header_len = snprintf(header, sizeof(header),
+                          "HTTP/1.1 %s\r\n"
+                          "Content-Type: text/plain\r\n"
+                          "Content-Length: %lld\r\n"
+                          "%s"
+                          "Accept-Ranges: bytes\r\n"
+                          "ETag: %s\r\n"
+                          "Last-Modified: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+                          "%s"
+                          "Connection: close\r\n\r\n",
+                          ranged ? "206 Partial Content" : "200 OK", last - first + 1, content_range, etag, cache_control);
+    if (!conn_write(conn->fd, ssl, header, header_len)) goto done;
+
+    if (strcmp(method, "HEAD") != 0) {
+        long long pos = first;
+        while (pos <= last) {
+            size_t offset = pos % PATTERN_SIZE;
+            size_t chunk = PATTERN_SIZE - offset;
+            if ((long long)chunk > last - pos + 1) chunk = last - pos + 1;
+            if (!conn_write(conn->fd, ssl, pattern + offset, chunk)) goto done;
+            pos += chunk;
+        }
+    }
+
+done:
+    if (ssl) {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+    }
+    close(conn->fd);
+    free(conn);
+    return NULL;
+}
+
+static int listen_on(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1024) < 0) {
+        perror("origin: listen failed");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+typedef struct {
+    int listen_fd;
+    SSL_CTX *ssl_ctx;
+} listener;
+
+static void *accept_loop(void *arg) {
+    listener *l = arg;
+    while (1) {
+        int fd = accept(l->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("origin: accept failed");
+            continue;
+        }
+
+        origin_conn *conn = malloc(sizeof(origin_conn));
+        conn->fd = fd;
+        conn->ssl_ctx = l->ssl_ctx;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_connection, conn) != 0) {
+            close(fd);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int http_port = 18080, https_port = 18443;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) http_port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) https_port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-max-age") == 0 && i + 1 < argc) max_age = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "Usage: %s [-p <http_port>] [-s <https_port>] [-max-age <seconds>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < PATTERN_SIZE; i += 16) {
+        char line[17];
+        snprintf(line, sizeof(line), "%015x\n", i / 16);
+        memcpy(pattern + i, line, 16);
+    }
+
+    SSL_CTX *ssl_ctx = create_self_signed_ctx();
+    if (!ssl_ctx) {
+        fprintf(stderr, "origin: could not create TLS context\n");
+        exit(EXIT_FAILURE);
+    }
+
+    listener plain = { listen_on(http_port), NULL };
+    listener tls = { listen_on(https_port), ssl_ctx };
+
+    printf("Origin serving http://127.0.0.1:%d/<bytes> and https://127.0.0.1:%d/<bytes>\n", http_port, https_port);
+    fflush(stdout);
+
+    pthread_t plain_thread;
+    pthread_create(&plain_thread, NULL, accept_loop, &plain);
+    accept_loop(&tls);
+    return 0;
+}
@@ -0,0 +1,73 @@
+#!/bin/sh
+# Reproducible single-box benchmark for myproxy.
+# Starts the local origin and a proxy on loopback, drives load through the proxy
+# for each object size, and reports throughput, latency percentiles and the
+# proxy's CPU time per request.
+#
+# Usage: bench/run_bench.sh [-s "sizes"] [-t threads] [-d seconds] [-r req/s] [-shared] [-H header] [-- extra myproxy flags]
+#   -shared lets concurrent requests hit the same URL (and be coalesced)
+#   -H adds a request header to every request, e.g. -H "Cookie: a=1" to bypass coalescing and the cache
+#   run from WebProxy/ after `make bench`
+
+SIZES="1024 65536 1048576"
+THREADS=8
+DURATION=10
+RATE=""
+UNIQUE="-q"
+HEADER=""
+PROXY_PORT=${PROXY_PORT:-18888}
+HTTP_PORT=${HTTP_PORT:-18080}
+HTTPS_PORT=${HTTPS_PORT:-18443}
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        -s) SIZES="$2"; shift 2 ;;
+        -t) THREADS="$2"; shift 2 ;;
+        -d) DURATION="$2"; shift 2 ;;
+        -r) RATE="-r $2"; shift 2 ;;
+        -shared) UNIQUE=""; shift ;;
+        -H) HEADER="$2"; shift 2 ;;
+        --) shift; break ;;
+        *) echo "Usage: $0 [-s \"sizes\"] [-t threads] [-d seconds] [-r req/s] [-shared] [-H header] [-- myproxy flags]"; exit 1 ;;
+    esac
+done
+
+BIN=$(dirname "$0")/../bin
+WORK=$(mktemp -d)
+trap 'kill $ORIGIN_PID $PROXY_PID 2>/dev/null; rm -rf "$WORK"' EXIT INT TERM
+
+: > "$WORK/forbidden_sites.txt"
+"$BIN/origin" -p $HTTP_PORT -s $HTTPS_PORT > "$WORK/origin.out" 2>&1 &
+ORIGIN_PID=$!
+"$BIN/myproxy" -p $PROXY_PORT -a "$WORK/forbidden_sites.txt" -l "$WORK/access.log" -untrusted "$@" > "$WORK/proxy.out" 2>&1 &
+PROXY_PID=$!
+sleep 1
+
+if ! kill -0 $ORIGIN_PID 2>/dev/null || ! kill -0 $PROXY_PID 2>/dev/null; then
+    echo "benchmark: origin or proxy failed to start"
+    cat "$WORK/origin.out" "$WORK/proxy.out"
+    exit 1
+fi
+
+TICKS=$(getconf CLK_TCK)
+proxy_cpu_ticks() {
+    # utime + stime of the proxy and of its -workers children, plus the reaped children's
+    # cutime + cstime, in clock ticks; with -workers the master itself is mostly idle
+    cat /proc/[0-9]*/stat 2>/dev/null | awk -v pid=$PROXY_PID '
+        $1 == pid { ticks += $14 + $15 + $16 + $17 }
+        $4 == pid { ticks += $14 + $15 }
+        END { print ticks + 0 }'
+}
+
+echo "myproxy benchmark: threads=$THREADS duration=${DURATION}s ${RATE:-closed loop} origin=https://127.0.0.1:$HTTPS_PORT"
+for SIZE in $SIZES; do
+    CPU_BEFORE=$(proxy_cpu_ticks)
+    RESULT=$("$BIN/loadgen" -x 127.0.0.1:$PROXY_PORT -u "http://127.0.0.1:$HTTPS_PORT/$SIZE" \
+             -t $THREADS -d $DURATION $RATE $UNIQUE ${HEADER:+-H} ${HEADER:+"$HEADER"})
+    CPU_AFTER=$(proxy_cpu_ticks)
+
+    REQUESTS=$(echo "$RESULT" | sed -n 's/.*requests=\([0-9]*\).*/\1/p')
+    CPU_US=$(awk -v t=$((CPU_AFTER - CPU_BEFORE)) -v hz=$TICKS -v n=$REQUESTS \
+             'BEGIN { printf "%.1f", (n > 0) ? t * 1e6 / hz / n : 0 }')
+    echo "size=$SIZE $RESULT cpu_us_per_req=$CPU_US"
+done
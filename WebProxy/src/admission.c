@@ -0,0 +1,151 @@
+#include "proxy.h"
+#include <stdatomic.h>
+#include <time.h>
+
+// Admission control for the accept loop.
+// Connections are shed with a pre-canned 503 before any thread or upstream work
+// when too many clients are in service or when accepted clients wait too long
+// to be picked up. Each client IP also gets a token bucket; empty buckets get a 429.
+
+#define BUCKET_TABLE_SIZE 1024
+#define BUCKET_PROBE 8
+#define BUCKET_IDLE_NS (60LL * 1000000000LL)   // Reuse buckets idle this long
+#define DELAY_SAMPLE_TTL_NS 1000000000LL       // Ignore delay samples older than 1s
+
+typedef struct {
+    in_addr_t ip;
+    int used;
+    double tokens;
+    long long last_ns;
+} token_bucket;
+
+static const char overload_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Connection: close\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n\r\n";
+
+static const char throttle_response[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Connection: close\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n\r\n";
+
+static admission_config config;
+
+// Only the accept thread touches the bucket table, so it needs no lock
+static token_bucket buckets[BUCKET_TABLE_SIZE];
+
+static atomic_int active_clients = 0;
+static atomic_llong queue_delay_ewma_ns = 0;
+static atomic_llong last_delay_sample_ns = 0;
+
+static atomic_long admitted_count = 0;
+static atomic_long shed_concurrency_count = 0;
+static atomic_long shed_delay_count = 0;
+static atomic_long throttled_count = 0;
+
+long long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void admission_configure(const admission_config *cfg) {
+    config = *cfg;
+}
+
+static token_bucket *find_bucket(in_addr_t ip, long long now) {
+    unsigned int h = (ntohl(ip) * 2654435761u) % BUCKET_TABLE_SIZE;
+    token_bucket *victim = NULL;
+    int victim_free = 0;
+
+    for (int i = 0; i < BUCKET_PROBE; i++) {
+        token_bucket *b = &buckets[(h + i) % BUCKET_TABLE_SIZE];
+        if (b->used && b->ip == ip) return b;
+
+        int is_free = !b->used || now - b->last_ns > BUCKET_IDLE_NS;
+        if (is_free) {
+            if (!victim_free) {
+                victim = b;
+                victim_free = 1;
+            }
+        } else if (!victim || (!victim_free && b->last_ns < victim->last_ns)) {
+            victim = b;  // Evict the least recently seen client
+        }
+    }
+
+    victim->used = 1;
+    victim->ip = ip;
+    victim->tokens = config.burst_per_ip;
+    victim->last_ns = now;
+    return victim;
+}
+
+static int take_token(in_addr_t ip, long long now) {
+    token_bucket *b = find_bucket(ip, now);
+
+    b->tokens += (now - b->last_ns) / 1e9 * config.rate_per_ip;
+    if (b->tokens > config.burst_per_ip) b->tokens = config.burst_per_ip;
+    b->last_ns = now;
+
+    if (b->tokens < 1.0) return 0;
+    b->tokens -= 1.0;
+    return 1;
+}
+
+static void reject(int client_fd, const char *response, size_t len) {
+    // Best effort: never block the accept loop on a client that is not reading
+    send(client_fd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_fd);
+}
+
+int admission_check(int client_fd, const struct sockaddr_in *client_addr, long long now) {
+    if (config.max_active > 0 && atomic_load(&active_clients) >= config.max_active) {
+        atomic_fetch_add(&shed_concurrency_count, 1);
+        reject(client_fd, overload_response, sizeof(overload_response) - 1);
+        return 0;
+    }
+
+    if (config.max_queue_ms > 0 && now - atomic_load(&last_delay_sample_ns) < DELAY_SAMPLE_TTL_NS &&
+        atomic_load(&queue_delay_ewma_ns) > config.max_queue_ms * 1000000LL) {
+        atomic_fetch_add(&shed_delay_count, 1);
+        reject(client_fd, overload_response, sizeof(overload_response) - 1);
+        return 0;
+    }
+
+    if (config.rate_per_ip > 0 && !take_token(client_addr->sin_addr.s_addr, now)) {
+        atomic_fetch_add(&throttled_count, 1);
+        reject(client_fd, throttle_response, sizeof(throttle_response) - 1);
+        return 0;
+    }
+
+    atomic_fetch_add(&active_clients, 1);
+    atomic_fetch_add(&admitted_count, 1);
+    return 1;
+}
+
+void admission_started(long long accepted_ns) {
+    long long now = monotonic_ns();
+    long long sample = now - accepted_ns;
+    long long ewma = atomic_load(&queue_delay_ewma_ns);
+
+    // EWMA with alpha = 1/8; a lost race only drops one sample
+    atomic_store(&queue_delay_ewma_ns, ewma + (sample - ewma) / 8);
+    atomic_store(&last_delay_sample_ns, now);
+}
+
+void admission_release() {
+    atomic_fetch_sub(&active_clients, 1);
+}
+
+int admission_active() {
+    return atomic_load(&active_clients);
+}
+
+void print_admission_stats(FILE *out) {
+    fprintf(out, "admission: active=%d queue_delay_ewma_us=%lld admitted=%ld shed_concurrency=%ld shed_delay=%ld throttled=%ld\n",
+            atomic_load(&active_clients), atomic_load(&queue_delay_ewma_ns) / 1000,
+            atomic_load(&admitted_count), atomic_load(&shed_concurrency_count),
+            atomic_load(&shed_delay_count), atomic_load(&throttled_count));
+}
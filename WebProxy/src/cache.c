@@ -0,0 +1,899 @@
+#define _GNU_SOURCE  // strptime(), timegm(), memmem()
+#include "proxy.h"
+#include <time.h>
+#include <errno.h>
+
+// Shared in-memory response cache.
+// Objects are keyed by origin and path and stored as sorted, non-overlapping byte
+// segments, so a 206 for the middle of a large file is cached on its own and
+// later requests fill in the gaps. A GET whose (range of the) object is fully
+// covered by fresh segments is answered here without contacting the origin.
+// Expired objects are revalidated with their ETag/Last-Modified; within the
+// stale-while-revalidate window the stale copy is served while a background
+// thread does that, so hot objects never wait on the origin. When the object
+// has changed, the origin's 200 is kept as the new copy and, for a waiting
+// client, streamed to it as well, so a change costs one origin fetch, not two.
+
+#define CACHE_TABLE_SIZE 256
+#define CACHE_HEURISTIC_MAX_S 86400  // Cap on freshness guessed from Last-Modified
+#define CACHE_REVALIDATE_TIMEOUT_S 10
+
+enum { REVALIDATE_CURRENT, REVALIDATE_CHANGED, REVALIDATE_FAILED };
+
+typedef struct cache_segment {
+    long long start;
+    size_t len;
+    char *data;
+    atomic_int refs;       // The entry's reference plus one per client being served from it
+    struct cache_segment *next;
+} cache_segment;
+
+typedef struct cache_entry {
+    char key[384];
+    char host[128];              // Where revalidation requests go
+    int port;
+    char path[256];
+    long long total;             // Full object length
+    char *headers;               // Origin header lines replayed on hits, without framing headers
+    size_t headers_len;
+    char etag[128];
+    char last_modified[64];
+    time_t stored_at;            // Last time the origin vouched for this copy
+    time_t expires_at;
+    time_t stale_until;          // May be served stale (while refreshing) until then
+    long lifetime;               // Freshness granted at store time, reused when a 304 is silent
+    int revalidating;            // A conditional request is in flight
+    cache_segment *segments;     // Sorted by start
+    size_t bytes;
+    struct cache_entry *next;    // Hash chain
+    struct cache_entry *lru_prev, *lru_next;
+} cache_entry;
+
+struct cache_fill {
+    char key[384];
+    char host[128];
+    int port;
+    char path[256];
+    int disabled;
+    char head[BUFFER_SIZE];      // Response head until it is complete
+    size_t head_len;
+    int head_done;
+    long long start;             // Object offset of the first body byte
+    long long total;
+    char *headers;
+    size_t headers_len;
+    char etag[128];
+    char last_modified[64];
+    time_t expires_at;
+    long stale_seconds;
+    char *body;
+    size_t body_len, body_cap;
+};
+
+static cache_config config;
+static cache_entry *cache_table[CACHE_TABLE_SIZE];
+static cache_entry *lru_head, *lru_tail;   // Most recently used first
+static size_t cache_bytes = 0;
+static long cache_entries = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_long cache_hits = 0;
+static atomic_long cache_range_hits = 0;
+static atomic_long cache_misses = 0;
+static atomic_long cache_partial_misses = 0;  // Entry existed but the range had gaps
+static atomic_long cache_stores = 0;
+static atomic_long cache_evictions = 0;
+static atomic_llong cache_bytes_served = 0;
+static atomic_long cache_client_not_modified = 0;  // 304s answered from the cache
+static atomic_long cache_stale_served = 0;
+static atomic_long cache_background_refreshes = 0;
+static atomic_long cache_revalidations = 0;
+static atomic_long cache_not_modified = 0;         // Origin confirmed the stored copy
+static atomic_long cache_changed = 0;
+static atomic_long cache_revalidate_failures = 0;
+
+void cache_configure(const cache_config *cfg) {
+    config = *cfg;
+}
+
+int cache_enabled() {
+    return config.max_bytes > 0;
+}
+
+static unsigned int hash_key(const char *key) {
+    unsigned int h = 5381;
+    while (*key) h = h * 33 + (unsigned char)*key++;
+    return h % CACHE_TABLE_SIZE;
+}
+
+static void make_key(const char *host, int port, const char *path, char *key, size_t key_len) {
+    snprintf(key, key_len, "%s:%d%s", host, port, path);
+}
+
+static void copy_value(const header_field *f, char *out, size_t out_len) {
+    out[0] = '\0';
+    if (!f) return;
+    size_t n = f->value_len < out_len - 1 ? f->value_len : out_len - 1;
+    memcpy(out, f->value, n);
+    out[n] = '\0';
+}
+
+static time_t parse_http_date(const header_field *f) {
+    char value[64];
+    struct tm tm = {0};
+    copy_value(f, value, sizeof(value));
+    if (!f || !strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm)) return -1;
+    return timegm(&tm);
+}
+
+// Finds "name" or "name=value" in a comma-separated directive list; returns 1 if present
+static int cc_directive(const header_field *cc, const char *name, long long *value) {
+    if (!cc) return 0;
+    size_t name_len = strlen(name);
+    const char *p = cc->value;
+    const char *end = p + cc->value_len;
+
+    while (p < end) {
+        while (p < end && (*p == ',' || *p == ' ' || *p == '\t')) p++;
+        const char *token = p;
+        while (p < end && *p != ',' && *p != '=' && *p != ' ') p++;
+        int match = (size_t)(p - token) == name_len && strncasecmp(token, name, name_len) == 0;
+        if (match && value) *value = (p < end && *p == '=') ? strtoll(p + 1, NULL, 10) : 0;
+        while (p < end && *p != ',') p++;
+        if (match) return 1;
+    }
+    return 0;
+}
+
+// Absolute expiry per RFC 9111 4.2; returns -1 if the response must not be stored
+static time_t freshness_deadline(const header_table *t, time_t now) {
+    const header_field *cc = find_header(t, "Cache-Control");
+    long long seconds;
+
+    if (cc_directive(cc, "no-store", NULL) || cc_directive(cc, "private", NULL)) return -1;
+    if (cc_directive(cc, "no-cache", NULL)) return now;
+
+    long long age = 0;
+    const header_field *age_field = find_header(t, "Age");
+    if (age_field) age = strtoll(age_field->value, NULL, 10);
+
+    if (cc_directive(cc, "s-maxage", &seconds) || cc_directive(cc, "max-age", &seconds)) {
+        return now + seconds - age;
+    }
+
+    time_t date = parse_http_date(find_header(t, "Date"));
+    if (date < 0) date = now;
+
+    const header_field *expires = find_header(t, "Expires");
+    if (expires) {
+        time_t when = parse_http_date(expires);
+        return when < 0 ? now : now + (when - date);  // Invalid Expires means already expired
+    }
+
+    time_t modified = parse_http_date(find_header(t, "Last-Modified"));
+    if (modified > 0 && modified < date) {
+        long long guess = (date - modified) / 10;
+        return now + (guess > CACHE_HEURISTIC_MAX_S ? CACHE_HEURISTIC_MAX_S : guess);
+    }
+    return now;
+}
+
+static cache_entry *find_entry(const char *key) {
+    for (cache_entry *e = cache_table[hash_key(key)]; e; e = e->next) {
+        if (strcmp(e->key, key) == 0) return e;
+    }
+    return NULL;
+}
+
+static void lru_unlink(cache_entry *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_touch(cache_entry *e) {
+    if (lru_head == e) return;
+    if (e->lru_prev || e->lru_next || lru_tail == e) lru_unlink(e);
+    e->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = e;
+    lru_head = e;
+    if (!lru_tail) lru_tail = e;
+}
+
+static void segment_release(cache_segment *s) {
+    if (atomic_fetch_sub(&s->refs, 1) == 1) {
+        free(s->data);
+        free(s);
+    }
+}
+
+static void drop_segments(cache_entry *e) {
+    cache_segment *s = e->segments;
+    while (s) {
+        cache_segment *next = s->next;
+        cache_bytes -= s->len;
+        segment_release(s);
+        s = next;
+    }
+    e->segments = NULL;
+    e->bytes = 0;
+}
+
+static void remove_entry(cache_entry *e) {
+    cache_entry **p = &cache_table[hash_key(e->key)];
+    while (*p && *p != e) p = &(*p)->next;
+    if (*p) *p = e->next;
+
+    lru_unlink(e);
+    drop_segments(e);
+    cache_bytes -= e->headers_len;
+    free(e->headers);
+    free(e);
+    cache_entries--;
+}
+
+static void evict_until_fits(const cache_entry *keep) {
+    cache_entry *e = lru_tail;
+    while (cache_bytes > config.max_bytes && e) {
+        cache_entry *prev = e->lru_prev;
+        if (e != keep) {
+            remove_entry(e);
+            atomic_fetch_add(&cache_evictions, 1);
+        }
+        e = prev;
+    }
+}
+
+// Copy the parts of [start, start + len) not yet held by the entry into new segments
+static void insert_gaps(cache_entry *e, long long start, const char *data, size_t len) {
+    long long end = start + len;
+    cache_segment **p = &e->segments;
+    long long pos = start;
+
+    while (pos < end) {
+        while (*p && (*p)->start + (long long)(*p)->len <= pos) p = &(*p)->next;
+        long long gap_end = *p && (*p)->start < end ? (*p)->start : end;
+
+        if (gap_end > pos) {
+            cache_segment *s = malloc(sizeof(cache_segment));
+            char *copy = s ? malloc(gap_end - pos) : NULL;
+            if (!copy) {
+                free(s);
+                return;
+            }
+            memcpy(copy, data + (pos - start), gap_end - pos);
+            s->start = pos;
+            s->len = gap_end - pos;
+            s->data = copy;
+            atomic_init(&s->refs, 1);
+            s->next = *p;
+            *p = s;
+            p = &s->next;
+            e->bytes += s->len;
+            cache_bytes += s->len;
+        }
+        pos = *p ? (*p)->start + (long long)(*p)->len : end;
+    }
+}
+
+// Parses a single "bytes=" range; returns 0 if absent, 1 if parsed, -1 if not something we serve
+static int parse_range(const header_table *request, long long *first, long long *last, long long *suffix) {
+    const header_field *range = find_header(request, "Range");
+    if (!range) return 0;
+
+    char value[128];
+    copy_value(range, value, sizeof(value));
+    if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ',')) return -1;
+
+    char *p = value + 6, *dash = strchr(p, '-');
+    if (!dash) return -1;
+    *first = *last = *suffix = -1;
+    if (dash == p) {
+        *suffix = strtoll(dash + 1, NULL, 10);
+        return *suffix > 0 ? 1 : -1;
+    }
+    *first = strtoll(p, NULL, 10);
+    if (dash[1]) *last = strtoll(dash + 1, NULL, 10);
+    return (*first >= 0 && (*last < 0 || *last >= *first)) ? 1 : -1;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Feed part of a cached response through the compression stage and send what comes out.
+// With final set, the encoder is drained and finished.
+static int send_encoded(int fd, response_encoder *enc, char *out, const char *data, size_t len, int final, size_t *sent) {
+    while (1) {
+        char *stage;
+        size_t n = encoder_input_room(enc, &stage);
+        if (n > len) n = len;
+        memcpy(stage, data, n);
+        encoder_commit_input(enc, n);
+        data += n;
+        len -= n;
+
+        size_t produced = encoder_produce(enc, out, RELAY_BUFFER_SIZE, final && len == 0);
+        if (produced > 0 && !send_all(fd, out, produced)) return 0;
+        *sent += produced;
+        if (len == 0 && (!final || !encoder_pending(enc) || produced == 0)) return 1;
+    }
+}
+
+// Resolve the requested range against the entry and take a reference on every segment it needs.
+// Returns the status to answer with, or 0 when some byte of the range is missing.
+static int collect_pieces(cache_entry *e, int ranged, long long *first, long long *last, long long suffix,
+                          cache_segment ***pieces, int *count) {
+    int status = ranged ? 206 : 200;
+    *count = 0;
+    *pieces = NULL;
+    if (ranged) {
+        if (suffix > 0) {
+            *first = suffix > e->total ? 0 : e->total - suffix;
+            *last = e->total - 1;
+        } else if (*last < 0 || *last >= e->total) {
+            *last = e->total - 1;
+        }
+        if (*first >= e->total) return 416;
+    } else {
+        *first = 0;
+        *last = e->total - 1;
+    }
+
+    if (*last < *first) return status;
+
+    long long pos = *first;
+    for (cache_segment *s = e->segments; s && pos <= *last; s = s->next) {
+        if (s->start + (long long)s->len <= pos) continue;
+        if (s->start > pos) break;
+        pos = s->start + s->len;
+        (*count)++;
+    }
+    if (pos <= *last) return 0;
+
+    *pieces = malloc(*count * sizeof(cache_segment *));
+    if (!*pieces) return 0;
+    *count = 0;
+    pos = *first;
+    for (cache_segment *s = e->segments; s && pos <= *last; s = s->next) {
+        if (s->start + (long long)s->len <= pos) continue;
+        atomic_fetch_add(&s->refs, 1);  // Keeps the bytes alive if the entry is evicted meanwhile
+        (*pieces)[(*count)++] = s;
+        pos = s->start + s->len;
+    }
+    return status;
+}
+
+static void release_pieces(cache_segment **pieces, int count) {
+    for (int i = 0; i < count; i++) segment_release(pieces[i]);
+    free(pieces);
+}
+
+// Does the client's own validator already match what we hold?
+static int client_has_current(const cache_entry *e, const header_table *request) {
+    const header_field *inm = find_header(request, "If-None-Match");
+    if (inm) {
+        if (inm->value_len == 1 && inm->value[0] == '*') return 1;
+        return e->etag[0] && memmem(inm->value, inm->value_len, e->etag, strlen(e->etag)) != NULL;
+    }
+
+    const header_field *ims = find_header(request, "If-Modified-Since");
+    if (!ims || !e->last_modified[0]) return 0;
+    time_t since = parse_http_date(ims);
+    char stored[64];
+    struct tm tm = {0};
+    strcpy(stored, e->last_modified);
+    return since >= 0 && strptime(stored, "%a, %d %b %Y %H:%M:%S GMT", &tm) && timegm(&tm) <= since;
+}
+
+// Returns the head length; *got also counts any body bytes that arrived with it
+static size_t read_response_head(SSL *ssl, char *head, size_t size, size_t *got) {
+    size_t len = 0;
+    while (len < size - 1) {
+        int n = SSL_read(ssl, head + len, size - 1 - len);
+        if (n <= 0) return 0;
+        len += n;
+        head[len] = '\0';
+        const char *end = strstr(head, "\r\n\r\n");
+        if (end) {
+            *got = len;
+            return end + 4 - head;
+        }
+    }
+    return 0;
+}
+
+// Store a changed object's 200 without a client to relay it to; returns 1 if the origin finished it
+static int drain_into_fill(SSL *ssl, cache_fill *f, const char *head, size_t got) {
+    cache_fill_append(f, head, got);
+    char buf[BUFFER_SIZE];
+    int n = 0;
+    while (!f->disabled && f->body_len < config.max_object_bytes && (n = SSL_read(ssl, buf, sizeof(buf))) > 0) {
+        cache_fill_append(f, buf, n);
+    }
+    return !f->disabled && f->body_len < config.max_object_bytes && SSL_get_error(ssl, n) == SSL_ERROR_ZERO_RETURN;
+}
+
+// Fold the origin's answer to a conditional GET into the entry it was asked about
+static int apply_revalidation(const char *key, const char *head, size_t head_len, const char *etag,
+                              const char *last_modified) {
+    header_table t;
+    int status = 0;
+    if (sscanf(head, "HTTP/1.%*d %d", &status) != 1 || !parse_headers(head, head_len, &t)) return REVALIDATE_FAILED;
+    if (status != 304 && status != 200) return REVALIDATE_FAILED;  // Keep the stale copy through origin errors
+
+    // An origin that ignores conditionals answers 200, but unchanged validators still vouch for our copy
+    char new_etag[128], new_modified[64];
+    copy_value(find_header(&t, "ETag"), new_etag, sizeof(new_etag));
+    copy_value(find_header(&t, "Last-Modified"), new_modified, sizeof(new_modified));
+    int current = status == 304 || (etag[0] ? strcmp(new_etag, etag) == 0
+                                            : last_modified[0] && strcmp(new_modified, last_modified) == 0);
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&cache_lock);
+    cache_entry *e = find_entry(key);
+    if (e && strcmp(e->etag, etag) == 0 && strcmp(e->last_modified, last_modified) == 0) {
+        time_t expires = -1;
+        if (current) {
+            // Headers on the 304 replace the stored ones; without any, the original lifetime repeats
+            int explicit = find_header(&t, "Cache-Control") || find_header(&t, "Expires");
+            expires = explicit ? freshness_deadline(&t, now) : now + e->lifetime;
+        }
+        if (expires < 0) {
+            remove_entry(e);
+            current = 0;
+        } else {
+            e->stale_until = expires + (e->stale_until - e->expires_at);
+            e->expires_at = expires;
+            e->stored_at = now;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return current ? REVALIDATE_CURRENT : REVALIDATE_CHANGED;
+}
+
+// Ask the origin whether the stored object is still current, sending only its validators.
+// With a client_fd, a changed object is relayed to that client and *served is set to the
+// status to log; without one it is only stored.
+static int revalidate(const char *key, int client_fd, int encoding, size_t *sent, int *served) {
+    char host[128], path[256], etag[128], last_modified[64];
+    int port;
+
+    pthread_mutex_lock(&cache_lock);
+    cache_entry *e = find_entry(key);
+    if (!e) {
+        pthread_mutex_unlock(&cache_lock);
+        return REVALIDATE_CHANGED;
+    }
+    strcpy(host, e->host);
+    strcpy(path, e->path);
+    strcpy(etag, e->etag);
+    strcpy(last_modified, e->last_modified);
+    port = e->port;
+    pthread_mutex_unlock(&cache_lock);
+
+    char request[BUFFER_SIZE];
+    int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n", path, host);
+    if (etag[0]) len += snprintf(request + len, sizeof(request) - len, "If-None-Match: %s\r\n", etag);
+    if (last_modified[0]) len += snprintf(request + len, sizeof(request) - len, "If-Modified-Since: %s\r\n", last_modified);
+    len += snprintf(request + len, sizeof(request) - len, "User-Agent: MyProxy/1.0\r\nConnection: close\r\n\r\n");
+
+    int outcome = REVALIDATE_FAILED;
+    int origin_slot = upstream_acquire(host, port);
+    if (origin_slot != UPSTREAM_REJECTED) {
+        int server_fd;
+        SSL *ssl = NULL;
+        SSL_CTX *ssl_ctx = NULL;
+        if (connect_to_server(host, port, &server_fd, &ssl, &ssl_ctx, config.allow_untrusted)) {
+            struct timeval timeout = { CACHE_REVALIDATE_TIMEOUT_S, 0 };
+            setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+            char head[BUFFER_SIZE];
+            size_t got = 0;
+            struct iovec iov = { request, len };
+            size_t head_len = send_upstream_request(server_fd, ssl, &iov, 1) ? read_response_head(ssl, head, sizeof(head), &got) : 0;
+            if (head_len > 0) outcome = apply_revalidation(key, head, head_len, etag, last_modified);
+
+            // The 200 that says the object changed is the new object; keep it instead of fetching it again
+            cache_fill *fill = outcome == REVALIDATE_CHANGED ? cache_fill_begin(host, port, path) : NULL;
+            if (fill) {
+                int ok;
+                if (client_fd >= 0) {
+                    *sent = relay_response(client_fd, server_fd, ssl, head, got, 0, NULL, fill, NULL, encoding, -1, &ok);
+                    *served = ok ? 200 : 502;
+                } else {
+                    ok = drain_into_fill(ssl, fill, head, got);
+                }
+                cache_fill_end(fill, ok);
+            }
+
+            SSL_free(ssl);
+            SSL_CTX_free(ssl_ctx);
+            close(server_fd);
+        }
+        upstream_release(origin_slot);
+    }
+
+    atomic_fetch_add(&cache_revalidations, 1);
+    if (outcome == REVALIDATE_CURRENT) atomic_fetch_add(&cache_not_modified, 1);
+    else if (outcome == REVALIDATE_CHANGED) atomic_fetch_add(&cache_changed, 1);
+    else atomic_fetch_add(&cache_revalidate_failures, 1);
+    LOG_DEBUG("Revalidated %s: %s", key, outcome == REVALIDATE_CURRENT ? "not modified"
+                                         : outcome == REVALIDATE_CHANGED ? "changed" : "failed");
+    return outcome;
+}
+
+static void *background_refresh(void *arg) {
+    char *key = arg;
+    revalidate(key, -1, ENCODING_IDENTITY, NULL, NULL);
+
+    pthread_mutex_lock(&cache_lock);
+    cache_entry *e = find_entry(key);
+    if (e) e->revalidating = 0;
+    pthread_mutex_unlock(&cache_lock);
+    free(key);
+    return NULL;
+}
+
+// Called with cache_lock held; at most one refresh per entry is in flight
+static void start_background_refresh(cache_entry *e) {
+    if (e->revalidating) return;
+
+    char *key = strdup(e->key);
+    pthread_t thread;
+    if (!key || pthread_create(&thread, NULL, background_refresh, key) != 0) {
+        free(key);
+        return;
+    }
+    pthread_detach(thread);
+    e->revalidating = 1;
+    atomic_fetch_add(&cache_background_refreshes, 1);
+}
+
+int cache_serve(const char *host, int port, const char *path, const header_table *request, int encoding,
+                int client_fd, size_t *sent) {
+    *sent = 0;
+    if (!cache_enabled()) return 0;
+
+    // A client asking for a reload, or for a range only if it still matches, goes to the origin
+    long long max_age;
+    const header_field *cc = find_header(request, "Cache-Control");
+    if (cc_directive(cc, "no-cache", NULL) || (cc_directive(cc, "max-age", &max_age) && max_age == 0) ||
+        find_header(request, "Pragma") || find_header(request, "If-Range")) {
+        atomic_fetch_add(&cache_misses, 1);
+        return 0;
+    }
+
+    long long first, last, suffix;
+    int ranged = parse_range(request, &first, &last, &suffix);
+    if (ranged < 0) return 0;  // Multi-range and odd ranges go to the origin
+
+    char key[384];
+    make_key(host, port, path, key, sizeof(key));
+
+    cache_entry *e;
+    cache_segment **pieces;
+    int count, status;
+    long long range_first = first, range_last = last;
+    for (int attempt = 0;; attempt++) {
+        first = range_first;
+        last = range_last;
+        time_t now = time(NULL);
+
+        pthread_mutex_lock(&cache_lock);
+        e = find_entry(key);
+        if (!e) {
+            pthread_mutex_unlock(&cache_lock);
+            atomic_fetch_add(&cache_misses, 1);
+            return 0;
+        }
+
+        // Every byte of the range must be on hand, or the origin serves it
+        status = collect_pieces(e, ranged, &first, &last, suffix, &pieces, &count);
+        if (!status) {
+            pthread_mutex_unlock(&cache_lock);
+            atomic_fetch_add(&cache_partial_misses, 1);
+            return 0;
+        }
+        if (now < e->expires_at) break;
+
+        if (now < e->stale_until) {
+            // Within the stale-while-revalidate window: answer now, refresh behind the client's back
+            start_background_refresh(e);
+            atomic_fetch_add(&cache_stale_served, 1);
+            break;
+        }
+
+        // Too stale to serve: confirm with the origin first, unless another client already is
+        release_pieces(pieces, count);
+        int can_revalidate = attempt == 0 && !e->revalidating && (e->etag[0] || e->last_modified[0]);
+        if (can_revalidate) e->revalidating = 1;
+        pthread_mutex_unlock(&cache_lock);
+        if (!can_revalidate) {
+            atomic_fetch_add(&cache_misses, 1);
+            return 0;
+        }
+
+        int served = 0;
+        int outcome = revalidate(key, client_fd, encoding, sent, &served);
+        pthread_mutex_lock(&cache_lock);
+        e = find_entry(key);
+        if (e) e->revalidating = 0;
+        pthread_mutex_unlock(&cache_lock);
+        if (outcome != REVALIDATE_CURRENT) {
+            atomic_fetch_add(&cache_misses, 1);
+            return served;  // Nonzero once the changed object went to the client straight from the revalidation
+        }
+    }
+
+    time_t now = time(NULL);
+    char head[BUFFER_SIZE];
+    int head_len;
+    if (status != 416 && client_has_current(e, request)) {
+        // The client's copy is current: a bodiless 304 is all it needs
+        release_pieces(pieces, count);
+        pieces = NULL;
+        count = 0;
+        status = 304;
+        head_len = snprintf(head, sizeof(head), "HTTP/1.1 304 Not Modified\r\n%s%s%s%s%s%sAge: %lld\r\nConnection: close\r\n\r\n",
+                            e->etag[0] ? "ETag: " : "", e->etag, e->etag[0] ? "\r\n" : "",
+                            e->last_modified[0] ? "Last-Modified: " : "", e->last_modified, e->last_modified[0] ? "\r\n" : "",
+                            (long long)(now - e->stored_at));
+    } else if (status == 416) {
+        head_len = snprintf(head, sizeof(head), "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\n"
+                            "Content-Length: 0\r\nConnection: close\r\n\r\n", e->total);
+    } else {
+        head_len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\n%.*sAge: %lld\r\nAccept-Ranges: bytes\r\nContent-Length: %lld\r\n",
+                            status == 206 ? "206 Partial Content" : "200 OK",
+                            (int)e->headers_len, e->headers, (long long)(now - e->stored_at), last - first + 1);
+        if (status == 206 && head_len > 0 && (size_t)head_len < sizeof(head)) {
+            head_len += snprintf(head + head_len, sizeof(head) - head_len, "Content-Range: bytes %lld-%lld/%lld\r\n",
+                                 first, last, e->total);
+        }
+        if (head_len > 0 && (size_t)head_len < sizeof(head)) {
+            head_len += snprintf(head + head_len, sizeof(head) - head_len, "Connection: close\r\n\r\n");
+        }
+    }
+    lru_touch(e);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (head_len <= 0 || (size_t)head_len >= sizeof(head)) {
+        // Stored headers too large to replay; let the origin answer
+        release_pieces(pieces, count);
+        return 0;
+    }
+
+    // Full hits go through the same compression stage as origin responses; the encoder decides from the head
+    response_encoder *enc = status == 200 && encoding != ENCODING_IDENTITY ? encoder_create(encoding) : NULL;
+    char *out = enc ? malloc(RELAY_BUFFER_SIZE) : NULL;
+    if (!out) {
+        encoder_destroy(enc);
+        enc = NULL;
+    }
+
+    int ok = enc ? send_encoded(client_fd, enc, out, head, head_len, 0, sent) : send_all(client_fd, head, head_len);
+    if (!enc) *sent = head_len;
+    long long pos = first;
+    for (int i = 0; i < count; i++) {
+        cache_segment *s = pieces[i];
+        long long from = pos - s->start;
+        long long to = (last + 1 < s->start + (long long)s->len ? last + 1 : s->start + (long long)s->len) - s->start;
+        if (ok && enc) {
+            ok = send_encoded(client_fd, enc, out, s->data + from, to - from, 0, sent);
+        } else if (ok) {
+            ok = send_all(client_fd, s->data + from, to - from);
+            if (ok) *sent += to - from;
+        }
+        pos = s->start + to;
+    }
+    if (ok && enc) ok = send_encoded(client_fd, enc, out, NULL, 0, 1, sent);
+    release_pieces(pieces, count);
+    encoder_destroy(enc);
+    free(out);
+
+    if (status == 304) atomic_fetch_add(&cache_client_not_modified, 1);
+    else atomic_fetch_add(status == 200 ? &cache_hits : &cache_range_hits, 1);
+    atomic_fetch_add(&cache_bytes_served, *sent);
+    return status;
+}
+
+cache_fill *cache_fill_begin(const char *host, int port, const char *path) {
+    if (!cache_enabled()) return NULL;
+    cache_fill *f = calloc(1, sizeof(cache_fill));
+    if (!f) return NULL;
+    make_key(host, port, path, f->key, sizeof(f->key));
+    snprintf(f->host, sizeof(f->host), "%s", host);
+    snprintf(f->path, sizeof(f->path), "%s", path);
+    f->port = port;
+    return f;
+}
+
+// Decide from the origin's response head whether, and where, its body goes in the cache
+static void inspect_response(cache_fill *f, size_t head_len) {
+    header_table t;
+    f->disabled = 1;
+    if (!parse_headers(f->head, head_len, &t)) return;
+
+    int status = 0;
+    if (sscanf(f->head, "HTTP/1.%*d %d", &status) != 1) return;
+    if (find_header(&t, "Set-Cookie") || find_header(&t, "Transfer-Encoding")) return;
+
+    const header_field *encoding = find_header(&t, "Content-Encoding");
+    if (encoding && !(encoding->value_len == 8 && strncasecmp(encoding->value, "identity", 8) == 0)) return;
+
+    const header_field *vary = find_header(&t, "Vary");
+    if (vary && !(vary->value_len == 15 && strncasecmp(vary->value, "Accept-Encoding", 15) == 0)) return;
+
+    time_t now = time(NULL);
+    f->expires_at = freshness_deadline(&t, now);
+    if (f->expires_at < 0) return;
+
+    // The origin may widen the stale window; must-revalidate closes it
+    const header_field *cc = find_header(&t, "Cache-Control");
+    long long stale;
+    if (cc_directive(cc, "must-revalidate", NULL) || cc_directive(cc, "proxy-revalidate", NULL) ||
+        cc_directive(cc, "no-cache", NULL)) f->stale_seconds = 0;
+    else if (cc_directive(cc, "stale-while-revalidate", &stale)) f->stale_seconds = stale;
+    else f->stale_seconds = config.stale_while_revalidate_s;
+
+    if (status == 200) {
+        const header_field *length = find_header(&t, "Content-Length");
+        f->start = 0;
+        f->total = length ? strtoll(length->value, NULL, 10) : -1;  // Unknown until the origin closes
+    } else if (status == 206) {
+        char range[128];
+        copy_value(find_header(&t, "Content-Range"), range, sizeof(range));
+        long long last;
+        if (sscanf(range, "bytes %lld-%lld/%lld", &f->start, &last, &f->total) != 3) return;
+    } else {
+        return;
+    }
+
+    // Keep end-to-end headers for replay; framing is rebuilt for every hit
+    static const char *skipped[] = { "Content-Length", "Content-Range", "Connection", "Keep-Alive",
+                                     "Age", "Accept-Ranges", "Proxy-Connection", NULL };
+    f->headers = malloc(head_len);
+    if (!f->headers) return;
+    for (int i = 0; i < t.count; i++) {
+        const header_field *field = &t.fields[i];
+        int skip = 0;
+        for (int j = 0; skipped[j] && !skip; j++) {
+            skip = field->name_len == strlen(skipped[j]) && strncasecmp(field->name, skipped[j], field->name_len) == 0;
+        }
+        if (skip) continue;
+        memcpy(f->headers + f->headers_len, field->line, field->line_len);
+        f->headers_len += field->line_len;
+    }
+    copy_value(find_header(&t, "ETag"), f->etag, sizeof(f->etag));
+    copy_value(find_header(&t, "Last-Modified"), f->last_modified, sizeof(f->last_modified));
+    f->disabled = 0;
+}
+
+static void append_body(cache_fill *f, const char *data, size_t len) {
+    // Past the per-object cap the prefix we have is still a useful segment
+    if (f->body_len + len > config.max_object_bytes) len = config.max_object_bytes - f->body_len;
+    if (len == 0) return;
+
+    if (f->body_len + len > f->body_cap) {
+        size_t cap = f->body_cap ? f->body_cap * 2 : 64 * 1024;
+        while (cap < f->body_len + len) cap *= 2;
+        if (cap > config.max_object_bytes) cap = config.max_object_bytes;
+        char *body = realloc(f->body, cap);
+        if (!body) {
+            f->disabled = 1;
+            return;
+        }
+        f->body = body;
+        f->body_cap = cap;
+    }
+    memcpy(f->body + f->body_len, data, len);
+    f->body_len += len;
+}
+
+void cache_fill_append(cache_fill *f, const char *data, size_t len) {
+    if (f->disabled) return;
+
+    if (!f->head_done) {
+        size_t take = len < sizeof(f->head) - f->head_len ? len : sizeof(f->head) - f->head_len;
+        memcpy(f->head + f->head_len, data, take);
+        size_t scan_from = f->head_len > 3 ? f->head_len - 3 : 0;
+        f->head_len += take;
+
+        const char *end = memmem(f->head + scan_from, f->head_len - scan_from, "\r\n\r\n", 4);
+        if (!end) {
+            if (f->head_len == sizeof(f->head)) f->disabled = 1;  // Head too large to keep
+            return;
+        }
+
+        size_t head_len = end + 4 - f->head;
+        f->head_done = 1;
+        inspect_response(f, head_len);
+        if (f->disabled) return;
+
+        // Whatever followed the head in this read is body
+        size_t body_in_head = f->head_len - head_len;
+        append_body(f, f->head + head_len, body_in_head);
+        append_body(f, data + take, len - take);
+        return;
+    }
+    append_body(f, data, len);
+}
+
+void cache_fill_end(cache_fill *f, int complete) {
+    if (!f) return;
+
+    // A close-delimited body only has a known length if it arrived in full
+    if (f->total < 0 && complete && f->body_len < config.max_object_bytes) f->total = f->body_len;
+
+    if (!f->disabled && f->head_done && f->total >= 0 && f->start + (long long)f->body_len <= f->total &&
+        (f->body_len > 0 || f->total == 0) && f->body_len + f->headers_len <= config.max_bytes) {
+        pthread_mutex_lock(&cache_lock);
+        cache_entry *e = find_entry(f->key);
+        if (e && (e->total != f->total || strcmp(e->etag, f->etag) != 0 ||
+                  strcmp(e->last_modified, f->last_modified) != 0)) {
+            drop_segments(e);  // The object changed at the origin; old pieces no longer fit together
+        }
+        if (!e) {
+            e = calloc(1, sizeof(cache_entry));
+            if (e) {
+                memcpy(e->key, f->key, sizeof(e->key));
+                memcpy(e->host, f->host, sizeof(e->host));
+                memcpy(e->path, f->path, sizeof(e->path));
+                e->port = f->port;
+                unsigned int slot = hash_key(e->key);
+                e->next = cache_table[slot];
+                cache_table[slot] = e;
+                cache_entries++;
+            }
+        }
+
+        if (e) {
+            // The newest response's metadata wins
+            cache_bytes += f->headers_len;
+            cache_bytes -= e->headers_len;
+            free(e->headers);
+            e->headers = f->headers;
+            e->headers_len = f->headers_len;
+            f->headers = NULL;
+            e->total = f->total;
+            strcpy(e->etag, f->etag);
+            strcpy(e->last_modified, f->last_modified);
+            e->stored_at = time(NULL);
+            e->expires_at = f->expires_at;
+            e->stale_until = f->expires_at + f->stale_seconds;
+            e->lifetime = f->expires_at - e->stored_at;
+
+            insert_gaps(e, f->start, f->body, f->body_len);
+            lru_touch(e);
+            evict_until_fits(e);
+            atomic_fetch_add(&cache_stores, 1);
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+
+    free(f->headers);
+    free(f->body);
+    free(f);
+}
+
+void print_cache_stats(FILE *out) {
+    pthread_mutex_lock(&cache_lock);
+    fprintf(out, "cache: max_bytes=%zu bytes=%zu entries=%ld hits=%ld range_hits=%ld misses=%ld partial_misses=%ld stores=%ld evictions=%ld bytes_served=%lld\n",
+            config.max_bytes, cache_bytes, cache_entries, atomic_load(&cache_hits), atomic_load(&cache_range_hits),
+            atomic_load(&cache_misses), atomic_load(&cache_partial_misses), atomic_load(&cache_stores),
+            atomic_load(&cache_evictions), atomic_load(&cache_bytes_served));
+    fprintf(out, "  revalidation: swr_s=%d client_304=%ld stale_served=%ld background=%ld requests=%ld not_modified=%ld changed=%ld failed=%ld\n",
+            config.stale_while_revalidate_s, atomic_load(&cache_client_not_modified), atomic_load(&cache_stale_served),
+            atomic_load(&cache_background_refreshes), atomic_load(&cache_revalidations), atomic_load(&cache_not_modified),
+            atomic_load(&cache_changed), atomic_load(&cache_revalidate_failures));
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,276 @@
+#define _GNU_SOURCE  // memmem()
+#include "proxy.h"
+#include <stdatomic.h>
+#include <errno.h>
+
+// In-flight request coalescing.
+// The first GET for a cache key becomes the leader and fetches from the origin.
+// Identical GETs that arrive while it is running attach as followers and replay
+// the leader's bytes from a shared ring, each at its own offset. The ring starts
+// small and grows with the response up to COALESCE_MAX_BYTES; after that the
+// leader overwrites the oldest bytes and never waits for followers. A follower
+// that falls a full ring behind detaches and continues with a range request for
+// the rest of the same body, never with a second full response.
+
+#define FLIGHT_TABLE_SIZE 64
+
+static flight *flight_table[FLIGHT_TABLE_SIZE];
+static pthread_mutex_t flight_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_long coalesce_leaders = 0;
+static atomic_long coalesce_followers = 0;   // origin fetches saved
+static atomic_long coalesce_fallbacks = 0;   // followers that had to fetch on their own
+
+static unsigned int hash_key(const char *key) {
+    unsigned int h = 5381;
+    while (*key) h = h * 33 + (unsigned char)*key++;
+    return h % FLIGHT_TABLE_SIZE;
+}
+
+void make_cache_key(const char *host, const char *path, const header_table *request, char *key, size_t key_len) {
+    // The origin may encode differently per Accept-Encoding, so it is part of the key
+    const header_field *accept = find_header(request, "Accept-Encoding");
+    snprintf(key, key_len, "%s%s\n%.*s", host, path, accept ? (int)accept->value_len : 0, accept ? accept->value : "");
+}
+
+// Remove a flight from the table so no new followers can attach. Caller must not hold f->lock.
+static void unpublish_flight(flight *f) {
+    pthread_mutex_lock(&flight_table_lock);
+    flight **p = &flight_table[hash_key(f->key)];
+    while (*p) {
+        if (*p == f) {
+            *p = f->next;
+            break;
+        }
+        p = &(*p)->next;
+    }
+    f->next = NULL;
+    pthread_mutex_unlock(&flight_table_lock);
+}
+
+flight *coalesce_join(const char *key, int *is_leader) {
+    *is_leader = 0;
+    unsigned int slot = hash_key(key);
+
+    pthread_mutex_lock(&flight_table_lock);
+    for (flight *f = flight_table[slot]; f; f = f->next) {
+        if (strcmp(f->key, key) != 0) continue;
+
+        pthread_mutex_lock(&f->lock);
+        int joinable = !f->done && f->len <= f->cap;  // The start of the response is still held
+        if (joinable) f->refs++;
+        pthread_mutex_unlock(&f->lock);
+        pthread_mutex_unlock(&flight_table_lock);
+
+        if (!joinable) return NULL;  // Too far along to replay, fetch privately
+        atomic_fetch_add(&coalesce_followers, 1);
+        return f;
+    }
+
+    flight *f = calloc(1, sizeof(flight));
+    char *data = f ? malloc(COALESCE_MIN_BYTES) : NULL;
+    if (!data) {
+        free(f);
+        pthread_mutex_unlock(&flight_table_lock);
+        return NULL;
+    }
+
+    strncpy(f->key, key, sizeof(f->key) - 1);
+    f->data = data;
+    f->cap = COALESCE_MIN_BYTES;
+    f->refs = 1;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    f->next = flight_table[slot];
+    flight_table[slot] = f;
+    pthread_mutex_unlock(&flight_table_lock);
+
+    atomic_fetch_add(&coalesce_leaders, 1);
+    *is_leader = 1;
+    return f;
+}
+
+// Copy ring bytes [from, from + len) out; the caller holds f->lock and has checked they are still held
+static void ring_read(const flight *f, size_t from, char *out, size_t len) {
+    size_t pos = from % f->cap;
+    size_t first = len < f->cap - pos ? len : f->cap - pos;
+    memcpy(out, f->data + pos, first);
+    memcpy(out + first, f->data, len - first);
+}
+
+static void ring_write(flight *f, const char *buf, size_t len) {
+    if (len > f->cap) {
+        // Only the newest cap bytes can be held
+        buf += len - f->cap;
+        f->len += len - f->cap;
+        len = f->cap;
+    }
+    size_t pos = f->len % f->cap;
+    size_t first = len < f->cap - pos ? len : f->cap - pos;
+    memcpy(f->data + pos, buf, first);
+    memcpy(f->data, buf + first, len - first);
+    f->len += len;
+}
+
+void coalesce_append(flight *f, const char *buf, size_t len) {
+    pthread_mutex_lock(&f->lock);
+    int was_whole = f->len <= f->cap;
+
+    if (!f->head_len && f->len < sizeof(f->head)) {
+        // Keep the head for coalesce_resume_point; one too large to copy simply cannot be resumed
+        size_t n = sizeof(f->head) - f->len < len ? sizeof(f->head) - f->len : len;
+        memcpy(f->head + f->len, buf, n);
+        const char *end = memmem(f->head, f->len + n, "\r\n\r\n", 4);
+        if (end) f->head_len = end + 4 - f->head;
+    }
+
+    // Grow while the ring has never wrapped, so byte offsets keep their positions
+    if (was_whole && f->len + len > f->cap && f->cap < COALESCE_MAX_BYTES) {
+        size_t cap = f->cap * 2 > f->len + len ? f->cap * 2 : f->len + len;
+        if (cap > COALESCE_MAX_BYTES) cap = COALESCE_MAX_BYTES;
+        char *data = realloc(f->data, cap);
+        if (data) {
+            f->data = data;
+            f->cap = cap;
+        }
+    }
+
+    ring_write(f, buf, len);
+    int wrapped = was_whole && f->len > f->cap;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+
+    // The start of the response is gone, so later requests need a flight of their own
+    if (wrapped) unpublish_flight(f);
+}
+
+void coalesce_release(flight *f) {
+    pthread_mutex_lock(&f->lock);
+    int refs = --f->refs;
+    pthread_mutex_unlock(&f->lock);
+
+    if (refs == 0) {
+        pthread_mutex_destroy(&f->lock);
+        pthread_cond_destroy(&f->cond);
+        free(f->data);
+        free(f);
+    }
+}
+
+// Whether the bytes seen end where the response's own framing says it ends; caller holds f->lock
+static int body_complete(const flight *f) {
+    if (!f->head_len) return 0;
+
+    header_table t;
+    if (!parse_headers(f->head, f->head_len, &t)) return 0;
+    const header_field *te = find_header(&t, "Transfer-Encoding");
+    if (te) {
+        // A chunked body ends with the zero-length chunk and the blank line after it
+        char tail[5];
+        if (f->len < f->head_len + sizeof(tail)) return 0;
+        ring_read(f, f->len - sizeof(tail), tail, sizeof(tail));
+        return memcmp(tail, "0\r\n\r\n", sizeof(tail)) == 0;
+    }
+    const header_field *length = find_header(&t, "Content-Length");
+    if (!length) return 1;  // Close-delimited: the origin's close is the end
+    return f->len == f->head_len + strtoull(length->value, NULL, 10);
+}
+
+void coalesce_finish(flight *f, int ok) {
+    unpublish_flight(f);
+
+    pthread_mutex_lock(&f->lock);
+    f->done = 1;
+    // An origin that drops the connection early still ends the relay cleanly
+    f->failed = !ok || !body_complete(f);
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+
+    coalesce_release(f);
+}
+
+size_t coalesce_follow(flight *f, int client_fd, int *complete) {
+    size_t offset = 0;
+    *complete = 0;
+
+    // Bytes are copied out under the lock, since the leader may overwrite them as soon as it is released
+    char *chunk = malloc(RELAY_BUFFER_SIZE);
+    if (!chunk) return 0;
+
+    while (1) {
+        pthread_mutex_lock(&f->lock);
+        while (offset == f->len && !f->done) {
+            pthread_cond_wait(&f->cond, &f->lock);
+        }
+        int lagged = f->len - offset > f->cap;
+        size_t n = 0;
+        if (!lagged) {
+            n = f->len - offset < RELAY_BUFFER_SIZE ? f->len - offset : RELAY_BUFFER_SIZE;
+            ring_read(f, offset, chunk, n);
+        }
+        int last = f->done && offset + n == f->len;
+        int failed = f->failed;
+        pthread_mutex_unlock(&f->lock);
+
+        if (lagged) {
+            // Fell a full ring behind the leader
+            atomic_fetch_add(&coalesce_fallbacks, 1);
+            break;
+        }
+
+        size_t at = 0;
+        while (at < n) {
+            ssize_t sent = send(client_fd, chunk + at, n - at, 0);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) {
+                *complete = 1;  // Client went away, nothing left to deliver
+                free(chunk);
+                return offset + at;
+            }
+            at += sent;
+        }
+        offset += n;
+
+        if (last) {
+            if (failed) atomic_fetch_add(&coalesce_fallbacks, 1);
+            else *complete = 1;
+            break;
+        }
+    }
+
+    free(chunk);
+    return offset;
+}
+
+// Only a 200 with a known length and a strong validator can be continued byte for byte
+int coalesce_resume_point(flight *f, size_t sent, resume_point *resume) {
+    // The head copy is complete once head_len is set and never changes after that
+    pthread_mutex_lock(&f->lock);
+    size_t head_len = f->head_len;
+    pthread_mutex_unlock(&f->lock);
+    if (!head_len || sent < head_len) return 0;  // The client holds part of the head; nothing can follow it
+
+    header_table t;
+    int status = 0;
+    if (sscanf(f->head, "HTTP/1.%*d %d", &status) != 1 || status != 200) return 0;
+    if (!parse_headers(f->head, head_len, &t) || find_header(&t, "Transfer-Encoding")) return 0;
+
+    const header_field *length = find_header(&t, "Content-Length");
+    const header_field *validator = find_header(&t, "ETag");
+    if (validator && validator->value_len >= 2 && strncmp(validator->value, "W/", 2) == 0) return 0;
+    if (!validator) validator = find_header(&t, "Last-Modified");
+    if (!length || !validator || validator->value_len >= sizeof(resume->validator)) return 0;
+
+    resume->total = strtoll(length->value, NULL, 10);
+    resume->body_offset = sent - head_len;
+    memcpy(resume->validator, validator->value, validator->value_len);
+    resume->validator[validator->value_len] = '\0';
+    return resume->body_offset <= resume->total;
+}
+
+void print_coalesce_stats(FILE *out) {
+    fprintf(out, "coalesce: leaders=%ld followers=%ld fallbacks=%ld origin_fetches_saved=%ld\n",
+            atomic_load(&coalesce_leaders), atomic_load(&coalesce_followers),
+            atomic_load(&coalesce_fallbacks),
+            atomic_load(&coalesce_followers) - atomic_load(&coalesce_fallbacks));
+}
@@ -0,0 +1,318 @@
+#define _GNU_SOURCE  // memmem()
+#include "proxy.h"
+#include <stdatomic.h>
+#include <time.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+// On-the-fly response compression.
+// The encoder sits between the upstream read and the relay buffer. It holds the
+// response head until it is complete, decides from the headers whether the body
+// is worth compressing, rewrites the head (Content-Encoding, Vary, weak ETag, no
+// Content-Length) and then streams the body through gzip or brotli. Responses it
+// will not touch pass through unchanged.
+
+#define ENCODER_STAGE_SIZE RELAY_BUFFER_SIZE
+
+typedef enum { ENC_HEADERS, ENC_BODY, ENC_PASSTHROUGH } encoder_state;
+
+struct response_encoder {
+    int encoding;
+    encoder_state state;
+    char in[ENCODER_STAGE_SIZE];    // Upstream bytes not yet encoded
+    size_t in_head, in_tail;
+    char head[BUFFER_SIZE];         // Rewritten response head awaiting the relay buffer
+    size_t head_off, head_len;
+    z_stream z;
+    BrotliEncoderState *br;
+    int finished;
+    long long cpu_ns;
+    size_t body_in, body_out;
+};
+
+static compress_config config;
+
+static atomic_long compressed_gzip = 0;
+static atomic_long compressed_br = 0;
+static atomic_long compress_skipped = 0;     // Offered an encoding but not compressible
+static atomic_llong compress_bytes_in = 0;
+static atomic_llong compress_bytes_out = 0;
+static atomic_llong compress_cpu_ns = 0;
+
+static const char *compressible_types[] = {
+    "text/", "application/json", "application/javascript", "application/xml",
+    "application/xhtml+xml", "application/rss+xml", "image/svg+xml", NULL
+};
+
+void compress_configure(const compress_config *cfg) {
+    config = *cfg;
+}
+
+static long long thread_cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Does the Accept-Encoding list offer this coding with a non-zero q-value?
+static int offers_coding(const header_field *accept, const char *coding) {
+    size_t coding_len = strlen(coding);
+    const char *p = accept->value;
+    const char *end = p + accept->value_len;
+
+    while (p < end) {
+        while (p < end && (*p == ',' || *p == ' ' || *p == '\t')) p++;
+        const char *token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        int match = (size_t)(p - token) == coding_len && strncasecmp(token, coding, coding_len) == 0;
+
+        // q=0, q=0.0, q=0.00 ... mean "not acceptable"
+        int refused = 0;
+        const char *params = p;
+        while (p < end && *p != ',') p++;
+        const char *q = memmem(params, p - params, "q=", 2);
+        if (q) {
+            refused = q[2] == '0';
+            for (const char *d = q + 3; refused && d < p && *d != ' ' && *d != ';'; d++) {
+                if (*d != '.' && *d != '0') refused = 0;
+            }
+        }
+        if (match) return !refused;
+    }
+    return 0;
+}
+
+int choose_encoding(const header_table *request) {
+    if (config.level <= 0) return ENCODING_IDENTITY;
+
+    const header_field *accept = find_header(request, "Accept-Encoding");
+    if (!accept) return ENCODING_IDENTITY;
+    if (offers_coding(accept, "br")) return ENCODING_BROTLI;
+    if (offers_coding(accept, "gzip")) return ENCODING_GZIP;
+    return ENCODING_IDENTITY;
+}
+
+static int is_compressible_type(const header_field *type) {
+    if (!type) return 0;
+    for (int i = 0; compressible_types[i]; i++) {
+        size_t len = strlen(compressible_types[i]);
+        if (type->value_len >= len && strncasecmp(type->value, compressible_types[i], len) == 0) return 1;
+    }
+    return 0;
+}
+
+static int should_compress(const char *status_line, const header_table *table) {
+    // Only full 200 responses: partial content and errors are left alone
+    if (strncmp(status_line, "HTTP/1.", 7) != 0 || strncmp(status_line + 8, " 200", 4) != 0) return 0;
+    if (find_header(table, "Content-Encoding") || find_header(table, "Content-Range")) return 0;
+    if (find_header(table, "Transfer-Encoding")) return 0;  // Chunked bodies are relayed as-is
+    if (!is_compressible_type(find_header(table, "Content-Type"))) return 0;
+
+    const header_field *cache_control = find_header(table, "Cache-Control");
+    if (cache_control && memmem(cache_control->value, cache_control->value_len, "no-transform", 12)) return 0;
+
+    const header_field *length = find_header(table, "Content-Length");
+    if (length && strtoll(length->value, NULL, 10) < config.min_bytes) return 0;
+    return 1;
+}
+
+static int append(char *buf, size_t cap, size_t *len, const char *data, size_t n) {
+    if (*len + n > cap) return 0;
+    memcpy(buf + *len, data, n);
+    *len += n;
+    return 1;
+}
+
+// Rebuild the response head for the encoded body; returns 0 if it does not fit
+static int rewrite_head(response_encoder *e, const char *status_line, size_t status_len, const header_table *table) {
+    size_t len = 0;
+    const header_field *vary = NULL;
+    int ok = append(e->head, sizeof(e->head), &len, status_line, status_len);
+
+    for (int i = 0; ok && i < table->count; i++) {
+        const header_field *f = &table->fields[i];
+        if ((f->name_len == 14 && strncasecmp(f->name, "Content-Length", 14) == 0) ||
+            (f->name_len == 10 && strncasecmp(f->name, "Connection", 10) == 0) ||
+            (f->name_len == 10 && strncasecmp(f->name, "Keep-Alive", 10) == 0)) continue;
+        if (f->name_len == 4 && strncasecmp(f->name, "Vary", 4) == 0) {
+            vary = f;
+            continue;
+        }
+        if (f->name_len == 4 && strncasecmp(f->name, "ETag", 4) == 0 && f->value_len > 0 && f->value[0] == '"') {
+            // The encoded bytes differ, so a strong validator no longer holds
+            ok = append(e->head, sizeof(e->head), &len, "ETag: W/", 8) &&
+                 append(e->head, sizeof(e->head), &len, f->value, f->value_len) &&
+                 append(e->head, sizeof(e->head), &len, "\r\n", 2);
+            continue;
+        }
+        ok = append(e->head, sizeof(e->head), &len, f->line, f->line_len);
+    }
+
+    const char *coding = e->encoding == ENCODING_BROTLI ? "Content-Encoding: br\r\n" : "Content-Encoding: gzip\r\n";
+    ok = ok && append(e->head, sizeof(e->head), &len, coding, strlen(coding));
+    ok = ok && append(e->head, sizeof(e->head), &len, "Vary: ", 6);
+    if (vary && vary->value_len > 0) {
+        ok = ok && append(e->head, sizeof(e->head), &len, vary->value, vary->value_len) &&
+             append(e->head, sizeof(e->head), &len, ", ", 2);
+    }
+    const char *tail = "Accept-Encoding\r\nConnection: close\r\n\r\n";
+    ok = ok && append(e->head, sizeof(e->head), &len, tail, strlen(tail));
+
+    e->head_len = ok ? len : 0;
+    e->head_off = 0;
+    return ok;
+}
+
+static int start_stream(response_encoder *e) {
+    if (e->encoding == ENCODING_BROTLI) {
+        e->br = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+        if (!e->br) return 0;
+        BrotliEncoderSetParameter(e->br, BROTLI_PARAM_QUALITY, config.level > BROTLI_MAX_QUALITY ? BROTLI_MAX_QUALITY : config.level);
+        BrotliEncoderSetParameter(e->br, BROTLI_PARAM_LGWIN, 18);  // 256 KB window keeps per-stream memory modest
+        return 1;
+    }
+
+    // windowBits 15 + 16 selects the gzip wrapper
+    return deflateInit2(&e->z, config.level > 9 ? 9 : config.level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+// Look for a complete response head in the staging buffer and decide what to do with the body
+static void inspect_head(response_encoder *e, int final) {
+    const char *end = memmem(e->in, e->in_tail, "\r\n\r\n", 4);
+    if (!end) {
+        // Head larger than the stage or a truncated response: leave it untouched
+        if (final || e->in_tail == sizeof(e->in)) e->state = ENC_PASSTHROUGH;
+        return;
+    }
+
+    size_t head_len = end + 4 - e->in;
+    const char *status_end = memchr(e->in, '\n', head_len);
+    header_table table;
+    e->state = ENC_PASSTHROUGH;
+    if (!status_end || !parse_headers(e->in, head_len, &table) || !should_compress(e->in, &table)) {
+        atomic_fetch_add(&compress_skipped, 1);
+        return;
+    }
+    if (!rewrite_head(e, e->in, status_end + 1 - e->in, &table)) return;
+    if (!start_stream(e)) {
+        e->head_len = 0;
+        return;
+    }
+
+    e->in_head = head_len;  // Original head is replaced by the rewritten one
+    e->state = ENC_BODY;
+}
+
+static size_t encode_body(response_encoder *e, char *out, size_t room, int final) {
+    size_t avail_in = e->in_tail - e->in_head;
+    size_t produced;
+    long long start = thread_cpu_ns();
+
+    if (e->encoding == ENCODING_BROTLI) {
+        const uint8_t *next_in = (const uint8_t *)e->in + e->in_head;
+        uint8_t *next_out = (uint8_t *)out;
+        size_t avail_out = room;
+        BrotliEncoderCompressStream(e->br, final ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
+                                    &avail_in, &next_in, &avail_out, &next_out, NULL);
+        produced = room - avail_out;
+        if (final && BrotliEncoderIsFinished(e->br)) e->finished = 1;
+    } else {
+        e->z.next_in = (Bytef *)e->in + e->in_head;
+        e->z.avail_in = avail_in;
+        e->z.next_out = (Bytef *)out;
+        e->z.avail_out = room;
+        int rc = deflate(&e->z, final ? Z_FINISH : Z_NO_FLUSH);
+        avail_in = e->z.avail_in;
+        produced = room - e->z.avail_out;
+        if (rc == Z_STREAM_END || rc == Z_STREAM_ERROR) e->finished = 1;
+    }
+
+    e->cpu_ns += thread_cpu_ns() - start;
+    e->body_in += e->in_tail - e->in_head - avail_in;
+    e->body_out += produced;
+    e->in_head = e->in_tail - avail_in;
+    return produced;
+}
+
+response_encoder *encoder_create(int encoding) {
+    response_encoder *e = calloc(1, sizeof(response_encoder));
+    if (!e) return NULL;
+    e->encoding = encoding;
+    e->state = ENC_HEADERS;
+    return e;
+}
+
+size_t encoder_input_room(response_encoder *e, char **where) {
+    if (e->in_head == e->in_tail) {
+        e->in_head = e->in_tail = 0;
+    } else if (e->in_tail == sizeof(e->in) && e->in_head > 0) {
+        memmove(e->in, e->in + e->in_head, e->in_tail - e->in_head);
+        e->in_tail -= e->in_head;
+        e->in_head = 0;
+    }
+    *where = e->in + e->in_tail;
+    return sizeof(e->in) - e->in_tail;
+}
+
+void encoder_commit_input(response_encoder *e, size_t len) {
+    e->in_tail += len;
+}
+
+size_t encoder_produce(response_encoder *e, char *out, size_t room, int final) {
+    size_t produced = 0;
+
+    if (e->state == ENC_HEADERS) inspect_head(e, final);
+    if (e->state == ENC_HEADERS) return 0;
+
+    if (e->head_off < e->head_len) {
+        size_t n = e->head_len - e->head_off < room ? e->head_len - e->head_off : room;
+        memcpy(out, e->head + e->head_off, n);
+        e->head_off += n;
+        produced += n;
+        if (e->head_off < e->head_len) return produced;
+    }
+
+    if (e->state == ENC_PASSTHROUGH) {
+        size_t n = e->in_tail - e->in_head < room - produced ? e->in_tail - e->in_head : room - produced;
+        memcpy(out + produced, e->in + e->in_head, n);
+        e->in_head += n;
+        return produced + n;
+    }
+
+    if (!e->finished && produced < room) produced += encode_body(e, out + produced, room - produced, final);
+    return produced;
+}
+
+int encoder_pending(const response_encoder *e) {
+    if (e->in_head < e->in_tail || e->head_off < e->head_len) return 1;
+    return e->state != ENC_PASSTHROUGH && !e->finished;
+}
+
+void encoder_destroy(response_encoder *e) {
+    if (!e) return;
+
+    if (e->state == ENC_BODY) {
+        if (e->encoding == ENCODING_BROTLI) {
+            BrotliEncoderDestroyInstance(e->br);
+            atomic_fetch_add(&compressed_br, 1);
+        } else {
+            deflateEnd(&e->z);
+            atomic_fetch_add(&compressed_gzip, 1);
+        }
+        atomic_fetch_add(&compress_bytes_in, e->body_in);
+        atomic_fetch_add(&compress_bytes_out, e->body_out);
+        atomic_fetch_add(&compress_cpu_ns, e->cpu_ns);
+    }
+    free(e);
+}
+
+void print_compress_stats(FILE *out) {
+    long long in = atomic_load(&compress_bytes_in);
+    long long saved = in - atomic_load(&compress_bytes_out);
+    long long cpu_ns = atomic_load(&compress_cpu_ns);
+
+    fprintf(out, "compress: level=%d gzip=%ld br=%ld skipped=%ld bytes_in=%lld bytes_saved=%lld cpu_ms=%lld cpu_us_per_mb_saved=%.1f\n",
+            config.level, atomic_load(&compressed_gzip), atomic_load(&compressed_br),
+            atomic_load(&compress_skipped), in, saved, cpu_ns / 1000000,
+            saved > 0 ? cpu_ns / 1000.0 / (saved / 1048576.0) : 0.0);
+}
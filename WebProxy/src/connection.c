@@ -49,10 +49,24 @@ int extract_host(const char *url, char *host, size_t host_len) {
     return 1;
 }
 
+// Port named in the URL; plain-HTTP defaults map to the HTTPS port since upstream is always TLS
+int extract_port(const char *url) {
+    const char *start = strstr(url, "://");
+    start = start ? start + 3 : url;
+    const char *end = strpbrk(start, ":/");
+    if (!end || *end != ':') return DEFAULT_HTTPS_PORT;
+
+    int port = atoi(end + 1);
+    if (port <= 0 || port > 65535 || port == 80) return DEFAULT_HTTPS_PORT;
+    return port;
+}
+
 int connect_to_server(const char *host, int port, int *server_fd, SSL **ssl, SSL_CTX **ssl_ctx, int allow_untrusted) {
-    printf("Connecting to %s:%d...\n", host, port);
+    LOG_DEBUG("Connecting to %s:%d...", host, port);
 
+    trace_span_begin(TRACE_DNS);
     struct hostent *server = gethostbyname(host);
+    trace_span_end(TRACE_DNS);
     if (!server) {
         perror("DNS resolution failed");
         return 0;
@@ -69,15 +83,19 @@ int connect_to_server(const char *host, int port, int *server_fd, SSL **ssl, SSL
     server_addr.sin_port = htons(port);
     memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
 
-    if (connect(*server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    trace_span_begin(TRACE_CONNECT);
+    int connected = connect(*server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr));
+    trace_span_end(TRACE_CONNECT);
+    if (connected < 0) {
         perror("Connection to server failed");
         close(*server_fd);
         return 0;
     }
 
-    printf("Connected to %s:%d successfully!\n", host, port);
+    LOG_DEBUG("Connected to %s:%d successfully!", host, port);
 
-    if (port == 443) {  // Establish SSL for HTTPS
+    {  // Establish SSL: the proxy always talks HTTPS upstream
+        trace_span_begin(TRACE_TLS);
         *ssl_ctx = SSL_CTX_new(SSLv23_client_method());
         if (!*ssl_ctx) {
             perror("SSL_CTX_new failed");
@@ -110,9 +128,10 @@ int connect_to_server(const char *host, int port, int *server_fd, SSL **ssl, SSL
 
         *ssl = SSL_new(*ssl_ctx);
         SSL_set_fd(*ssl, *server_fd);
+        ktls_prepare(*ssl);
 
         if (SSL_connect(*ssl) != 1) {
-            printf("SSL handshake failed for %s:%d\n", host, port);
+            LOG_WARN("SSL handshake failed for %s:%d", host, port);
             ERR_print_errors_fp(stderr);
             
             SSL_free(*ssl);
@@ -122,7 +141,9 @@ int connect_to_server(const char *host, int port, int *server_fd, SSL **ssl, SSL
             return 0;
         }
 
-        printf("SSL handshake completed for %s:%d\n", host, port);
+        trace_span_end(TRACE_TLS);
+        LOG_DEBUG("SSL handshake completed for %s:%d", host, port);
+        if (ktls_recv_enabled(*ssl)) ktls_count_session();
     }
 
     return 1;
@@ -131,78 +152,6 @@ int connect_to_server(const char *host, int port, int *server_fd, SSL **ssl, SSL
 
 
 
-void inject_header(char *buffer, size_t buf_size, const char *header) {
-    char *headers_end = strstr(buffer, "\r\n\r\n");
-    if (!headers_end) return;
-    
-    size_t existing_len = headers_end - buffer;
-    size_t new_header_len = strlen(header);
-    if (existing_len + new_header_len + 4 >= buf_size) return;
-
-    memmove(buffer + new_header_len, buffer, existing_len + 4);
-    memcpy(buffer, header, new_header_len);
-}
-
-void forward_response(int client_fd, int server_fd, SSL *ssl, int is_head_request) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes;
-    int header_sent = 0;
-
-    while (1) {
-        if (ssl) {
-            bytes = SSL_read(ssl, buffer, sizeof(buffer));
-        } else {
-            bytes = recv(server_fd, buffer, sizeof(buffer), 0);
-        }
-
-        if (bytes <= 0) break;  // Stop reading when connection closes
-
-        // If this is a HEAD request, only send headers (stop after "\r\n\r\n")
-        if (is_head_request) {
-            if (!header_sent) {
-                char *headers_end = strstr(buffer, "\r\n\r\n");
-                if (headers_end) {
-                    send(client_fd, buffer, headers_end - buffer + 4, 0);
-                    header_sent = 1;
-                }
-            }
-            break;  // Stop sending anything else
-        } else {
-            send(client_fd, buffer, bytes, 0);
-        }
-    }
-}
-
-
-
-void tunnel_data(int client_fd, int server_fd) {
-    fd_set fds;
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes;
-
-    while (1) {
-        FD_ZERO(&fds);
-        FD_SET(client_fd, &fds);
-        FD_SET(server_fd, &fds);
-
-        if (select(FD_SETSIZE, &fds, NULL, NULL, NULL) < 0) break;
-
-        if (FD_ISSET(client_fd, &fds)) {
-            bytes = recv(client_fd, buffer, sizeof(buffer), 0);
-            if (bytes <= 0) break;
-            send(server_fd, buffer, bytes, 0);
-        }
-
-        if (FD_ISSET(server_fd, &fds)) {
-            bytes = recv(server_fd, buffer, sizeof(buffer), 0);
-            if (bytes <= 0) break;
-            send(client_fd, buffer, bytes, 0);
-        }
-    }
-
-    close(client_fd);
-    close(server_fd);
-}
 int extract_content_length(const char *buffer) {
     const char *cl_header = strcasestr(buffer, "Content-Length:");
     if (!cl_header) return -1; // No Content-Length header found
@@ -213,52 +162,31 @@ int extract_content_length(const char *buffer) {
     }
     return -1; // Return -1 if parsing fails
 }
-void replace_proxy_connection(char *buffer) {
-    char *proxy_conn = strcasestr(buffer, "Proxy-Connection:");
-    if (proxy_conn) {
-        memcpy(proxy_conn, "Connection:", 11);
-        char *value = proxy_conn + 11;
-        while (*value == ' ' || *value == '\t') value++;
-        if (strncasecmp(value, "keep-alive", 10) == 0) {
-            snprintf(proxy_conn, sizeof(buffer) - (proxy_conn - buffer), "Connection: keep-alive\r\n");
-        } else {
-            snprintf(proxy_conn, sizeof(buffer) - (proxy_conn - buffer), "Connection: close\r\n");
-        }
-    }
-}
-void ensure_host_header(char *buffer, const char *host, const char *client_ip) {
-    char *headers_end = strstr(buffer, "\r\n\r\n");
-    if (!headers_end) return;  // No headers found
-
-    // Ensure "Host:" header is present
-    if (!strcasestr(buffer, "Host:")) {
-        char host_header[256];
-        int len = snprintf(host_header, sizeof(host_header), "Host: %s\r\n", host);
-        memmove(headers_end + len, headers_end, strlen(headers_end) + 1);
-        memcpy(headers_end, host_header, len);
-    }
 
-    // Handle "X-Forwarded-For"
-    if (!strcasestr(buffer, "X-Forwarded-For:")) {
-        // Ensure it is inserted properly with a newline before it
-        char xff_new[256];
-        int xff_len = snprintf(xff_new, sizeof(xff_new), "\r\nX-Forwarded-For: %s\r\n", client_ip);
-        
-        // Move existing headers forward to make space
-        memmove(headers_end + xff_len, headers_end, strlen(headers_end) + 1);
-        memcpy(headers_end, xff_new, xff_len);
+// Read until the blank line that ends the request head (or the buffer fills up)
+ssize_t read_request_head(int client_fd, char *buffer, size_t buf_size) {
+    size_t total = 0;
+    while (total < buf_size) {
+        ssize_t n = recv(client_fd, buffer + total, buf_size - total, 0);
+        if (n <= 0) return total > 0 ? (ssize_t)total : n;
+        total += n;
+
+        size_t scan_from = total > (size_t)n + 3 ? total - n - 3 : 0;
+        buffer[total] = '\0';
+        if (strstr(buffer + scan_from, "\r\n\r\n")) break;
     }
+    return total;
 }
 
 
 /*handle_client implementation*/
-void *handle_client(void *arg) {
-    client_info *info = (client_info *)arg;
+static void *serve_client(client_info *info, int conn_slot) {
     int client_fd = info->client_fd;
     struct sockaddr_in client_addr = info->client_addr;
     char log_path[256];
     strncpy(log_path, info->log_path, sizeof(log_path));  // Copy log_path from struct
     log_path[sizeof(log_path) - 1] = '\0'; 
+    int allow_untrusted = info->allow_untrusted;
     free(info);
 
     char buffer[BUFFER_SIZE] = {0};
@@ -268,14 +196,14 @@ void *handle_client(void *arg) {
     SSL_CTX *ssl_ctx = NULL;
     SSL *ssl = NULL;
     int server_fd = -1;
-    int target_port = 443;
+    int target_port = DEFAULT_HTTPS_PORT;
     char host[128] = {0};
     char method[16], url[256], version[16];
     //size_t received;
     //ssize_t rc;
 
-    // Read client request
-    ssize_t total_received = recv(client_fd, buffer, BUFFER_SIZE - 1, 0);
+    // Read client request head
+    ssize_t total_received = read_request_head(client_fd, buffer, BUFFER_SIZE - 1);
     if (total_received <= 0) {
         close(client_fd);
         return NULL;
@@ -283,12 +211,20 @@ void *handle_client(void *arg) {
     buffer[total_received] = '\0';
 
     // Parse request line
+    trace_span_begin(TRACE_PARSE);
     if (sscanf(buffer, "%15s %255s %15s", method, url, version) != 3) {
         send_error(client_fd, 400, "Bad Request");
         close(client_fd);
         return NULL;
     }
     
+    header_table headers;
+    if (!parse_headers(buffer, total_received, &headers)) {
+        send_error(client_fd, 400, "Bad Request");
+        close(client_fd);
+        return NULL;
+    }
+
     if (strstr(version, "HTTP/1.0")) {
         strcpy(version, "HTTP/1.1");
     } else if (!strstr(version, "HTTP/1.")) {
@@ -304,9 +240,16 @@ void *handle_client(void *arg) {
         return NULL;
     }
 
+    target_port = extract_port(url);
+    trace_span_end(TRACE_PARSE);
+    trace_annotate(host, url);
+
     // Check if site is blocked
-    if (is_site_blocked(host)) {
-        printf("Blocking site: %s\n", host);
+    trace_span_begin(TRACE_BLOCKLIST);
+    int blocked = is_site_blocked(host);
+    trace_span_end(TRACE_BLOCKLIST);
+    if (blocked) {
+        LOG_INFO("Blocking site: %s", host);
         send_error(client_fd, 403, "Forbidden");
 
         // Log the correct status
@@ -318,60 +261,111 @@ void *handle_client(void *arg) {
 
 
 
-    // Store connection in active_connections[]
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (!active_connections[i].in_use) {
-            active_connections[i].client_fd = client_fd;
-            active_connections[i].client_addr = client_addr;
-            active_connections[i].in_use = 1;
-            strncpy(active_connections[i].host, host, sizeof(active_connections[i].host) - 1);
-            active_connections[i].host[sizeof(active_connections[i].host) - 1] = '\0';
-            break;
-        }
-    }
+    // Record the host on this connection's active_connections[] entry
+    set_connection_host(conn_slot, host);
 
     // Extract path (fix request formatting)
     char *path = strchr(url + 7, '/');
     if (!path) path = "/";
 
-    // Connect to remote server
-    if (!connect_to_server(host, target_port, &server_fd, &ssl, &ssl_ctx, 0)) {
-        send_error(client_fd, 502, "Bad Gateway");
+    if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) {
+        send_error(client_fd, 501, "Not Implemented");
         close(client_fd);
         return NULL;
     }
-    if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) {
-        send_error(client_fd, 501, "Not Implemented");
+    int is_head_request = (strcmp(method, "HEAD") == 0);
+
+    // Answer from cached segments when every requested byte is on hand and fresh
+    int cacheable = !is_head_request && cache_enabled() && request_is_cacheable(&headers);
+    if (cacheable) {
+        size_t sent;
+        int status = cache_serve(host, target_port, path, &headers, choose_encoding(&headers), client_fd, &sent);
+        if (status) {
+            log_request(log_path, client_ip, buffer, status, sent);
+            close(client_fd);
+            return NULL;
+        }
+    }
+
+    // Attach to an identical in-flight GET instead of opening another origin fetch
+    flight *inflight = NULL;
+    int is_leader = 0;
+    size_t skip = 0;
+    resume_point resume;
+    char range_request[320] = "";
+    if (!is_head_request && request_is_shareable(&headers)) {
+        char key[384];
+        make_cache_key(host, path, &headers, key, sizeof(key));
+        inflight = coalesce_join(key, &is_leader);
+        if (inflight && !is_leader) {
+            int complete;
+            skip = coalesce_follow(inflight, client_fd, &complete);
+            int resumable = !complete && skip > 0 && coalesce_resume_point(inflight, skip, &resume);
+            coalesce_release(inflight);
+            inflight = NULL;
+            if (resumable && resume.body_offset == resume.total) complete = 1;
+            if (complete || (skip > 0 && !resumable)) {
+                // A different response cannot follow the bytes already sent; a short body tells the client
+                log_request(log_path, client_ip, buffer, complete ? 200 : 502, skip);
+                close(client_fd);
+                return NULL;
+            }
+            // Leader failed or outran the fan-out buffer: fetch privately, from where the client stopped
+            if (skip > 0) {
+                snprintf(range_request, sizeof(range_request), "Range: bytes=%lld-\r\nIf-Range: %s\r\n",
+                         resume.body_offset, resume.validator);
+            }
+        }
+    }
+
+    // Wait for this origin's turn; a full queue sheds only requests to the same origin
+    trace_span_begin(TRACE_ORIGIN_QUEUE);
+    int origin_slot = upstream_acquire(host, target_port);
+    trace_span_end(TRACE_ORIGIN_QUEUE);
+    if (origin_slot == UPSTREAM_REJECTED) {
+        if (inflight) coalesce_finish(inflight, 0);
+        if (skip == 0) send_error(client_fd, 503, "Service Unavailable");
+        log_request(log_path, client_ip, buffer, 503, skip);
         close(client_fd);
         return NULL;
     }
 
+    // Connect to remote server
+    if (!connect_to_server(host, target_port, &server_fd, &ssl, &ssl_ctx, allow_untrusted)) {
+        upstream_release(origin_slot);
+        if (inflight) coalesce_finish(inflight, 0);
+        if (skip == 0) send_error(client_fd, 502, "Bad Gateway");
+        close(client_fd);
+        return NULL;
+    }
 
-    // Correct request formatting
-    char new_request[BUFFER_SIZE];
-    snprintf(new_request, sizeof(new_request),
-             "%s %s %s\r\n"
-             "Host: %s\r\n"
-             "Connection: close\r\n"
-             "User-Agent: MyProxy/1.0\r\n\r\n",
-             method, path, version, host);
 
-    //printf("Forwarding request:\n%s\n", new_request);
-    if (target_port == 443) {
-        printf("Sending HTTPS request using SSL_write\n");
-        SSL_write(ssl, new_request, strlen(new_request));
-    } else {
-        printf("Sending HTTP request using send()\n");
-        send(server_fd, new_request, strlen(new_request), 0);
+    // Rewrite headers in one pass and send them straight from the client's buffer
+    char request_prefix[BUFFER_SIZE / 2];
+    struct iovec iov[MAX_HEADERS + 8];
+    int iovcnt = build_upstream_request(&headers, method, path, version, host, client_ip,
+                                        skip > 0 ? range_request : NULL, cacheable, request_prefix, sizeof(request_prefix), iov);
+    if (iovcnt < 0 || !send_upstream_request(server_fd, ssl, iov, iovcnt)) {
+        if (inflight) coalesce_finish(inflight, 0);
+        if (skip == 0) send_error(client_fd, 502, "Bad Gateway");
+        if (ssl) SSL_free(ssl);
+        if (ssl_ctx) SSL_CTX_free(ssl_ctx);
+        close(server_fd);
+        upstream_release(origin_slot);
+        close(client_fd);
+        return NULL;
     }
+    trace_span_begin(TRACE_FIRST_BYTE);
 
 
-    // Read response from server
-    ensure_host_header(buffer, host, client_ip);
-    int is_head_request = (strcmp(method, "HEAD") == 0);
-    forward_response(client_fd, server_fd, ssl, is_head_request);
-    log_request(log_path, client_ip, buffer, 200, strlen(buffer));
-    ensure_host_header(buffer, host, client_ip);
+    // Read response from server, keeping a copy of the body for the cache
+    int relay_ok;
+    cache_fill *fill = cacheable ? cache_fill_begin(host, target_port, path) : NULL;
+    size_t delivered = relay_response(client_fd, server_fd, ssl, NULL, 0, is_head_request, inflight, fill,
+                                      skip > 0 ? &resume : NULL, choose_encoding(&headers), conn_slot, &relay_ok);
+    cache_fill_end(fill, relay_ok);
+    if (inflight) coalesce_finish(inflight, relay_ok);  // A cut-off relay sends followers to their fallback
+    log_request(log_path, client_ip, buffer, relay_ok ? 200 : 502, skip + delivered);
 
 
     /*char resp_buffer[BUFFER_SIZE];
@@ -402,8 +396,19 @@ void *handle_client(void *arg) {
     if (ssl) SSL_free(ssl);
     if (ssl_ctx) SSL_CTX_free(ssl_ctx);
     close(server_fd);
+    upstream_release(origin_slot);
     close(client_fd);
     return NULL;
 }
 
-
+void *handle_client(void *arg) {
+    client_info *info = (client_info *)arg;
+    admission_started(info->accepted_ns);
+    trace_request_begin(info->accepted_ns);
+    int conn_slot = claim_connection_slot(info->client_fd, &info->client_addr);
+    serve_client(info, conn_slot);
+    release_connection_slot(conn_slot);
+    trace_request_end();
+    admission_release();
+    return NULL;
+}
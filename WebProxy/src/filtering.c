@@ -25,7 +25,7 @@ void load_forbidden_sites(const char *filename) {
 
     fclose(file);
     sort_forbidden_sites(); // Add this line to sort after loading
-    printf("Forbidden sites list reloaded. Total blocked sites: %d\n", num_forbidden_sites);
+    LOG_INFO("Forbidden sites list reloaded. Total blocked sites: %d", num_forbidden_sites);
 }
 
 
@@ -38,21 +38,21 @@ void sort_forbidden_sites() {
     qsort(forbidden_sites, num_forbidden_sites, sizeof(forbidden_sites[0]), compare_strings);
 }
 int is_site_blocked(const char *host) {
-    printf("Checking if site is blocked: %s\n", host);  // DEBUG print
+    LOG_TRACE("Checking if site is blocked: %s", host);
 
     for (int i = 0; i < num_forbidden_sites; i++) {
         if (strcmp(host, forbidden_sites[i]) == 0) {
-            printf("BLOCKED: %s\n", host);
+            LOG_DEBUG("BLOCKED: %s", host);
             return 1;
         }
 
         // Handle 'www.' prefix variations
         if (strncmp(host, "www.", 4) == 0 && strcmp(host + 4, forbidden_sites[i]) == 0) {
-            printf("BLOCKED (Removed 'www.'): %s\n", host);
+            LOG_DEBUG("BLOCKED (Removed 'www.'): %s", host);
             return 1;
         }
         if (strncmp(forbidden_sites[i], "www.", 4) == 0 && strcmp(forbidden_sites[i] + 4, host) == 0) {
-            printf("BLOCKED (Blocked entry had 'www.'): %s\n", host);
+            LOG_DEBUG("BLOCKED (Blocked entry had 'www.'): %s", host);
             return 1;
         }
     }
@@ -118,11 +118,3 @@ int is_site_blocked(const char *host) {
     return 0;
 }
 */
-
-void reload_forbidden_sites(int signo) {
-    if (signo == SIGINT) {
-        printf("\nReloading forbidden sites list...\n");
-        load_forbidden_sites("forbidden_sites.txt"); // Re-load the list from file
-        printf("Forbidden sites updated.\n");
-    }
-}
\ No newline at end of file
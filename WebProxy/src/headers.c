@@ -0,0 +1,188 @@
+#define _GNU_SOURCE  // memmem()
+#include "proxy.h"
+#include <sys/uio.h>
+#include <errno.h>
+
+// Header transformation stage.
+// The client's header block is parsed once into a table of spans that point into
+// the receive buffer. Rewrite rules then pick which spans go upstream, and the
+// result is sent as an iovec list, so no header bytes are shifted or copied.
+
+// Hop-by-hop headers (RFC 7230 6.1) never go upstream
+static const char *hop_by_hop[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate",
+    "Proxy-Authorization", "TE", "Trailer", "Transfer-Encoding", "Upgrade", NULL
+};
+
+static int span_equals(const char *s, size_t len, const char *name) {
+    return strlen(name) == len && strncasecmp(s, name, len) == 0;
+}
+
+int parse_headers(const char *buffer, size_t len, header_table *table) {
+    table->count = 0;
+    table->end = NULL;
+
+    const char *limit = buffer + len;
+    const char *p = memchr(buffer, '\n', len);  // Skip the request/status line
+    if (!p) return 0;
+    p++;
+
+    while (p < limit) {
+        const char *eol = memchr(p, '\n', limit - p);
+        if (!eol) return 0;  // Header block is incomplete
+
+        const char *line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+        if (line_end == p) {
+            table->end = eol + 1;
+            return 1;
+        }
+
+        const char *colon = memchr(p, ':', line_end - p);
+        if (!colon || colon == p) return 0;
+        if (table->count == MAX_HEADERS) return 0;
+
+        const char *value = colon + 1;
+        while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+        const char *value_end = line_end;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+
+        header_field *field = &table->fields[table->count++];
+        field->name = p;
+        field->name_len = colon - p;
+        field->value = value;
+        field->value_len = value_end - value;
+        field->line = p;
+        field->line_len = eol + 1 - p;
+
+        p = eol + 1;
+    }
+    return 0;
+}
+
+const header_field *find_header(const header_table *table, const char *name) {
+    for (int i = 0; i < table->count; i++) {
+        if (span_equals(table->fields[i].name, table->fields[i].name_len, name)) {
+            return &table->fields[i];
+        }
+    }
+    return NULL;
+}
+
+// Headers the client named in its Connection header are hop-by-hop too
+static int listed_in_connection(const header_field *connection, const header_field *field) {
+    if (!connection) return 0;
+
+    const char *p = connection->value;
+    const char *end = p + connection->value_len;
+    while (p < end) {
+        while (p < end && (*p == ',' || *p == ' ' || *p == '\t')) p++;
+        const char *token = p;
+        while (p < end && *p != ',' && *p != ' ' && *p != '\t') p++;
+        if (p > token && (size_t)(p - token) == field->name_len &&
+            strncasecmp(token, field->name, field->name_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int is_hop_by_hop(const header_field *field) {
+    for (int i = 0; hop_by_hop[i]; i++) {
+        if (span_equals(field->name, field->name_len, hop_by_hop[i])) return 1;
+    }
+    return 0;
+}
+
+int request_is_shareable(const header_table *table) {
+    // Responses to these may differ per client, so they must not be coalesced; a conditional
+    // request may get a bodiless 304 that would be useless to an unconditional follower
+    return !find_header(table, "Authorization") && !find_header(table, "Cookie") &&
+           !find_header(table, "Range") && !find_header(table, "If-Range") &&
+           !find_header(table, "If-None-Match") && !find_header(table, "If-Modified-Since") &&
+           !find_header(table, "If-Match") && !find_header(table, "If-Unmodified-Since");
+}
+
+int request_is_cacheable(const header_table *table) {
+    // Credentials may change the response; no-store forbids keeping it at all
+    const header_field *cc = find_header(table, "Cache-Control");
+    if (cc && memmem(cc->value, cc->value_len, "no-store", 8)) return 0;
+    return !find_header(table, "Authorization") && !find_header(table, "Cookie");
+}
+
+static void add_iov(struct iovec *iov, int *count, const void *base, size_t len) {
+    iov[*count].iov_base = (void *)base;
+    iov[*count].iov_len = len;
+    (*count)++;
+}
+
+int build_upstream_request(const header_table *table, const char *method, const char *path,
+                           const char *version, const char *host, const char *client_ip,
+                           const char *extra, int identity_only, char *scratch, size_t scratch_len, struct iovec *iov) {
+    int count = 0;
+    const header_field *connection = find_header(table, "Connection");
+    const header_field *forwarded = find_header(table, "X-Forwarded-For");
+
+    // Only the request line and Host are synthesized; everything else points into the client's buffer
+    int prefix_len = snprintf(scratch, scratch_len, "%s %s %s\r\nHost: %s\r\n", method, path, version, host);
+    if (prefix_len < 0 || (size_t)prefix_len >= scratch_len) return -1;
+    add_iov(iov, &count, scratch, prefix_len);
+
+    for (int i = 0; i < table->count; i++) {
+        const header_field *field = &table->fields[i];
+        if (is_hop_by_hop(field) || listed_in_connection(connection, field)) continue;
+        if (span_equals(field->name, field->name_len, "Host")) continue;
+        if (field == forwarded) continue;
+        // The cache keeps only identity bodies; the compression stage encodes per client instead
+        if (identity_only && span_equals(field->name, field->name_len, "Accept-Encoding")) continue;
+        add_iov(iov, &count, field->line, field->line_len);
+    }
+
+    add_iov(iov, &count, "X-Forwarded-For: ", 17);
+    if (forwarded && forwarded->value_len > 0) {
+        add_iov(iov, &count, forwarded->value, forwarded->value_len);
+        add_iov(iov, &count, ", ", 2);
+    }
+    add_iov(iov, &count, client_ip, strlen(client_ip));
+    add_iov(iov, &count, "\r\n", 2);
+
+    if (!find_header(table, "User-Agent")) {
+        add_iov(iov, &count, "User-Agent: MyProxy/1.0\r\n", 25);
+    }
+    if (extra) add_iov(iov, &count, extra, strlen(extra));
+
+    // Upstream connections are never reused
+    add_iov(iov, &count, "Connection: close\r\n\r\n", 21);
+    return count;
+}
+
+int send_upstream_request(int server_fd, SSL *ssl, struct iovec *iov, int count) {
+    if (ssl) {
+        // TLS needs the record contiguous: gather once and hand it to a single SSL_write
+        char record[BUFFER_SIZE * 2];
+        size_t len = 0;
+        for (int i = 0; i < count; i++) {
+            if (len + iov[i].iov_len > sizeof(record)) return 0;
+            memcpy(record + len, iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+        }
+        return SSL_write(ssl, record, len) == (int)len;
+    }
+
+    while (count > 0) {
+        ssize_t sent = writev(server_fd, iov, count);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return 0;
+
+        // Drop fully written entries and advance into a partially written one
+        while (count > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 1;
+}
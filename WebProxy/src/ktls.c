@@ -0,0 +1,62 @@
+#include "proxy.h"
+
+// Kernel TLS offload for upstream sessions, enabled with -ktls.
+// When the kernel has the "tls" ULP, upstream sessions ask OpenSSL to hand the
+// record layer to the kernel after the handshake. Received records then arrive
+// decrypted on the socket and relay.c can splice() them to the client without
+// copying through user space. Anything else falls back to SSL_read/send.
+// The protocol version is left to negotiation: OpenSSL before 3.2 only offloads
+// TLS 1.2 receives, so TLS 1.3 sessions there simply stay in user space.
+
+static int ktls_available = 0;
+
+static atomic_long ktls_sessions = 0;        // Upstream sessions with kernel receive offload
+static atomic_long ktls_spliced_bytes = 0;
+static atomic_long ktls_fallbacks = 0;       // Splices that hit a control record and finished via SSL_read
+
+void ktls_init(int enabled) {
+    if (!enabled) return;
+
+#ifdef SSL_OP_ENABLE_KTLS
+    FILE *ulp = fopen("/proc/sys/net/ipv4/tcp_available_ulp", "r");
+    if (!ulp) return;
+
+    char line[256] = {0};
+    if (fgets(line, sizeof(line), ulp)) {
+        for (char *tok = strtok(line, " \n"); tok; tok = strtok(NULL, " \n")) {
+            if (strcmp(tok, "tls") == 0) ktls_available = 1;
+        }
+    }
+    fclose(ulp);
+#endif
+
+    LOG_INFO("Kernel TLS offload %s", ktls_available ? "enabled" : "unavailable, using user-space TLS");
+}
+
+void ktls_prepare(SSL *ssl) {
+#ifdef SSL_OP_ENABLE_KTLS
+    if (!ktls_available) return;
+    SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+int ktls_recv_enabled(SSL *ssl) {
+#ifndef OPENSSL_NO_KTLS
+    if (ssl && BIO_get_ktls_recv(SSL_get_rbio(ssl))) return 1;
+#endif
+    return 0;
+}
+
+void ktls_count_session() {
+    atomic_fetch_add(&ktls_sessions, 1);
+}
+
+void ktls_count_splice(size_t bytes, int fell_back) {
+    atomic_fetch_add(&ktls_spliced_bytes, bytes);
+    if (fell_back) atomic_fetch_add(&ktls_fallbacks, 1);
+}
+
+void print_ktls_stats(FILE *out) {
+    fprintf(out, "ktls: available=%d sessions=%ld spliced_bytes=%ld fallbacks=%ld\n", ktls_available,
+            atomic_load(&ktls_sessions), atomic_load(&ktls_spliced_bytes), atomic_load(&ktls_fallbacks));
+}
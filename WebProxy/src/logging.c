@@ -1,11 +1,184 @@
 #include "proxy.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
 
+// Diagnostic log sink.
+// Worker threads format a message into a fixed slot of a lock-free ring and move on;
+// a single writer thread drains the ring to stdout in large writes. When the ring is
+// full the message is dropped and counted instead of making the caller wait.
+
+#define LOG_SLOTS 1024              // Must be a power of two
+#define LOG_SLOT_SIZE 256
+#define LOG_DRAIN_BUFFER (64 * 1024)
+#define LOG_IDLE_SLEEP_NS 5000000L  // Writer poll interval while the ring is empty
+
+typedef struct {
+    atomic_size_t seq;  // Slot is free for ticket seq, or holds ticket seq - 1 once published
+    int len;
+    char text[LOG_SLOT_SIZE];
+} log_slot;
+
+int log_runtime_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = { "error", "warn", "info", "debug", "trace" };
+
+static log_slot log_ring[LOG_SLOTS];
+static atomic_size_t log_enqueue_pos = 0;
+static size_t log_dequeue_pos = 0;   // Only the writer thread (or log_flush after it) touches this
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int writer_running = 0;
+
+static atomic_long log_written = 0;
+static atomic_long log_dropped = 0;
+
+static atomic_int access_log_fd = -1;
+static pthread_mutex_t access_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int log_level_from_name(const char *name) {
+    for (int i = 0; i <= LOG_LEVEL_TRACE; i++) {
+        if (strcasecmp(name, level_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+void log_message(int level, const char *fmt, ...) {
+    size_t pos = atomic_load_explicit(&log_enqueue_pos, memory_order_relaxed);
+    log_slot *slot;
+
+    // Claim a ticket; a full ring drops the message rather than blocking the caller
+    while (1) {
+        slot = &log_ring[pos & (LOG_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            atomic_fetch_add(&log_dropped, 1);
+            return;
+        } else {
+            pos = atomic_load_explicit(&log_enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    int len = snprintf(slot->text, LOG_SLOT_SIZE, "[%s] ", level_names[level]);
+    va_list args;
+    va_start(args, fmt);
+    int body = vsnprintf(slot->text + len, LOG_SLOT_SIZE - len, fmt, args);
+    va_end(args);
+
+    len += body < 0 ? 0 : body;
+    if (len > LOG_SLOT_SIZE - 2) len = LOG_SLOT_SIZE - 2;  // Truncated: keep room for the newline
+    slot->text[len++] = '\n';
+    slot->len = len;
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        buf += n;
+        len -= n;
+    }
+}
+
+// Copy every published message out of the ring and write them in as few syscalls as possible
+static int drain_ring() {
+    static char batch[LOG_DRAIN_BUFFER];
+    size_t used = 0;
+    int drained = 0;
+
+    pthread_mutex_lock(&log_drain_lock);
+    while (1) {
+        log_slot *slot = &log_ring[log_dequeue_pos & (LOG_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != log_dequeue_pos + 1) break;  // Not yet published
+
+        if (used + slot->len > sizeof(batch)) {
+            write_all(STDOUT_FILENO, batch, used);
+            used = 0;
+        }
+        memcpy(batch + used, slot->text, slot->len);
+        used += slot->len;
+
+        atomic_store_explicit(&slot->seq, log_dequeue_pos + LOG_SLOTS, memory_order_release);
+        log_dequeue_pos++;
+        drained++;
+    }
+    if (used > 0) write_all(STDOUT_FILENO, batch, used);
+    pthread_mutex_unlock(&log_drain_lock);
+
+    atomic_fetch_add(&log_written, drained);
+    return drained;
+}
+
+static void *log_writer(void *arg) {
+    struct timespec idle = { 0, LOG_IDLE_SLEEP_NS };
+    while (1) {
+        if (drain_ring() == 0) nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+// fork() copies the ring but not the writer thread: hand the child an empty ring and an unlocked drain
+static void before_fork() {
+    pthread_mutex_lock(&log_drain_lock);
+}
+
+static void after_fork_parent() {
+    pthread_mutex_unlock(&log_drain_lock);
+}
+
+static void after_fork_child() {
+    pthread_mutex_unlock(&log_drain_lock);
+    writer_running = 0;
+}
+
+void log_start_writer() {
+    if (writer_running) return;
+
+    // The writer must not take process signals meant for the accept loop
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_writer, NULL) == 0) {
+        pthread_detach(thread);
+        writer_running = 1;
+    } else {
+        perror("Log writer creation failed");
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void log_init(int level) {
+    log_runtime_level = level;
+    for (size_t i = 0; i < LOG_SLOTS; i++) {
+        atomic_init(&log_ring[i].seq, i);
+    }
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+    log_start_writer();
+}
+
+void log_flush() {
+    drain_ring();
+}
+
+void print_log_stats(FILE *out) {
+    fprintf(out, "log: level=%s compiled_max=%s written=%ld dropped=%ld\n",
+            level_names[log_runtime_level], level_names[LOG_COMPILE_LEVEL],
+            atomic_load(&log_written), atomic_load(&log_dropped));
+}
+
 void create_log_directory(const char *log_path) {
     char dir_path[256];
     strncpy(dir_path, log_path, sizeof(dir_path) - 1);
@@ -23,33 +196,41 @@ void create_log_directory(const char *log_path) {
 }
 
 
-// Open log file safely
-FILE *open_log_file(const char *log_path) {
-    create_log_directory(log_path);
+// Open the access log once and keep it; O_APPEND keeps each record's write atomic
+static int open_log_file(const char *log_path) {
+    int fd = atomic_load(&access_log_fd);
+    if (fd >= 0) return fd;
 
-    FILE *log_file = fopen(log_path, "a");  // Use "a" mode to append to the file
-    if (!log_file) {
-        perror("Failed to open log file");
-        return NULL; 
+    pthread_mutex_lock(&access_log_lock);
+    if (access_log_fd < 0) {
+        create_log_directory(log_path);
+        fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) perror("Failed to open log file");
+        else atomic_store(&access_log_fd, fd);
     }
-    return log_file;
+    fd = atomic_load(&access_log_fd);
+    pthread_mutex_unlock(&access_log_lock);
+    return fd;
 }
 
 void log_request(const char *log_path, const char *client_ip, const char *request_line, int status, int response_size) {
-    FILE *log_file = open_log_file(log_path);
-    if (!log_file) return;
+    int log_fd = open_log_file(log_path);
+    if (log_fd < 0) return;
 
     time_t now = time(NULL);
-    struct tm *tm_info = gmtime(&now);
+    struct tm tm_info;
+    gmtime_r(&now, &tm_info);
     char time_str[30];
-    strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M:%S.000Z", tm_info);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M:%S.000Z", &tm_info);
 
-    // DEBUG: Print logged status to verify
-    printf("[LOG] %s %s \"%s\" %d %d\n", time_str, client_ip, request_line, status, response_size);
+    char record[BUFFER_SIZE];
+    int len = snprintf(record, sizeof(record), "%s %s \"%s\" %d %d\n", time_str, client_ip, request_line, status, response_size);
+    if (len < 0) return;
+    if ((size_t)len >= sizeof(record)) {
+        len = sizeof(record) - 1;
+        record[len - 1] = '\n';
+    }
 
-    fprintf(log_file, "%s %s \"%s\" %d %d\n", time_str, client_ip, request_line, status, response_size);
-    fclose(log_file);
+    LOG_DEBUG("%.*s", len - 1, record);
+    write_all(log_fd, record, len);
 }
-
-
-
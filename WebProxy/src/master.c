@@ -0,0 +1,250 @@
+#include "proxy.h"
+#include <errno.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+// Master/worker process model.
+// The master owns the listening socket and forks workers that all accept on it.
+// It never serves traffic itself; it only relays signals and keeps the worker
+// count up:
+//   SIGHUP         workers reload the blocklist
+//   SIGQUIT        stop accepting, let in-flight requests finish, then exit
+//   SIGTERM/SIGINT stop now
+//   SIGUSR2        re-exec the binary with the listener handed over; once the new
+//                  master is up it sends SIGQUIT to the old one, which drains
+//   SIGUSR1, SIGTTIN, SIGTTOU are forwarded to every worker
+
+#define MAX_WORKERS 64
+#define LISTEN_FD_ENV "MYPROXY_LISTEN_FD"
+#define OLD_MASTER_ENV "MYPROXY_OLD_MASTER"
+#define RESPAWN_BACKOFF_NS 1000000000LL  // Workers dying faster than this are respawned after a pause
+
+typedef struct {
+    pid_t pid;
+    long long started_ns;
+} worker_slot;
+
+static const int master_signals[] = { SIGCHLD, SIGHUP, SIGQUIT, SIGTERM, SIGINT, SIGUSR1, SIGUSR2, SIGTTIN, SIGTTOU, 0 };
+
+static volatile sig_atomic_t received[NSIG];
+static worker_slot workers[MAX_WORKERS];
+static int worker_count = 0;
+static pid_t old_master_pid = 0;
+static pid_t upgrade_pid = 0;
+static char **saved_argv = NULL;
+
+void master_save_argv(char **argv) {
+    saved_argv = argv;
+}
+
+int open_listener(int port) {
+    // A new binary started by SIGUSR2 keeps serving on the socket its predecessor bound
+    const char *inherited = getenv(LISTEN_FD_ENV);
+    const char *old_master = getenv(OLD_MASTER_ENV);
+    if (inherited) {
+        int fd = atoi(inherited);
+        int accepting = 0;
+        socklen_t len = sizeof(accepting);
+        unsetenv(LISTEN_FD_ENV);
+        if (old_master) old_master_pid = atoi(old_master);
+        unsetenv(OLD_MASTER_ENV);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) == 0 && accepting) {
+            LOG_INFO("Inherited listening socket %d from process %d", fd, (int)old_master_pid);
+            return fd;
+        }
+        LOG_WARN("Inherited fd %s is not a listening socket, binding a new one", inherited);
+        old_master_pid = 0;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Allow quick restarts while old connections sit in TIME_WAIT
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Binding failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(fd, MAX_CONNECTIONS) < 0) {
+        perror("Listening failed");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+void notify_old_master() {
+    if (old_master_pid <= 0) return;
+    LOG_INFO("Asking previous process %d to drain", (int)old_master_pid);
+    kill(old_master_pid, SIGQUIT);
+    old_master_pid = 0;
+}
+
+pid_t spawn_upgrade(int listen_fd) {
+    log_flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Upgrade fork failed");
+        return -1;
+    }
+    if (pid > 0) return pid;
+
+    // argv[0] is re-resolved, so a binary replaced on disk is what starts
+    char value[32];
+    snprintf(value, sizeof(value), "%d", listen_fd);
+    setenv(LISTEN_FD_ENV, value, 1);
+    snprintf(value, sizeof(value), "%d", (int)getppid());
+    setenv(OLD_MASTER_ENV, value, 1);
+
+    // Only the listener crosses over; client and upstream sockets must close when this process is done with them
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    for (int fd = 3; fd < max_fd; fd++) {
+        if (fd != listen_fd) close(fd);
+    }
+
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    execvp(saved_argv[0], saved_argv);
+    perror("Upgrade exec failed");
+    _exit(EXIT_FAILURE);
+}
+
+static void handle_master_signal(int signo) {
+    received[signo] = 1;
+}
+
+static int take_signal(int signo) {
+    if (!received[signo]) return 0;
+    received[signo] = 0;
+    return 1;
+}
+
+static void signal_workers(int signo) {
+    for (int i = 0; i < worker_count; i++) {
+        if (workers[i].pid > 0) kill(workers[i].pid, signo);
+    }
+}
+
+static void spawn_worker(int slot, int listen_fd, const char *log_path, int allow_untrusted) {
+    log_flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Worker fork failed");
+        workers[slot].pid = 0;
+        return;
+    }
+
+    if (pid == 0) {
+#ifdef __linux__
+        prctl(PR_SET_PDEATHSIG, SIGQUIT);  // Drain if the master is killed outright
+#endif
+        // Signals stay blocked until run_worker() has its own handlers in place
+        run_worker(listen_fd, log_path, allow_untrusted, 0);
+        exit(EXIT_SUCCESS);
+    }
+
+    workers[slot].pid = pid;
+    workers[slot].started_ns = monotonic_ns();
+}
+
+// Collect exited children; returns how many workers are still running
+static int reap_children(int respawn, int listen_fd, const char *log_path, int allow_untrusted) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (pid == upgrade_pid) {
+            LOG_WARN("New binary %d exited with status %d, keeping the current one", (int)pid, status);
+            upgrade_pid = 0;
+            continue;
+        }
+
+        for (int i = 0; i < worker_count; i++) {
+            if (workers[i].pid != pid) continue;
+            workers[i].pid = 0;
+            if (!respawn) break;
+
+            LOG_WARN("Worker %d exited with status %d, respawning", (int)pid, status);
+            if (monotonic_ns() - workers[i].started_ns < RESPAWN_BACKOFF_NS) sleep(1);
+            spawn_worker(i, listen_fd, log_path, allow_untrusted);
+            break;
+        }
+    }
+
+    int live = 0;
+    for (int i = 0; i < worker_count; i++) {
+        if (workers[i].pid > 0) live++;
+    }
+    return live;
+}
+
+void run_master(int listen_fd, int count, const char *log_path, int allow_untrusted) {
+    if (count > MAX_WORKERS) count = MAX_WORKERS;
+
+    struct sigaction sa;
+    sa.sa_handler = handle_master_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_NOCLDSTOP;
+
+    // Signals are only taken inside sigsuspend(), so the loop never races a handler
+    sigset_t handled, orig_mask;
+    sigemptyset(&handled);
+    for (int i = 0; master_signals[i]; i++) {
+        sigaddset(&handled, master_signals[i]);
+        sigaction(master_signals[i], &sa, NULL);
+    }
+    sigprocmask(SIG_BLOCK, &handled, &orig_mask);
+
+    worker_count = count;
+    for (int i = 0; i < count; i++) spawn_worker(i, listen_fd, log_path, allow_untrusted);
+    LOG_INFO("Master %d started %d workers", (int)getpid(), count);
+    notify_old_master();
+
+    int stopping = 0;
+    while (1) {
+        sigsuspend(&orig_mask);
+
+        if (take_signal(SIGCHLD) && reap_children(!stopping, listen_fd, log_path, allow_untrusted) == 0 && stopping) break;
+        if (take_signal(SIGHUP)) {
+            LOG_INFO("Reload requested, signalling workers");
+            signal_workers(SIGHUP);
+        }
+        if (take_signal(SIGUSR1)) signal_workers(SIGUSR1);
+        if (take_signal(SIGTTIN)) signal_workers(SIGTTIN);
+        if (take_signal(SIGTTOU)) signal_workers(SIGTTOU);
+        if (take_signal(SIGUSR2) && !stopping) {
+            if (upgrade_pid > 0) LOG_WARN("Upgrade already in progress (process %d)", (int)upgrade_pid);
+            else {
+                upgrade_pid = spawn_upgrade(listen_fd);
+                if (upgrade_pid > 0) LOG_INFO("Started new binary as process %d", (int)upgrade_pid);
+            }
+        }
+        if (take_signal(SIGQUIT) && !stopping) {
+            LOG_INFO("Graceful shutdown: draining workers");
+            stopping = 1;
+            close(listen_fd);
+            signal_workers(SIGQUIT);
+        }
+        if ((take_signal(SIGTERM) | take_signal(SIGINT))) {
+            LOG_INFO("Stopping workers");
+            stopping = 1;
+            signal_workers(SIGTERM);
+        }
+        if (stopping && reap_children(0, listen_fd, log_path, allow_untrusted) == 0) break;
+    }
+
+    LOG_INFO("Master %d exiting", (int)getpid());
+    log_flush();
+}
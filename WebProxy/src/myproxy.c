@@ -7,20 +7,43 @@
 #include <unistd.h>
 
 
-volatile atomic_int running = 1; // Global flag to stop proxy on SIGINT
-int server_fd;
+volatile sig_atomic_t running = 1;         // Cleared by SIGTERM/SIGINT: stop now
+volatile sig_atomic_t draining = 0;        // Set by SIGQUIT: stop accepting, finish in-flight requests
+volatile sig_atomic_t reload_requested = 0;
+volatile sig_atomic_t upgrade_requested = 0;
+volatile sig_atomic_t stats_requested = 0;
+static const char *blocklist_path = "forbidden_sites.txt";
+
+void handle_sighup(int signo) {
+    reload_requested = 1;  // Reloaded from the accept loop, not from signal context
+}
+
+void handle_sigquit(int signo) {
+    draining = 1;
+}
 
-void handle_sigint(int signo) {
-    printf("\nSIGINT received: Reloading forbidden sites list...\n");
-    load_forbidden_sites("forbidden_sites.txt");
-    printf("Blocklist updated. New count: %d sites\n", num_forbidden_sites);
+void handle_stop(int signo) {
+    running = 0;
+}
+
+void handle_sigusr2(int signo) {
+    upgrade_requested = 1;
+}
+
+void handle_sigusr1(int signo) {
+    stats_requested = 1;  // Dumped from the accept loop, not from signal context
+}
+
+
+void handle_trace_rate(int signo) {
+    trace_adjust_rate(signo == SIGTTIN);  // SIGTTIN doubles the sampling rate, SIGTTOU halves it
 }
 
 
 void close_forbidden_connections() {
     for (int i = 0; i < MAX_CONNECTIONS; i++) {
         if (active_connections[i].in_use && is_site_blocked(active_connections[i].host)) {
-            printf("Closing connection to forbidden site: %s\n", active_connections[i].host);
+            LOG_INFO("Closing connection to forbidden site: %s", active_connections[i].host);
             close(active_connections[i].client_fd);
             active_connections[i].in_use = 0;  // Mark connection as closed
         }
@@ -29,59 +52,123 @@ void close_forbidden_connections() {
 
 
 connection_entry active_connections[MAX_CONNECTIONS] = {0};  // Initialize to zero
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
-void start_proxy(int port, const char *forbidden_sites_path, const char *log_path, int allow_untrusted) {
-    load_forbidden_sites(forbidden_sites_path);
+// Returns the claimed active_connections[] index, or -1 if the table is full
+int claim_connection_slot(int client_fd, const struct sockaddr_in *client_addr) {
+    pthread_mutex_lock(&connections_lock);
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (!active_connections[i].in_use) {
+            active_connections[i].client_fd = client_fd;
+            active_connections[i].client_addr = *client_addr;
+            active_connections[i].host[0] = '\0';
+            active_connections[i].in_use = 1;
+            pthread_mutex_unlock(&connections_lock);
+            return i;
+        }
+    }
+    pthread_mutex_unlock(&connections_lock);
+    return -1;
+}
+
+void set_connection_host(int slot, const char *host) {
+    if (slot < 0) return;
+    strncpy(active_connections[slot].host, host, sizeof(active_connections[slot].host) - 1);
+    active_connections[slot].host[sizeof(active_connections[slot].host) - 1] = '\0';
+}
+
+void release_connection_slot(int slot) {
+    if (slot < 0) return;
+    pthread_mutex_lock(&connections_lock);
+    active_connections[slot].in_use = 0;
+    pthread_mutex_unlock(&connections_lock);
+}
+
+
+// Accept loop of one serving process; standalone when no master is supervising it
+void run_worker(int listen_fd, const char *log_path, int allow_untrusted, int standalone) {
+    log_start_writer();  // A forked worker has no writer thread yet
     signal(SIGPIPE, SIG_IGN);
 
-    //Reload forbidden sites on Ctrl+C
     struct sigaction sa;
-    sa.sa_handler = handle_sigint;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
-    sigaction(SIGINT, &sa, NULL);
 
+    //Reload the blocklist on SIGHUP
+    sa.sa_handler = handle_sighup;
+    sigaction(SIGHUP, &sa, NULL);
 
+    //Graceful drain on SIGQUIT, immediate stop on SIGTERM or Ctrl+C
+    sa.sa_handler = handle_sigquit;
+    sigaction(SIGQUIT, &sa, NULL);
+    sa.sa_handler = handle_stop;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
+    //Dump runtime stats on SIGUSR1
+    sa.sa_handler = handle_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+    //Adjust trace sampling at runtime
+    sa.sa_handler = handle_trace_rate;
+    sigaction(SIGTTIN, &sa, NULL);
+    sigaction(SIGTTOU, &sa, NULL);
 
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Binding failed");
-        exit(EXIT_FAILURE);
+    //Without a master, SIGUSR2 starts the new binary directly
+    if (standalone) {
+        sa.sa_handler = handle_sigusr2;
+        sigaction(SIGUSR2, &sa, NULL);
     }
 
-    if (listen(server_fd, MAX_CONNECTIONS) < 0) {
-        perror("Listening failed");
-        exit(EXIT_FAILURE);
-    }
-
-    printf("Proxy server running on port %d...\n", port);
-
-    while (running) {
+    // Worker threads inherit this mask so signals interrupt accept() in the main thread
+    sigset_t worker_mask, accept_mask;
+    sigemptyset(&worker_mask);
+    sigaddset(&worker_mask, SIGHUP);
+    sigaddset(&worker_mask, SIGQUIT);
+    sigaddset(&worker_mask, SIGTERM);
+    sigaddset(&worker_mask, SIGINT);
+    sigaddset(&worker_mask, SIGUSR1);
+    sigaddset(&worker_mask, SIGUSR2);
+    sigaddset(&worker_mask, SIGTTIN);
+    sigaddset(&worker_mask, SIGTTOU);
+    sigprocmask(SIG_UNBLOCK, &worker_mask, NULL);
+
+    LOG_INFO("Process %d accepting connections", (int)getpid());
+
+    while (running && !draining) {
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
         
-        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+        int client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &client_len);
+        if (stats_requested) {
+            stats_requested = 0;
+            dump_stats(stdout);
+        }
+        if (reload_requested) {
+            reload_requested = 0;
+            load_forbidden_sites(blocklist_path);
+        }
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            pid_t pid = spawn_upgrade(listen_fd);
+            if (pid > 0) LOG_INFO("Started new binary as process %d", (int)pid);
+        }
         if (client_fd < 0) {
             if (errno == EINTR) continue;
             perror("Accept failed");
             continue;
         }
 
+        // Shed or throttle before spending a thread on the client
+        long long accepted_ns = monotonic_ns();
+        if (!admission_check(client_fd, &client_addr, accepted_ns)) continue;
+
         // Allocate memory for client info struct
         client_info *info = malloc(sizeof(client_info));
         if (!info) {
             perror("Memory allocation failed");
+            admission_release();
             close(client_fd);
             continue;
         }
@@ -92,13 +179,18 @@ void start_proxy(int port, const char *forbidden_sites_path, const char *log_pat
         info->allow_untrusted = allow_untrusted;
         strncpy(info->log_path, log_path, sizeof(info->log_path));
         info->log_path[sizeof(info->log_path) - 1] = '\0';  // Ensure null termination
+        info->accepted_ns = accepted_ns;
 
 
         
 
         pthread_t thread;
-        if (pthread_create(&thread, NULL, handle_client, info) != 0) {
+        pthread_sigmask(SIG_BLOCK, &worker_mask, &accept_mask);
+        int rc = pthread_create(&thread, NULL, handle_client, info);
+        pthread_sigmask(SIG_SETMASK, &accept_mask, NULL);
+        if (rc != 0) {
             perror("Thread creation failed");
+            admission_release();
             free(info);
             close(client_fd);
             continue;
@@ -107,8 +199,32 @@ void start_proxy(int port, const char *forbidden_sites_path, const char *log_pat
         pthread_detach(thread);
     }
 
-    printf("Shutting down proxy...\n");
-    close(server_fd);
+    close(listen_fd);
+    if (running && draining) {
+        // Other processes keep accepting on the shared socket; just finish what is in flight
+        LOG_INFO("Draining %d in-flight clients...", admission_active());
+        long long deadline = monotonic_ns() + DRAIN_TIMEOUT_MS * 1000000LL;
+        while (running && admission_active() > 0 && monotonic_ns() < deadline) usleep(50000);
+    }
+
+    LOG_INFO("Shutting down proxy...");
+    log_flush();
+}
+
+
+void start_proxy(int port, const char *forbidden_sites_path, const char *log_path, int allow_untrusted, int workers) {
+    blocklist_path = forbidden_sites_path;
+    load_forbidden_sites(forbidden_sites_path);
+
+    int listen_fd = open_listener(port);
+    LOG_INFO("Proxy server running on port %d...", port);
+
+    if (workers > 0) {
+        run_master(listen_fd, workers, log_path, allow_untrusted);
+        return;
+    }
+    notify_old_master();
+    run_worker(listen_fd, log_path, allow_untrusted, 1);
 }
 
 
@@ -124,6 +240,16 @@ int main(int argc, char *argv[]) {
     char *log_path = NULL;
 
     int allow_untrusted = 0;
+    int use_ktls = 0;
+    char *trace_path = NULL;
+    int trace_permille = 10;
+    int log_level = LOG_LEVEL_INFO;
+    int workers = 0;
+    long long cache_mb = 0, cache_object_mb = -1;
+    int cache_swr = 0;
+    upstream_config upstream = { .per_origin_max = 0, .global_max = 0, .queue_max = 16, .queue_timeout_ms = 5000 };
+    compress_config compress = { .level = 0, .min_bytes = 1024 };
+    admission_config admission = { .max_active = 0, .max_queue_ms = 0, .rate_per_ip = 0, .burst_per_ip = 10 };
 
     SSL_library_init();
     SSL_load_error_strings();
@@ -132,17 +258,59 @@ int main(int argc, char *argv[]) {
 
     // Parse command-line arguments
     for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-p") == 0) port = atoi(argv[++i]);
-        else if (strcmp(argv[i], "-a") == 0) forbidden_sites_path = argv[++i];
-        else if (strcmp(argv[i], "-l") == 0) log_path = argv[++i];
+        int has_value = i + 1 < argc;
+        if (strcmp(argv[i], "-p") == 0 && has_value) port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-a") == 0 && has_value) forbidden_sites_path = argv[++i];
+        else if (strcmp(argv[i], "-l") == 0 && has_value) log_path = argv[++i];
         else if (strcmp(argv[i], "-untrusted") == 0) allow_untrusted = 1;
+        else if (strcmp(argv[i], "-workers") == 0 && has_value) workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-ktls") == 0) use_ktls = 1;
+        else if (strcmp(argv[i], "-trace") == 0 && has_value) trace_path = argv[++i];
+        else if (strcmp(argv[i], "-trace-permille") == 0 && has_value) trace_permille = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-log-level") == 0 && has_value) log_level = log_level_from_name(argv[++i]);
+        else if (strcmp(argv[i], "-compress") == 0 && has_value) compress.level = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-compress-min") == 0 && has_value) compress.min_bytes = atoll(argv[++i]);
+        else if (strcmp(argv[i], "-cache-mb") == 0 && has_value) cache_mb = atoll(argv[++i]);
+        else if (strcmp(argv[i], "-cache-object-mb") == 0 && has_value) cache_object_mb = atoll(argv[++i]);
+        else if (strcmp(argv[i], "-cache-swr") == 0 && has_value) cache_swr = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-origin-max") == 0 && has_value) upstream.per_origin_max = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-origin-queue") == 0 && has_value) upstream.queue_max = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-origin-queue-ms") == 0 && has_value) upstream.queue_timeout_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-upstream-max") == 0 && has_value) upstream.global_max = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-max-active") == 0 && has_value) admission.max_active = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-max-queue-ms") == 0 && has_value) admission.max_queue_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-rate") == 0 && has_value) admission.rate_per_ip = atof(argv[++i]);
+        else if (strcmp(argv[i], "-burst") == 0 && has_value) admission.burst_per_ip = atoi(argv[++i]);
+        else port = -1;  // Unknown flag: fall through to usage
     }
 
-    if (argc < 7 || (argc != 7 + allow_untrusted)) {
-        fprintf(stderr, "Usage: %s -p <port> -a <forbidden_file> -l <log_file> [-untrusted]\n", argv[0]);
+    if (port <= 0 || !forbidden_sites_path || !log_path || admission.burst_per_ip < 1 ||
+        trace_permille < 0 || trace_permille > 1000 || log_level < 0 ||
+        compress.level < 0 || compress.level > 11 || upstream.queue_max < 0 || upstream.queue_timeout_ms < 0 ||
+        workers < 0 || cache_mb < 0 || cache_swr < 0) {
+        fprintf(stderr, "Usage: %s -p <port> -a <forbidden_file> -l <log_file> [-untrusted] [-ktls] [-workers <n>]\n"
+                        "          [-max-active <n>] [-max-queue-ms <ms>] [-rate <req/s per IP>] [-burst <n>]\n"
+                        "          [-origin-max <n>] [-upstream-max <n>] [-origin-queue <n>] [-origin-queue-ms <ms>]\n"
+                        "          [-trace <file> [-trace-permille <0-1000>]]\n"
+                        "          [-compress <level 1-9, 10-11 brotli only> [-compress-min <bytes>]]\n"
+                        "          [-cache-mb <n> [-cache-object-mb <n>] [-cache-swr <seconds>]]\n"
+                        "          [-log-level error|warn|info|debug|trace]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    start_proxy(port, forbidden_sites_path, log_path, allow_untrusted);
+    log_init(log_level);
+    admission_configure(&admission);
+    compress_configure(&compress);
+    upstream_configure(&upstream);
+
+    // One object may take a quarter of the cache unless told otherwise
+    if (cache_object_mb < 0 || cache_object_mb > cache_mb) cache_object_mb = cache_mb / 4 > 0 ? cache_mb / 4 : cache_mb;
+    cache_config cache = { .max_bytes = cache_mb << 20, .max_object_bytes = cache_object_mb << 20,
+                           .stale_while_revalidate_s = cache_swr, .allow_untrusted = allow_untrusted };
+    cache_configure(&cache);
+    ktls_init(use_ktls);
+    if (trace_path) trace_init(trace_path, trace_permille);
+    master_save_argv(argv);
+    start_proxy(port, forbidden_sites_path, log_path, allow_untrusted, workers);
     return 0;
 }
@@ -13,6 +13,8 @@
 #include <pthread.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -20,38 +22,247 @@
 #define BUFFER_SIZE 8192
 #define MAX_CONNECTIONS 50
 #define DEFAULT_HTTPS_PORT 443
+#define MAX_HEADERS 64
+#define RELAY_BUFFER_SIZE (64 * 1024)     // Per direction, caps memory per connection
+#define RELAY_IDLE_TIMEOUT_MS 30000
+#define COALESCE_MIN_BYTES (16 * 1024)    // First fan-out allocation, doubled as the response arrives
+#define COALESCE_MAX_BYTES (1024 * 1024)  // Fan-out ring per in-flight fetch; followers further behind detach
+#define DRAIN_TIMEOUT_MS 60000            // Longest a draining process waits for in-flight clients
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_TRACE 4
+
+// Calls above this level compile out; set with "make LOG_LEVEL=..."
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_AT(level, ...) \
+    do { \
+        if ((level) <= LOG_COMPILE_LEVEL && (level) <= log_runtime_level) log_message((level), __VA_ARGS__); \
+    } while (0)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
 
 typedef struct {
     int client_fd;
     struct sockaddr_in client_addr;
     int allow_untrusted;
     char log_path[256];
+    long long accepted_ns;  // Monotonic time accept() returned, for queueing delay
 } client_info;
 
+typedef struct {
+    int max_active;       // Shed new clients while this many are in service (0 = no limit)
+    int max_queue_ms;     // Shed while accept-to-service delay is above this (0 = off)
+    double rate_per_ip;   // Requests per second allowed per client IP (0 = no limit)
+    int burst_per_ip;
+} admission_config;
+
+typedef struct {
+    int per_origin_max;   // Upstream connections per host:port (0 = no limit)
+    int global_max;       // Upstream connections in total, shared fairly (0 = no limit)
+    int queue_max;        // Requests allowed to wait per origin
+    int queue_timeout_ms;
+} upstream_config;
+
+#define UPSTREAM_UNTRACKED -1  // Limits off: nothing to release
+#define UPSTREAM_REJECTED -2   // Queue full or wait timed out
+
 typedef struct {
     int client_fd;
     struct sockaddr_in client_addr;
     int in_use;
     char host[256];  // Store hostname for checking against blocklist
+    atomic_long buffered_bytes;  // Relay bytes waiting for a slow peer
 } connection_entry;
+
+typedef struct {
+    const char *name;
+    size_t name_len;
+    const char *value;    // Value with surrounding whitespace trimmed
+    size_t value_len;
+    const char *line;     // Whole "Name: value\r\n" line, forwarded as-is
+    size_t line_len;
+} header_field;
+
+typedef struct {
+    header_field fields[MAX_HEADERS];
+    int count;
+    const char *end;      // First byte after the blank line
+} header_table;
+
+typedef enum {
+    TRACE_PARSE,
+    TRACE_BLOCKLIST,
+    TRACE_ORIGIN_QUEUE,
+    TRACE_DNS,
+    TRACE_CONNECT,
+    TRACE_TLS,
+    TRACE_FIRST_BYTE,
+    TRACE_RELAY,
+} trace_span_id;
+
+typedef enum {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_BROTLI,
+} content_encoding;
+
+typedef struct {
+    int level;            // gzip level / brotli quality (0 = compression off)
+    long long min_bytes;  // Leave responses with a smaller Content-Length alone
+} compress_config;
+
+typedef struct response_encoder response_encoder;
+
+typedef struct {
+    size_t max_bytes;         // Total cached body and header bytes (0 = cache off)
+    size_t max_object_bytes;  // Largest body kept from a single response
+    int stale_while_revalidate_s;  // Serve expired objects this long while refreshing them
+    int allow_untrusted;      // Revalidation connects to origins like a client fetch does
+} cache_config;
+
+typedef struct cache_fill cache_fill;
+
+typedef struct flight {
+    char key[384];
+    char *data;        // Ring of the last cap response bytes; byte n lives at data[n % cap]
+    size_t cap;        // Grows up to COALESCE_MAX_BYTES, fixed once the ring wraps
+    size_t len;        // Response bytes seen so far
+    char head[BUFFER_SIZE];  // Copy of the response head, kept for resuming detached followers
+    size_t head_len;   // Set once the whole head has been seen
+    int done;
+    int failed;        // Leader could not reach the origin
+    int refs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct flight *next;
+} flight;
+
+// Where a follower that already forwarded part of a leader's response picks up again
+typedef struct {
+    long long body_offset;  // First body byte the client has not seen
+    long long total;        // Leader's Content-Length
+    char validator[256];    // Strong ETag or Last-Modified, echoed as If-Range
+} resume_point;
+
 extern int num_forbidden_sites;
 
 extern connection_entry active_connections[MAX_CONNECTIONS];
 /*Function Declaration*/
 //myproxy.c
-void start_proxy(int port, const char *forbidden_sites_path, const char *log_path, int allow_untrusted);
+void start_proxy(int port, const char *forbidden_sites_path, const char *log_path, int allow_untrusted, int workers);
+void run_worker(int listen_fd, const char *log_path, int allow_untrusted, int standalone);
 void close_forbidden_connections();
+int claim_connection_slot(int client_fd, const struct sockaddr_in *client_addr);
+void set_connection_host(int slot, const char *host);
+void release_connection_slot(int slot);
+extern volatile sig_atomic_t stats_requested;
 //connection.c
 void *handle_client(void *client_socket);
+int connect_to_server(const char *host, int port, int *server_fd, SSL **ssl, SSL_CTX **ssl_ctx, int allow_untrusted);
+int extract_port(const char *url);
 int extract_host_and_path(const char *url, char *host, size_t host_len, char *path, size_t path_len);
 void modify_request_headers(char *buffer, const char *host);
 void forward_request(int server_fd, SSL *ssl, const char *buffer);
 void handle_response(int client_fd, int server_fd, SSL *ssl);
+ssize_t read_request_head(int client_fd, char *buffer, size_t buf_size);
 //filtering.c
 void load_forbidden_sites(const char *filename);
 void sort_forbidden_sites();
 int is_site_blocked(const char *host);
-void reload_forbidden_sites(int signo);
+//headers.c
+int parse_headers(const char *buffer, size_t len, header_table *table);
+const header_field *find_header(const header_table *table, const char *name);
+int request_is_shareable(const header_table *table);
+int request_is_cacheable(const header_table *table);
+int build_upstream_request(const header_table *table, const char *method, const char *path,
+                           const char *version, const char *host, const char *client_ip,
+                           const char *extra, int identity_only, char *scratch, size_t scratch_len, struct iovec *iov);
+int send_upstream_request(int server_fd, SSL *ssl, struct iovec *iov, int count);
+//relay.c
+size_t relay_response(int client_fd, int server_fd, SSL *ssl, const char *preread, size_t preread_len, int head_only,
+                      flight *inflight, cache_fill *fill, const resume_point *resume, int encoding, int conn_slot, int *ok);
+void print_relay_stats(FILE *out);
+//coalesce.c
+void make_cache_key(const char *host, const char *path, const header_table *request, char *key, size_t key_len);
+flight *coalesce_join(const char *key, int *is_leader);
+void coalesce_append(flight *f, const char *buf, size_t len);
+void coalesce_finish(flight *f, int ok);
+void coalesce_release(flight *f);
+size_t coalesce_follow(flight *f, int client_fd, int *complete);
+int coalesce_resume_point(flight *f, size_t sent, resume_point *resume);
+void print_coalesce_stats(FILE *out);
+//compress.c
+void compress_configure(const compress_config *cfg);
+int choose_encoding(const header_table *request);
+response_encoder *encoder_create(int encoding);
+size_t encoder_input_room(response_encoder *e, char **where);
+void encoder_commit_input(response_encoder *e, size_t len);
+size_t encoder_produce(response_encoder *e, char *out, size_t room, int final);
+int encoder_pending(const response_encoder *e);
+void encoder_destroy(response_encoder *e);
+void print_compress_stats(FILE *out);
+//cache.c
+void cache_configure(const cache_config *cfg);
+int cache_enabled();
+int cache_serve(const char *host, int port, const char *path, const header_table *request, int encoding,
+                int client_fd, size_t *sent);
+cache_fill *cache_fill_begin(const char *host, int port, const char *path);
+void cache_fill_append(cache_fill *f, const char *data, size_t len);
+void cache_fill_end(cache_fill *f, int complete);
+void print_cache_stats(FILE *out);
+//master.c
+void master_save_argv(char **argv);
+int open_listener(int port);
+void notify_old_master();
+pid_t spawn_upgrade(int listen_fd);
+void run_master(int listen_fd, int count, const char *log_path, int allow_untrusted);
+//upstream.c
+void upstream_configure(const upstream_config *cfg);
+int upstream_acquire(const char *host, int port);
+void upstream_release(int handle);
+void print_upstream_stats(FILE *out);
+//admission.c
+long long monotonic_ns();
+void admission_configure(const admission_config *cfg);
+int admission_check(int client_fd, const struct sockaddr_in *client_addr, long long now);
+void admission_started(long long accepted_ns);
+void admission_release();
+int admission_active();
+void print_admission_stats(FILE *out);
+//ktls.c
+void ktls_init(int enabled);
+void ktls_prepare(SSL *ssl);
+int ktls_recv_enabled(SSL *ssl);
+void ktls_count_session();
+void ktls_count_splice(size_t bytes, int fell_back);
+void print_ktls_stats(FILE *out);
+//trace.c
+void trace_init(const char *path, int permille);
+void trace_adjust_rate(int up);
+void trace_request_begin(long long accepted_ns);
+void trace_annotate(const char *host, const char *url);
+void trace_span_begin(trace_span_id id);
+void trace_span_end(trace_span_id id);
+void trace_request_end();
+void print_trace_stats(FILE *out);
+//stats.c
+void dump_stats(FILE *out);
 //logging.c
+extern int log_runtime_level;
 void log_request(const char *log_path, const char *client_ip, const char *request_line, int status, int response_size);
+int log_level_from_name(const char *name);
+void log_init(int level);
+void log_start_writer();
+void log_message(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_flush();
+void print_log_stats(FILE *out);
 #endif
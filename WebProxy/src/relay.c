@@ -0,0 +1,488 @@
+#define _GNU_SOURCE  // splice()
+#include "proxy.h"
+#include <poll.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+// Flow-controlled relay.
+// Each direction owns a bounded buffer and the source is only read while that
+// buffer has room. When the destination stops draining (its socket buffer is
+// full) the relay stops pulling from the source instead of blocking inside
+// send() or dropping bytes, so memory per connection stays capped.
+
+typedef struct relay_dir {
+    int src_fd;
+    SSL *src_ssl;
+    const char *preread;   // Source bytes the caller already consumed, replayed before reading more
+    size_t preread_len;
+    int dst_fd;
+    char buf[RELAY_BUFFER_SIZE];
+    size_t head, tail;     // Bytes [head, tail) are waiting for the destination
+    int src_open;
+    short src_wait;        // Poll events the source needs before it can be read again
+    int dst_blocked;
+    int dst_failed;
+    int stalled;
+    int conn_slot;
+    long gauge;
+    size_t delivered;
+    int awaiting_first_byte;  // Ends the first_byte trace span on the first upstream read
+    // Inspects freshly read bytes in place and returns how many of them to keep
+    size_t (*filter)(struct relay_dir *dir, char *data, size_t len);
+    void *filter_ctx;
+    response_encoder *encoder;  // Optional re-encoding stage between the source and buf
+} relay_dir;
+
+typedef struct {
+    int head_only;
+    int crlf_matched;      // Bytes of "\r\n\r\n" matched so far across reads
+    flight *inflight;
+    cache_fill *fill;
+    const resume_point *resume;  // Set while a resumed follower still waits for the 206 head
+    char resume_head[BUFFER_SIZE];
+    size_t resume_head_len;
+    int resume_rejected;
+} response_filter;
+
+static const char header_terminator[] = "\r\n\r\n";
+
+static atomic_long relay_buffered_total = 0;
+static atomic_long relay_stall_count = 0;
+static atomic_long relay_idle_timeouts = 0;
+
+static void relay_dir_init(relay_dir *d, int src_fd, SSL *src_ssl, int dst_fd, int conn_slot) {
+    d->src_fd = src_fd;
+    d->src_ssl = src_ssl;
+    d->preread = NULL;
+    d->preread_len = 0;
+    d->dst_fd = dst_fd;
+    d->head = d->tail = 0;
+    d->src_open = 1;
+    d->src_wait = 0;
+    d->dst_blocked = 0;
+    d->dst_failed = 0;
+    d->stalled = 0;
+    d->conn_slot = conn_slot;
+    d->gauge = 0;
+    d->delivered = 0;
+    d->awaiting_first_byte = 0;
+    d->filter = NULL;
+    d->filter_ctx = NULL;
+    d->encoder = NULL;
+}
+
+static void set_gauge(relay_dir *d, long buffered) {
+    if (buffered == d->gauge) return;
+
+    atomic_fetch_add(&relay_buffered_total, buffered - d->gauge);
+    if (d->conn_slot >= 0) atomic_fetch_add(&active_connections[d->conn_slot].buffered_bytes, buffered - d->gauge);
+    d->gauge = buffered;
+}
+
+static void update_gauge(relay_dir *d) {
+    set_gauge(d, d->tail - d->head);
+}
+
+static void note_first_byte(relay_dir *d) {
+    if (!d->awaiting_first_byte) return;
+    d->awaiting_first_byte = 0;
+    trace_span_end(TRACE_FIRST_BYTE);
+    trace_span_begin(TRACE_RELAY);
+}
+
+// Returns bytes read, 0 at end of stream, -1 if the source has nothing right now
+static ssize_t read_source(relay_dir *d, char *buf, size_t len) {
+    if (d->preread_len > 0) {
+        size_t n = len < d->preread_len ? len : d->preread_len;
+        memcpy(buf, d->preread, n);
+        d->preread += n;
+        d->preread_len -= n;
+        return n;
+    }
+
+    if (d->src_ssl) {
+        int n = SSL_read(d->src_ssl, buf, len);
+        if (n > 0) return n;
+
+        int err = SSL_get_error(d->src_ssl, n);
+        if (err == SSL_ERROR_WANT_READ) {
+            d->src_wait = POLLIN;
+            return -1;
+        }
+        if (err == SSL_ERROR_WANT_WRITE) {
+            d->src_wait = POLLOUT;
+            return -1;
+        }
+        return 0;  // close_notify, or the origin simply dropped the connection
+    }
+
+    ssize_t n = recv(d->src_fd, buf, len, MSG_DONTWAIT);
+    if (n >= 0) return n;
+    if (errno == EINTR) return -1;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        d->src_wait = POLLIN;
+        return -1;
+    }
+    return 0;
+}
+
+// Read through the encoder's staging buffer, then let it fill buf with encoded bytes
+static int pump_encoder(relay_dir *d) {
+    int progress = 0;
+    char *stage;
+    size_t stage_room = encoder_input_room(d->encoder, &stage);
+
+    if (d->src_open && !d->src_wait && stage_room > 0) {
+        ssize_t n = read_source(d, stage, stage_room);
+        if (n > 0) {
+            note_first_byte(d);
+            encoder_commit_input(d->encoder, d->filter ? d->filter(d, stage, n) : (size_t)n);
+            progress = 1;
+        } else if (n == 0) {
+            d->src_open = 0;
+            progress = 1;
+        }
+    }
+
+    if (d->head == d->tail) {
+        d->head = d->tail = 0;
+    } else if (d->tail == RELAY_BUFFER_SIZE && d->head > 0) {
+        memmove(d->buf, d->buf + d->head, d->tail - d->head);
+        d->tail -= d->head;
+        d->head = 0;
+    }
+
+    size_t room = RELAY_BUFFER_SIZE - d->tail;
+    if (room > 0) {
+        size_t n = encoder_produce(d->encoder, d->buf + d->tail, room, !d->src_open);
+        d->tail += n;
+        if (n > 0) progress = 1;
+    }
+    return progress;
+}
+
+// Move whatever can move without blocking; returns 1 if anything happened
+static int pump(relay_dir *d) {
+    int progress = 0;
+
+    if (d->encoder) {
+        progress = pump_encoder(d);
+    } else if (d->src_open && !d->src_wait) {
+        if (d->head == d->tail) {
+            d->head = d->tail = 0;
+        } else if (d->tail == RELAY_BUFFER_SIZE && d->head > 0) {
+            memmove(d->buf, d->buf + d->head, d->tail - d->head);
+            d->tail -= d->head;
+            d->head = 0;
+        }
+
+        size_t room = RELAY_BUFFER_SIZE - d->tail;
+        if (room > 0) {
+            ssize_t n = read_source(d, d->buf + d->tail, room);
+            if (n > 0) {
+                note_first_byte(d);
+                d->tail += d->filter ? d->filter(d, d->buf + d->tail, n) : (size_t)n;
+                progress = 1;
+            } else if (n == 0) {
+                d->src_open = 0;
+                progress = 1;
+            }
+        }
+    }
+
+    if (d->tail > d->head && !d->dst_blocked) {
+        ssize_t n = send(d->dst_fd, d->buf + d->head, d->tail - d->head, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            d->head += n;
+            d->delivered += n;
+            progress = 1;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            d->dst_blocked = 1;
+        } else if (n < 0 && errno != EINTR) {
+            d->dst_failed = 1;  // Destination is gone; nothing left worth reading
+        }
+    }
+
+    int full = d->tail - d->head == RELAY_BUFFER_SIZE;
+    if (full && d->dst_blocked && !d->stalled) atomic_fetch_add(&relay_stall_count, 1);
+    d->stalled = full && d->dst_blocked;
+
+    update_gauge(d);
+    return progress;
+}
+
+static int relay_dir_active(const relay_dir *d) {
+    return d->src_open || d->tail > d->head || (d->encoder && encoder_pending(d->encoder));
+}
+
+// Drive every direction until all sources end and all buffers drain; returns 1 on a clean finish
+static int run_relay(relay_dir **dirs, int count) {
+    int ok = 1;
+
+    while (1) {
+        int progress = 0, active = 0;
+        for (int i = 0; i < count; i++) {
+            progress |= pump(dirs[i]);
+            if (dirs[i]->dst_failed) ok = 0;
+            active |= relay_dir_active(dirs[i]);
+        }
+        if (!ok || !active) break;
+        if (progress) continue;
+
+        // Nothing can move: sleep until the blocked side of some direction is ready
+        struct pollfd pfds[4];
+        relay_dir *owner[4];
+        int waits_on_src[4];
+        int nfds = 0;
+        for (int i = 0; i < count; i++) {
+            relay_dir *d = dirs[i];
+            char *stage;
+            int has_room = d->encoder ? encoder_input_room(d->encoder, &stage) > 0 : d->tail < RELAY_BUFFER_SIZE;
+            if (d->src_open && d->src_wait && has_room) {
+                pfds[nfds] = (struct pollfd){ .fd = d->src_fd, .events = d->src_wait };
+                waits_on_src[nfds] = 1;
+                owner[nfds++] = d;
+            }
+            if (d->tail > d->head && d->dst_blocked) {
+                pfds[nfds] = (struct pollfd){ .fd = d->dst_fd, .events = POLLOUT };
+                waits_on_src[nfds] = 0;
+                owner[nfds++] = d;
+            }
+        }
+        if (nfds == 0) break;
+
+        int rc = poll(pfds, nfds, RELAY_IDLE_TIMEOUT_MS);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) {
+            if (rc == 0) atomic_fetch_add(&relay_idle_timeouts, 1);
+            ok = 0;
+            break;
+        }
+
+        // Any readiness (including errors and hangups) is rediscovered by the next read or send
+        for (int j = 0; j < nfds; j++) {
+            if (!pfds[j].revents) continue;
+            if (waits_on_src[j]) owner[j]->src_wait = 0;
+            else owner[j]->dst_blocked = 0;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        dirs[i]->head = dirs[i]->tail;
+        update_gauge(dirs[i]);
+    }
+    return ok;
+}
+
+// Zero-copy path for kTLS sessions: plaintext moves socket -> pipe -> socket inside the kernel.
+// The pipe plays the role of the bounded buffer. Returns 1 on a clean finish; sets
+// *fell_back when a TLS control record stopped the splice and SSL_read must finish the job.
+static int relay_splice(relay_dir *d, int *fell_back) {
+    int pipefd[2];
+    *fell_back = 1;
+    if (pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) < 0) return 1;
+    fcntl(pipefd[1], F_SETPIPE_SZ, RELAY_BUFFER_SIZE);
+    *fell_back = 0;
+
+    size_t in_pipe = 0;
+    int src_open = 1, src_ready = 1, dst_ready = 1, ok = 1;
+
+    while (src_open || in_pipe > 0) {
+        int progress = 0;
+
+        if (src_open && src_ready && in_pipe < RELAY_BUFFER_SIZE) {
+            ssize_t n = splice(d->src_fd, NULL, pipefd[1], NULL, RELAY_BUFFER_SIZE - in_pipe,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                note_first_byte(d);
+                in_pipe += n;
+                progress = 1;
+            } else if (n == 0) {
+                src_open = 0;
+                progress = 1;
+            } else if (errno == EAGAIN) {
+                src_ready = 0;
+            } else if (errno != EINTR) {
+                // Alerts, tickets and key updates cannot be spliced; drain the pipe and hand over to SSL_read
+                src_open = 0;
+                *fell_back = 1;
+                progress = 1;
+            }
+        }
+
+        if (in_pipe > 0 && dst_ready) {
+            ssize_t n = splice(pipefd[0], NULL, d->dst_fd, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                in_pipe -= n;
+                d->delivered += n;
+                progress = 1;
+            } else if (n < 0 && errno == EAGAIN) {
+                dst_ready = 0;
+            } else if (n < 0 && errno != EINTR) {
+                ok = 0;
+                break;
+            }
+        }
+
+        int full = in_pipe == RELAY_BUFFER_SIZE;
+        if (full && !dst_ready && !d->stalled) atomic_fetch_add(&relay_stall_count, 1);
+        d->stalled = full && !dst_ready;
+        set_gauge(d, in_pipe);
+        if (progress) continue;
+
+        struct pollfd pfds[2];
+        int nfds = 0, src_index = -1;
+        if (src_open && !src_ready && in_pipe < RELAY_BUFFER_SIZE) {
+            src_index = nfds;
+            pfds[nfds++] = (struct pollfd){ .fd = d->src_fd, .events = POLLIN };
+        }
+        if (in_pipe > 0 && !dst_ready) pfds[nfds++] = (struct pollfd){ .fd = d->dst_fd, .events = POLLOUT };
+        if (nfds == 0) break;
+
+        int rc = poll(pfds, nfds, RELAY_IDLE_TIMEOUT_MS);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) {
+            if (rc == 0) atomic_fetch_add(&relay_idle_timeouts, 1);
+            ok = 0;
+            break;
+        }
+        for (int j = 0; j < nfds; j++) {
+            if (!pfds[j].revents) continue;
+            if (j == src_index) src_ready = 1;
+            else dst_ready = 1;
+        }
+    }
+
+    ktls_count_splice(d->delivered, *fell_back);
+    set_gauge(d, 0);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return ok;
+}
+
+// The origin must answer the range with exactly the rest of the body the leader was sending
+static int resume_matches(const resume_point *resume, const char *head, size_t head_len) {
+    header_table t;
+    int status = 0;
+    long long first, last, total;
+    if (sscanf(head, "HTTP/1.%*d %d", &status) != 1 || status != 206) return 0;
+    if (!parse_headers(head, head_len, &t) || find_header(&t, "Transfer-Encoding")) return 0;
+
+    const header_field *range = find_header(&t, "Content-Range");
+    if (!range || sscanf(range->value, "bytes %lld-%lld/%lld", &first, &last, &total) != 3) return 0;
+    return first == resume->body_offset && last == total - 1 && total == resume->total;
+}
+
+// Hold back the 206 head; the client already has the leader's head and gets only body bytes
+static size_t strip_resume_head(relay_dir *d, response_filter *f, char *data, size_t len) {
+    size_t before = f->resume_head_len;
+    size_t room = sizeof(f->resume_head) - 1 - before;
+    size_t take = len < room ? len : room;
+    memcpy(f->resume_head + before, data, take);
+    f->resume_head_len += take;
+    f->resume_head[f->resume_head_len] = '\0';
+
+    const char *end = strstr(f->resume_head, header_terminator);
+    if (!end && f->resume_head_len < sizeof(f->resume_head) - 1) return 0;
+
+    size_t head_len = end ? (size_t)(end + 4 - f->resume_head) : 0;
+    if (!end || !resume_matches(f->resume, f->resume_head, head_len)) {
+        // Anything but the matching range would splice two different responses together
+        f->resume_rejected = 1;
+        d->src_open = 0;
+        return 0;
+    }
+
+    f->resume = NULL;
+    size_t body_from = head_len - before;
+    memmove(data, data + body_from, len - body_from);
+    return len - body_from;
+}
+
+static size_t filter_response(relay_dir *d, char *data, size_t len) {
+    response_filter *f = d->filter_ctx;
+
+    if (f->head_only) {
+        // Forward the status line and headers only, then stop reading the origin
+        for (size_t i = 0; i < len; i++) {
+            f->crlf_matched = data[i] == header_terminator[f->crlf_matched] ? f->crlf_matched + 1
+                            : (data[i] == '\r' ? 1 : 0);
+            if (f->crlf_matched == 4) {
+                d->src_open = 0;
+                return i + 1;
+            }
+        }
+        return len;
+    }
+
+    // Followers of a coalesced fetch see every byte, even ones this client already has
+    if (f->inflight) coalesce_append(f->inflight, data, len);
+    if (f->fill) cache_fill_append(f->fill, data, len);
+
+    if (f->resume) return strip_resume_head(d, f, data, len);
+    return len;
+}
+
+size_t relay_response(int client_fd, int server_fd, SSL *ssl, const char *preread, size_t preread_len, int head_only,
+                      flight *inflight, cache_fill *fill, const resume_point *resume, int encoding, int conn_slot, int *ok) {
+    relay_dir *d = malloc(sizeof(relay_dir));
+    if (!d) {
+        *ok = 0;
+        return 0;
+    }
+
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL, 0) | O_NONBLOCK);
+
+    response_filter *filter = calloc(1, sizeof(response_filter));
+    if (!filter) {
+        free(d);
+        *ok = 0;
+        return 0;
+    }
+    filter->head_only = head_only;
+    filter->inflight = inflight;
+    filter->fill = fill;
+    filter->resume = resume;
+    relay_dir_init(d, server_fd, ssl, client_fd, conn_slot);
+    d->preread = preread;
+    d->preread_len = preread_len;
+    d->filter = filter_response;
+    d->filter_ctx = filter;
+    d->awaiting_first_byte = 1;
+
+    // Re-encoding needs the whole response head, which a resumed follower has already sent
+    if (encoding != ENCODING_IDENTITY && !head_only && !resume) d->encoder = encoder_create(encoding);
+
+    // Responses that need no user-space inspection can skip the copy entirely under kTLS
+    int fell_back = 1;
+    *ok = 1;
+    if (!head_only && !inflight && !fill && !resume && !d->encoder && !preread_len && ktls_recv_enabled(ssl)) {
+        *ok = relay_splice(d, &fell_back);
+    }
+    if (*ok && fell_back) {
+        relay_dir *dirs[] = { d };
+        *ok = run_relay(dirs, 1);
+    }
+    if (filter->resume_rejected) *ok = 0;
+    trace_span_end(TRACE_RELAY);
+    size_t delivered = d->delivered;
+    encoder_destroy(d->encoder);
+    free(filter);
+    free(d);
+    return delivered;
+}
+
+void print_relay_stats(FILE *out) {
+    fprintf(out, "relay: buffered_bytes=%ld stalls=%ld idle_timeouts=%ld\n",
+            atomic_load(&relay_buffered_total), atomic_load(&relay_stall_count),
+            atomic_load(&relay_idle_timeouts));
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        long buffered = atomic_load(&active_connections[i].buffered_bytes);
+        if (!active_connections[i].in_use || buffered == 0) continue;
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &active_connections[i].client_addr.sin_addr, client_ip, sizeof(client_ip));
+        fprintf(out, "  conn %d: client=%s host=%s buffered_bytes=%ld\n", i,
+                client_ip, active_connections[i].host, buffered);
+    }
+}
@@ -0,0 +1,16 @@
+#include "proxy.h"
+
+// Runtime counters, dumped on SIGUSR1 so they can be scraped without stopping the proxy.
+void dump_stats(FILE *out) {
+    fprintf(out, "---- myproxy stats ----\n");
+    print_admission_stats(out);
+    print_upstream_stats(out);
+    print_cache_stats(out);
+    print_coalesce_stats(out);
+    print_relay_stats(out);
+    print_compress_stats(out);
+    print_ktls_stats(out);
+    print_trace_stats(out);
+    print_log_stats(out);
+    fflush(out);
+}
@@ -0,0 +1,156 @@
+#include "proxy.h"
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Sampled per-request tracing in Chrome/Perfetto trace-event format.
+// Each client thread records its spans into a thread-local buffer with no locking.
+// When a sampled request ends, its spans are formatted once and appended to the
+// trace file with a single O_APPEND write, so threads never wait on each other.
+// Open the file in chrome://tracing or ui.perfetto.dev.
+
+#define TRACE_MAX_SPANS 16
+
+typedef struct {
+    trace_span_id id;
+    long long start_ns;
+    long long end_ns;
+} trace_span;
+
+static const char *span_names[] = {
+    [TRACE_PARSE] = "parse",
+    [TRACE_BLOCKLIST] = "blocklist",
+    [TRACE_ORIGIN_QUEUE] = "origin_queue",
+    [TRACE_DNS] = "dns",
+    [TRACE_CONNECT] = "connect",
+    [TRACE_TLS] = "tls_handshake",
+    [TRACE_FIRST_BYTE] = "first_byte",
+    [TRACE_RELAY] = "relay",
+};
+
+static int trace_fd = -1;
+static atomic_int sample_permille = 0;
+static atomic_long traced_requests = 0;
+
+static __thread int sampled;
+static __thread unsigned int sample_seed;
+static __thread trace_span spans[TRACE_MAX_SPANS];
+static __thread int span_count;
+static __thread long long request_start_ns;
+static __thread char request_host[128];
+static __thread char request_url[256];
+
+void trace_init(const char *path, int permille) {
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        perror("Failed to open trace file");
+        return;
+    }
+
+    // JSON array format; the closing bracket is optional for trace viewers
+    struct stat st;
+    if (fstat(trace_fd, &st) == 0 && st.st_size == 0) {
+        if (write(trace_fd, "[\n", 2) != 2) perror("Failed to write trace file");
+    }
+    atomic_store(&sample_permille, permille);
+}
+
+// Called from SIGTTIN/SIGTTOU handlers: only lock-free atomics here
+void trace_adjust_rate(int up) {
+    int rate = atomic_load(&sample_permille);
+    if (up) rate = rate == 0 ? 1 : (rate * 2 > 1000 ? 1000 : rate * 2);
+    else rate /= 2;
+    atomic_store(&sample_permille, rate);
+}
+
+void trace_request_begin(long long accepted_ns) {
+    sampled = 0;
+    int rate = atomic_load(&sample_permille);
+    if (trace_fd < 0 || rate == 0) return;
+
+    if (sample_seed == 0) sample_seed = (unsigned int)(syscall(SYS_gettid) ^ monotonic_ns());
+    if ((int)(rand_r(&sample_seed) % 1000) >= rate) return;
+
+    sampled = 1;
+    span_count = 0;
+    request_start_ns = accepted_ns;  // Include time spent waiting for a thread
+    request_host[0] = '\0';
+    request_url[0] = '\0';
+}
+
+void trace_annotate(const char *host, const char *url) {
+    if (!sampled) return;
+    snprintf(request_host, sizeof(request_host), "%s", host);
+    snprintf(request_url, sizeof(request_url), "%s", url);
+}
+
+void trace_span_begin(trace_span_id id) {
+    if (!sampled || span_count == TRACE_MAX_SPANS) return;
+    spans[span_count++] = (trace_span){ id, monotonic_ns(), 0 };
+}
+
+void trace_span_end(trace_span_id id) {
+    if (!sampled) return;
+    for (int i = span_count - 1; i >= 0; i--) {
+        if (spans[i].id == id && spans[i].end_ns == 0) {
+            spans[i].end_ns = monotonic_ns();
+            return;
+        }
+    }
+}
+
+// Copy a string into a JSON string body, escaping what JSON requires
+static int json_escape(char *out, size_t out_len, const char *in) {
+    size_t n = 0;
+    for (; *in && n + 7 < out_len; in++) {
+        unsigned char c = *in;
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = c;
+        } else if (c < 0x20) {
+            n += snprintf(out + n, out_len - n, "\\u%04x", c);
+        } else {
+            out[n++] = c;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static int append_event(char *buf, size_t len, const char *name, long long start_ns, long long end_ns,
+                        long tid, const char *args) {
+    return snprintf(buf, len, "{\"name\":\"%s\",\"cat\":\"proxy\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                              "\"pid\":%d,\"tid\":%ld%s},\n",
+                    name, start_ns / 1000.0, (end_ns - start_ns) / 1000.0, (int)getpid(), tid, args);
+}
+
+void trace_request_end() {
+    if (!sampled) return;
+    sampled = 0;
+
+    long long end_ns = monotonic_ns();
+    long tid = syscall(SYS_gettid);
+    char host[256], url[512], args[1024];
+    json_escape(host, sizeof(host), request_host);
+    json_escape(url, sizeof(url), request_url);
+    snprintf(args, sizeof(args), ",\"args\":{\"host\":\"%s\",\"url\":\"%s\"}", host, url);
+
+    char out[4096];
+    size_t len = 0;
+    int n = append_event(out, sizeof(out), "request", request_start_ns, end_ns, tid, args);
+    if (n > 0 && (size_t)n < sizeof(out)) len = n;
+
+    for (int i = 0; i < span_count; i++) {
+        long long span_end = spans[i].end_ns ? spans[i].end_ns : end_ns;  // Close spans cut short by errors
+        n = append_event(out + len, sizeof(out) - len, span_names[spans[i].id], spans[i].start_ns, span_end, tid, "");
+        if (n < 0 || (size_t)n >= sizeof(out) - len) break;
+        len += n;
+    }
+
+    if (write(trace_fd, out, len) == (ssize_t)len) atomic_fetch_add(&traced_requests, 1);
+}
+
+void print_trace_stats(FILE *out) {
+    fprintf(out, "trace: enabled=%d sample_permille=%d traced_requests=%ld\n", trace_fd >= 0,
+            atomic_load(&sample_permille), atomic_load(&traced_requests));
+}
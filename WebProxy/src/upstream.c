@@ -0,0 +1,234 @@
+#include "proxy.h"
+#include <errno.h>
+#include <time.h>
+
+// Per-origin upstream connection limits.
+// Each origin (host:port) may hold at most per_origin_max upstream connections,
+// and extra requests wait in a short FIFO queue for that origin. An optional
+// global cap is handed out round-robin across origins with waiters, so one busy
+// or slow origin only queues its own requests and cannot take every slot.
+
+#define ORIGIN_TABLE_SIZE 256
+#define ORIGIN_KEY_SIZE 160
+
+typedef struct upstream_waiter {
+    pthread_cond_t cond;
+    int granted;
+    struct upstream_waiter *next;
+} upstream_waiter;
+
+typedef struct {
+    char key[ORIGIN_KEY_SIZE];
+    int used;
+    int active;
+    int queued;
+    int in_ring;               // Listed in the round-robin ring of origins with waiters
+    upstream_waiter *head, *tail;
+    long long last_used_ns;
+    long waited;               // Requests that had to queue
+    long long wait_ns_total;
+    long long wait_ns_max;
+    long rejected;             // Queue was full
+    long timeouts;             // Gave up waiting
+} origin_entry;
+
+static upstream_config config;
+static origin_entry origins[ORIGIN_TABLE_SIZE];
+static int ring[ORIGIN_TABLE_SIZE];  // Origins with waiters, in arrival order
+static int ring_len = 0;
+static int ring_cursor = 0;
+static int global_active = 0;
+static pthread_mutex_t upstream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void upstream_configure(const upstream_config *cfg) {
+    config = *cfg;
+}
+
+static int limits_enabled() {
+    return config.per_origin_max > 0 || config.global_max > 0;
+}
+
+static int origin_has_room(const origin_entry *o) {
+    return config.per_origin_max <= 0 || o->active < config.per_origin_max;
+}
+
+static int global_has_room() {
+    return config.global_max <= 0 || global_active < config.global_max;
+}
+
+// Find the origin's entry, reusing the least recently used idle one if it is new
+static int find_origin(const char *key, long long now) {
+    unsigned int h = 5381;
+    for (const char *p = key; *p; p++) h = h * 33 + (unsigned char)*p;
+
+    int victim = -1;
+    for (int i = 0; i < ORIGIN_TABLE_SIZE; i++) {
+        int idx = (h + i) % ORIGIN_TABLE_SIZE;
+        origin_entry *o = &origins[idx];
+        if (o->used && strcmp(o->key, key) == 0) return idx;
+        if (!o->used) {
+            if (victim < 0 || origins[victim].used) victim = idx;
+            break;  // Keys are never probed past a free entry
+        }
+        if (o->active == 0 && o->queued == 0 && (victim < 0 || o->last_used_ns < origins[victim].last_used_ns)) {
+            victim = idx;
+        }
+    }
+    if (victim < 0) return -1;
+
+    origin_entry *o = &origins[victim];
+    memset(o, 0, sizeof(*o));
+    o->used = 1;
+    snprintf(o->key, sizeof(o->key), "%s", key);
+    return victim;
+}
+
+static void ring_remove(int idx) {
+    for (int i = 0; i < ring_len; i++) {
+        if (ring[i] != idx) continue;
+        memmove(&ring[i], &ring[i + 1], (ring_len - i - 1) * sizeof(int));
+        ring_len--;
+        if (ring_cursor > i) ring_cursor--;
+        break;
+    }
+    if (ring_cursor >= ring_len) ring_cursor = 0;
+    origins[idx].in_ring = 0;
+}
+
+static void unlink_waiter(origin_entry *o, upstream_waiter *w) {
+    upstream_waiter **p = &o->head;
+    upstream_waiter *prev = NULL;
+    while (*p && *p != w) {
+        prev = *p;
+        p = &(*p)->next;
+    }
+    if (!*p) return;
+    *p = w->next;
+    if (o->tail == w) o->tail = prev;
+    o->queued--;
+}
+
+// Hand free slots to queued requests, one origin at a time in round-robin order
+static void dispatch() {
+    int idle_pass = 0;
+    while (ring_len > 0 && global_has_room() && idle_pass < ring_len) {
+        int idx = ring[ring_cursor];
+        origin_entry *o = &origins[idx];
+
+        if (!o->head || !origin_has_room(o)) {
+            ring_cursor = (ring_cursor + 1) % ring_len;
+            idle_pass++;
+            continue;
+        }
+
+        upstream_waiter *w = o->head;
+        unlink_waiter(o, w);
+        w->granted = 1;
+        o->active++;
+        global_active++;
+        pthread_cond_signal(&w->cond);
+        idle_pass = 0;
+
+        if (!o->head) ring_remove(idx);
+        else ring_cursor = (ring_cursor + 1) % ring_len;
+    }
+}
+
+int upstream_acquire(const char *host, int port) {
+    if (!limits_enabled()) return UPSTREAM_UNTRACKED;
+
+    char key[ORIGIN_KEY_SIZE];
+    snprintf(key, sizeof(key), "%s:%d", host, port);
+    long long now = monotonic_ns();
+
+    pthread_mutex_lock(&upstream_lock);
+    int idx = find_origin(key, now);
+    if (idx < 0) {
+        // Table is full of busy origins: let this one through untracked rather than fail it
+        pthread_mutex_unlock(&upstream_lock);
+        return UPSTREAM_UNTRACKED;
+    }
+
+    origin_entry *o = &origins[idx];
+    o->last_used_ns = now;
+
+    // Waiters already queued for this origin go first
+    if (!o->head && origin_has_room(o) && global_has_room()) {
+        o->active++;
+        global_active++;
+        pthread_mutex_unlock(&upstream_lock);
+        return idx;
+    }
+
+    if (o->queued >= config.queue_max) {
+        o->rejected++;
+        pthread_mutex_unlock(&upstream_lock);
+        return UPSTREAM_REJECTED;
+    }
+
+    upstream_waiter w = { .granted = 0, .next = NULL };
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (o->tail) o->tail->next = &w;
+    else o->head = &w;
+    o->tail = &w;
+    o->queued++;
+    if (!o->in_ring) {
+        ring[ring_len++] = idx;
+        o->in_ring = 1;
+    }
+
+    long long deadline_ns = now + (long long)config.queue_timeout_ms * 1000000LL;
+    struct timespec deadline = { deadline_ns / 1000000000LL, deadline_ns % 1000000000LL };
+    while (!w.granted) {
+        int rc = pthread_cond_timedwait(&w.cond, &upstream_lock, &deadline);
+        if (rc == ETIMEDOUT && !w.granted) break;
+    }
+
+    long long waited_ns = monotonic_ns() - now;
+    o->waited++;
+    o->wait_ns_total += waited_ns;
+    if (waited_ns > o->wait_ns_max) o->wait_ns_max = waited_ns;
+
+    int result = idx;
+    if (!w.granted) {
+        unlink_waiter(o, &w);
+        if (!o->head && o->in_ring) ring_remove(idx);
+        o->timeouts++;
+        result = UPSTREAM_REJECTED;
+    }
+    pthread_mutex_unlock(&upstream_lock);
+    pthread_cond_destroy(&w.cond);
+    return result;
+}
+
+void upstream_release(int handle) {
+    if (handle < 0) return;
+
+    pthread_mutex_lock(&upstream_lock);
+    origins[handle].active--;
+    origins[handle].last_used_ns = monotonic_ns();
+    global_active--;
+    dispatch();
+    pthread_mutex_unlock(&upstream_lock);
+}
+
+void print_upstream_stats(FILE *out) {
+    pthread_mutex_lock(&upstream_lock);
+    fprintf(out, "upstream: per_origin_max=%d global_max=%d queue_max=%d active=%d origins_waiting=%d\n",
+            config.per_origin_max, config.global_max, config.queue_max, global_active, ring_len);
+
+    for (int i = 0; i < ORIGIN_TABLE_SIZE; i++) {
+        origin_entry *o = &origins[i];
+        if (!o->used || (o->active == 0 && o->queued == 0 && o->waited == 0 && o->rejected == 0)) continue;
+        fprintf(out, "  origin %s: active=%d queued=%d waited=%ld avg_wait_us=%lld max_wait_us=%lld rejected=%ld timeouts=%ld\n",
+                o->key, o->active, o->queued, o->waited,
+                o->waited ? o->wait_ns_total / o->waited / 1000 : 0, o->wait_ns_max / 1000,
+                o->rejected, o->timeouts);
+    }
+    pthread_mutex_unlock(&upstream_lock);
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  //splice(), fallocate(), memmem(), strcasestr()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +7,23 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <ctype.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <stddef.h>
+
+#define CONNECT_TIMEOUT_MS 5000
+#define RESPONSE_TIMEOUT_MS 30000
+#define BATCH_DEFAULT_CONNECTIONS 100
+#define BATCH_MAX_EVENTS 256
+#define RECV_BUFFER_SIZE (1024 * 1024)
+#define SEGMENT_BUFFER_SIZE (256 * 1024)
+#define SEGMENT_RETRIES 3
 
 
 //goal:
@@ -21,40 +39,54 @@ int create_socket() {
 	return sock;
 }
 
-void connect_to_server(int sock, const char *ip, int port) {
+double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+//start_connect(): switch the socket to non-blocking and begin connecting
+//returns 0 if connected already, 1 if the connect is in progress, -1 on failure (errno set)
+int start_connect(int sock, const char *ip, int port) {
 	struct sockaddr_in server_addr;
 	memset(&server_addr, 0, sizeof(server_addr));
 	server_addr.sin_family = AF_INET;
 	server_addr.sin_port = htons(port);
 
 	if (inet_pton(AF_INET, ip, &server_addr.sin_addr) <= 0) {
-		perror("Invalid IP address");
-		close(sock);
-		exit(1);
+		errno = EINVAL;
+		return -1;
+	}
+
+	int flags = fcntl(sock, F_GETFL, 0);
+	if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+		return -1;
 	}
 
+	if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0) {
+		return 0;
+	}
+	return errno == EINPROGRESS ? 1 : -1;
+}
+
+void connect_to_server(int sock, const char *ip, int port) {
 	int flags = fcntl(sock, F_GETFL, 0);
 	if (flags == -1) {
 		perror("Failed to get socket flags");
 		close(sock);
 		exit(1);
 	}
-	if (fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
-		perror("Failed to set socket to non_blocking mode");
-		close(sock);
-		exit(1);
-	}
 
-	int result = connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr));
-	if (result < 0 && errno != EINPROGRESS) {
-		perror("Connection failed");
+	int result = start_connect(sock, ip, port);
+	if (result < 0) {
+		perror(errno == EINVAL ? "Invalid IP address" : "Connection failed");
 		close(sock);
 		exit(1);
 	}
 
-	if (result < 0 && errno == EINPROGRESS) {
+	if (result == 1) {
 		struct timeval timeout;
-		timeout.tv_sec = 5;
+		timeout.tv_sec = CONNECT_TIMEOUT_MS / 1000;
 		timeout.tv_usec = 0;
 
 		fd_set write_fds;
@@ -93,24 +125,26 @@ void connect_to_server(int sock, const char *ip, int port) {
 	}
 }
 
-void parse_url(const char *url, char *ip, char *path, int *port) {
+//parse_url(): ip and path must hold 100 bytes; returns 0 on a malformed URL
+int parse_url(const char *url, char *ip, char *path, int *port) {
 	if (strchr(url, ':')) {
-		if (sscanf(url, "%[^:]:%d/%s", ip, port, path) != 3) {
+		if (sscanf(url, "%99[^:]:%d/%99s", ip, port, path) != 3) {
 			fprintf(stderr, "Invalid URL format. Expected format: IP:port/path\n");
-			exit(1);
+			return 0;
 		}
 	} else {
 		*port = 80;
-		if (sscanf(url, "%[^/]/%s", ip, path) != 2) {
+		if (sscanf(url, "%99[^/]/%99s", ip, path) != 2) {
 			fprintf(stderr, "Invalid URL format. Expected format: IP/path\n");
-			exit(1);
+			return 0;
 		}
 	}
-	
+	return 1;
 }
 
-void construct_request(char *buffer, size_t buffer_size, const char *method, const char *path, const char *hostname) {
-	snprintf(buffer, buffer_size, "%s /%s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", method, path, hostname);
+void construct_request(char *buffer, size_t buffer_size, const char *method, const char *path, const char *hostname, int keep_alive) {
+	snprintf(buffer, buffer_size, "%s /%s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n", method, path, hostname,
+	         keep_alive ? "keep-alive" : "close");
 }
 
 void send_request(int sock, const char *request) {
@@ -121,56 +155,1151 @@ void send_request(int sock, const char *request) {
 	}
 }
 
+//write_all(): write() until everything is out; returns 0 on error
+int write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+//header_value(): value of a header in a NUL-terminated response head, or NULL
+const char *header_value(const char *head, const char *name) {
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), "\r\n%s:", name);
+	const char *found = strcasestr(head, pattern);
+	if (!found) return NULL;
+	found += strlen(pattern);
+	while (*found == ' ' || *found == '\t') found++;
+	return found;
+}
+
+//chunked transfer decoding, done in place: body bytes are compacted to the front of the buffer
+typedef enum { CHUNK_SIZE, CHUNK_EXTENSION, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER, CHUNK_DONE } chunk_state;
+
+typedef struct {
+	chunk_state state;
+	long long remaining;       //size being parsed, then bytes left in the current chunk
+	int line_len;              //length of the current trailer line
+} chunk_decoder;
+
+//dechunk(): returns the number of body bytes left at the front of buf; *consumed says how much input was used,
+//so whatever follows the final chunk (the next pipelined response) is left in place
+size_t dechunk(chunk_decoder *d, char *buf, size_t len, size_t *consumed) {
+	size_t in = 0, out = 0;
+	while (in < len && d->state != CHUNK_DONE) {
+		char c = buf[in];
+		switch (d->state) {
+		case CHUNK_SIZE:
+		case CHUNK_EXTENSION:
+			in++;
+			if (c == '\n') {
+				d->state = d->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+				d->line_len = 0;
+			} else if (d->state == CHUNK_SIZE && isxdigit((unsigned char)c)) {
+				d->remaining = d->remaining * 16 + (isdigit((unsigned char)c) ? c - '0' : (tolower(c) - 'a' + 10));
+			} else if (c != '\r') {
+				d->state = CHUNK_EXTENSION;  //";name=value" after the size is ignored
+			}
+			break;
+		case CHUNK_DATA: {
+			size_t run = len - in;
+			if ((long long)run > d->remaining) run = d->remaining;
+			memmove(buf + out, buf + in, run);
+			in += run;
+			out += run;
+			d->remaining -= run;
+			if (d->remaining == 0) d->state = CHUNK_DATA_END;
+			break;
+		}
+		case CHUNK_DATA_END:
+			in++;
+			if (c == '\n') d->state = CHUNK_SIZE;
+			break;
+		case CHUNK_TRAILER:
+			in++;
+			if (c == '\n') {
+				if (d->line_len == 0) d->state = CHUNK_DONE;
+				d->line_len = 0;
+			} else if (c != '\r') {
+				d->line_len++;
+			}
+			break;
+		case CHUNK_DONE:
+			break;
+		}
+	}
+	*consumed = in;
+	return out;
+}
+
+//splice_body(): move up to limit body bytes (-1 = until EOF) socket -> pipe -> file without copying
+//them through user space; returns bytes moved, or -1 if splice does not work for these descriptors
+long long splice_body(int sock, int fd, long long limit) {
+	int pipefd[2];
+	if (pipe(pipefd) < 0) return -1;
+	fcntl(pipefd[1], F_SETPIPE_SZ, RECV_BUFFER_SIZE);
+
+	long long moved = 0;
+	while (limit < 0 || moved < limit) {
+		size_t want = RECV_BUFFER_SIZE;
+		if (limit >= 0 && limit - moved < (long long)want) want = limit - moved;
+
+		ssize_t in = splice(sock, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (in < 0 && errno == EINTR) continue;
+		if (in < 0 && moved == 0 && (errno == EINVAL || errno == ENOSYS)) {
+			moved = -1;
+			break;
+		}
+		if (in < 0) perror("Failed to receive response");
+		if (in <= 0) break;
+
+		while (in > 0) {
+			ssize_t out = splice(pipefd[0], NULL, fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (out < 0 && errno == EINTR) continue;
+			if (out <= 0) {
+				perror("Failed to write output.dat");
+				close(pipefd[0]);
+				close(pipefd[1]);
+				return moved;
+			}
+			in -= out;
+			moved += out;
+		}
+	}
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return moved;
+}
+
+//receive_response(): headers go to stdout, the body streams into output.dat
 void receive_response(int sock, int is_head) {
-	char buffer[4096];
-	FILE *output_file = is_head ? NULL : fopen("output.dat", "w");
+	char *buffer = malloc(RECV_BUFFER_SIZE + 1);
+	if (!buffer) {
+		perror("Out of memory");
+		close(sock);
+		exit(1);
+	}
+	double started = now_ms();
+
+	//read until the blank line that ends the response head
+	size_t used = 0;
+	char *head_end = NULL;
+	ssize_t bytes_received = 0;
+	while (!head_end && used < RECV_BUFFER_SIZE) {
+		bytes_received = recv(sock, buffer + used, RECV_BUFFER_SIZE - used, 0);
+		if (bytes_received <= 0) break;
+		used += bytes_received;
+		head_end = memmem(buffer, used, "\r\n\r\n", 4);
+	}
+	if (bytes_received < 0) perror("Failed to receive response");
+
+	if (is_head) {
+		//HEAD has no body: print whatever the server sent
+		fwrite(buffer, 1, used, stdout);
+		while ((bytes_received = recv(sock, buffer, RECV_BUFFER_SIZE, 0)) > 0) fwrite(buffer, 1, bytes_received, stdout);
+		free(buffer);
+		return;
+	}
 
-	if (!is_head && !output_file) {
+	int fd = open("output.dat", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
 		perror("Failed to open output.dat");
+		free(buffer);
+		close(sock);
+		exit(1);
+	}
+
+	if (!head_end) {
+		fprintf(stderr, "Response has no complete header block; saving it unparsed\n");
+		if (!write_all(fd, buffer, used)) perror("Failed to write output.dat");
+		close(fd);
+		free(buffer);
+		return;
+	}
+
+	size_t head_len = head_end + 4 - buffer;
+	fwrite(buffer, 1, head_len, stdout);
+	fflush(stdout);
+
+	//look the framing headers up in a NUL-terminated copy of the head
+	char saved = buffer[head_len];
+	buffer[head_len] = '\0';
+	int status = 0;
+	sscanf(buffer, "HTTP/%*s %d", &status);
+	const char *length_value = header_value(buffer, "Content-Length");
+	const char *encoding = header_value(buffer, "Transfer-Encoding");
+	int chunked = encoding && strncasecmp(encoding, "chunked", 7) == 0;
+	long long content_length = length_value && !chunked ? atoll(length_value) : -1;
+	if (status == 204 || status == 304 || (status >= 100 && status < 200)) content_length = 0;
+	buffer[head_len] = saved;
+
+	//reserve the whole file up front so a long download does not fragment it
+	if (content_length > 0 && fallocate(fd, 0, 0, content_length) < 0 && errno != EOPNOTSUPP) {
+		perror("fallocate failed");
+	}
+
+	long long written = 0;
+	int ok = 1;
+	char *body = buffer + head_len;
+	size_t body_len = used - head_len;
+
+	if (chunked) {
+		chunk_decoder decoder = { CHUNK_SIZE, 0, 0 };
+		while (1) {
+			size_t consumed;
+			size_t n = dechunk(&decoder, body, body_len, &consumed);
+			if (n > 0 && !(ok = write_all(fd, body, n))) break;
+			written += n;
+			if (decoder.state == CHUNK_DONE) break;
+
+			bytes_received = recv(sock, buffer, RECV_BUFFER_SIZE, 0);
+			if (bytes_received <= 0) break;
+			body = buffer;
+			body_len = bytes_received;
+		}
+		if (decoder.state != CHUNK_DONE) fprintf(stderr, "Connection closed inside a chunked body\n");
+	} else {
+		if (content_length >= 0 && (long long)body_len > content_length) body_len = content_length;
+		ok = write_all(fd, body, body_len);
+		written = body_len;
+
+		long long remaining = content_length >= 0 ? content_length - written : -1;
+		long long spliced = ok && remaining != 0 ? splice_body(sock, fd, remaining) : 0;
+		if (spliced >= 0) {
+			written += spliced;
+		} else {
+			//splice unsupported here: copy through one large buffer instead
+			while (ok && (remaining < 0 || remaining > 0)) {
+				size_t want = remaining >= 0 && remaining < RECV_BUFFER_SIZE ? (size_t)remaining : RECV_BUFFER_SIZE;
+				bytes_received = recv(sock, buffer, want, 0);
+				if (bytes_received < 0 && errno == EINTR) continue;
+				if (bytes_received <= 0) break;
+				ok = write_all(fd, buffer, bytes_received);
+				written += bytes_received;
+				if (remaining > 0) remaining -= bytes_received;
+			}
+		}
+	}
+	if (!ok) perror("Failed to write output.dat");
+
+	if (content_length >= 0 && written != content_length) {
+		fprintf(stderr, "Connection closed after %lld of %lld body bytes\n", written, content_length);
+		ftruncate(fd, written);  //drop the unfilled part of the preallocation
+	}
+	close(fd);
+	free(buffer);
+
+	double elapsed = (now_ms() - started) / 1000.0;
+	fprintf(stderr, "Saved %lld body bytes to output.dat in %.3f s (%.1f MB/s)\n",
+	        written, elapsed, elapsed > 0 ? written / elapsed / 1e6 : 0.0);
+}
+
+//open_connection(): connect with the usual timeout and return a blocking socket, or -1 (no exit, so callers can retry).
+//reads time out after RESPONSE_TIMEOUT_MS like batch mode, so a stalled server fails the attempt instead of hanging it
+int open_connection(const char *ip, int port) {
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) return -1;
+
+	int flags = fcntl(sock, F_GETFL, 0);
+	int result = start_connect(sock, ip, port);
+	if (result == 1) {
+		struct pollfd pfd = { sock, POLLOUT, 0 };
+		int so_error = 0;
+		socklen_t len = sizeof(so_error);
+		if (poll(&pfd, 1, CONNECT_TIMEOUT_MS) != 1 || getsockopt(sock, SOL_SOCKET, SO_ERROR, &so_error, &len) < 0 || so_error != 0) {
+			result = -1;
+		}
+	}
+	struct timeval timeout = { RESPONSE_TIMEOUT_MS / 1000, (RESPONSE_TIMEOUT_MS % 1000) * 1000 };
+	if (result < 0 || fcntl(sock, F_SETFL, flags) == -1 ||
+	    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+//read_head(): receive until the end of the response head; returns its length (0 on failure), *used counts every byte read
+size_t read_head(int sock, char *buffer, size_t size, size_t *used) {
+	*used = 0;
+	while (*used < size - 1) {
+		ssize_t n = recv(sock, buffer + *used, size - 1 - *used, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		*used += n;
+		char *end = memmem(buffer, *used, "\r\n\r\n", 4);
+		if (end) return end + 4 - buffer;
+	}
+	return 0;
+}
+
+//segmented download: N connections each fetch one byte range and pwrite() it at its offset
+typedef struct {
+	int index;
+	const char *hostname, *ip, *path;
+	int port;
+	int fd;                    //output file shared by every segment
+	long long start, end;      //inclusive byte range
+	long long done;            //bytes of the range already on disk, so a retry resumes
+	int attempts;
+	int ok;
+	double elapsed_ms;
+} segment_job;
+
+int pwrite_all(int fd, const char *buf, size_t len, long long offset) {
+	while (len > 0) {
+		ssize_t n = pwrite(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return 1;
+}
+
+//fetch_segment(): one attempt at the part of the range not yet written; returns 1 once the range is complete
+int fetch_segment(segment_job *seg, char *buffer) {
+	long long from = seg->start + seg->done;
+	int sock = open_connection(seg->ip, seg->port);
+	if (sock < 0) return 0;
+
+	char request[1024];
+	int len = snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%lld-%lld\r\nConnection: close\r\n\r\n",
+	                   seg->path, seg->hostname, from, seg->end);
+	size_t used;
+	size_t head_len = write_all(sock, request, len) ? read_head(sock, buffer, SEGMENT_BUFFER_SIZE, &used) : 0;
+	if (head_len == 0) {
 		close(sock);
+		return 0;
+	}
+
+	//only a 206 for exactly the offset we asked for can be written in place
+	char saved = buffer[head_len];
+	buffer[head_len] = '\0';
+	int status = 0;
+	long long range_start = -1;
+	sscanf(buffer, "HTTP/%*s %d", &status);
+	const char *content_range = header_value(buffer, "Content-Range");
+	if (content_range) sscanf(content_range, "bytes %lld-", &range_start);
+	buffer[head_len] = saved;
+	if (status != 206 || range_start != from) {
+		fprintf(stderr, "segment %d: unexpected response (status %d, range start %lld)\n", seg->index, status, range_start);
+		close(sock);
+		return 0;
+	}
+
+	long long length = seg->end - seg->start + 1;
+	char *body = buffer + head_len;
+	size_t body_len = used - head_len;
+	while (seg->done < length) {
+		if ((long long)body_len > length - seg->done) body_len = length - seg->done;
+		if (body_len > 0 && !pwrite_all(seg->fd, body, body_len, seg->start + seg->done)) {
+			perror("Failed to write output.dat");
+			break;
+		}
+		seg->done += body_len;
+		if (seg->done == length) break;
+
+		ssize_t n = recv(sock, buffer, SEGMENT_BUFFER_SIZE, 0);
+		if (n < 0 && errno == EINTR) {
+			body_len = 0;
+			continue;
+		}
+		if (n <= 0) break;
+		body = buffer;
+		body_len = n;
+	}
+	close(sock);
+	return seg->done == length;
+}
+
+void *segment_worker(void *arg) {
+	segment_job *seg = arg;
+	char *buffer = malloc(SEGMENT_BUFFER_SIZE);
+	double started = now_ms();
+
+	while (buffer && !seg->ok && seg->attempts <= SEGMENT_RETRIES) {
+		if (seg->attempts > 0) {
+			fprintf(stderr, "segment %d: retry %d from byte %lld\n", seg->index, seg->attempts, seg->start + seg->done);
+		}
+		seg->attempts++;
+		seg->ok = fetch_segment(seg, buffer);
+	}
+
+	seg->elapsed_ms = now_ms() - started;
+	free(buffer);
+	return NULL;
+}
+
+//run_segmented(): returns the exit status, or -1 if the server cannot serve ranges and a plain GET should be used
+int run_segmented(const char *hostname, const char *ip, int port, const char *path, int count) {
+	//a HEAD tells us the size and whether byte ranges are supported
+	char head[8192], request[1024];
+	size_t used, head_len = 0;
+	int sock = open_connection(ip, port);
+	if (sock < 0) {
+		fprintf(stderr, "Connection failed\n");
+		return 1;
+	}
+	construct_request(request, sizeof(request), "HEAD", path, hostname, 0);
+	if (write_all(sock, request, strlen(request))) head_len = read_head(sock, head, sizeof(head), &used);
+	close(sock);
+	if (head_len == 0) {
+		fprintf(stderr, "No response to HEAD\n");
+		return 1;
+	}
+	head[head_len] = '\0';
+
+	int status = 0;
+	sscanf(head, "HTTP/%*s %d", &status);
+	const char *length_value = header_value(head, "Content-Length");
+	const char *ranges = header_value(head, "Accept-Ranges");
+	long long total = length_value ? atoll(length_value) : -1;
+	if (status != 200 || total <= 0 || !ranges || strncasecmp(ranges, "bytes", 5) != 0) {
+		fprintf(stderr, "Server does not offer byte ranges for this object; downloading in one stream\n");
+		return -1;
+	}
+	if (count > total) count = total;
+
+	int fd = open("output.dat", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("Failed to open output.dat");
+		return 1;
+	}
+	if (fallocate(fd, 0, 0, total) < 0 && ftruncate(fd, total) < 0) {
+		perror("Failed to size output.dat");
+		close(fd);
+		return 1;
+	}
+
+	segment_job *segs = calloc(count, sizeof(segment_job));
+	pthread_t *threads = calloc(count, sizeof(pthread_t));
+	if (!segs || !threads) {
+		perror("Out of memory");
+		exit(1);
+	}
+
+	double started = now_ms();
+	long long per_segment = total / count;
+	for (int i = 0; i < count; i++) {
+		segment_job *seg = &segs[i];
+		seg->index = i;
+		seg->hostname = hostname;
+		seg->ip = ip;
+		seg->path = path;
+		seg->port = port;
+		seg->fd = fd;
+		seg->start = i * per_segment;
+		seg->end = i == count - 1 ? total - 1 : seg->start + per_segment - 1;
+		if (pthread_create(&threads[i], NULL, segment_worker, seg) != 0) {
+			perror("Thread creation failed");
+			exit(1);
+		}
+	}
+
+	long long written = 0;
+	int failed = 0;
+	for (int i = 0; i < count; i++) {
+		pthread_join(threads[i], NULL);
+		segment_job *seg = &segs[i];
+		written += seg->done;
+		failed += !seg->ok;
+		fprintf(stderr, "segment %d: bytes %lld-%lld  %s after %d attempt(s)  %.2f ms\n", i, seg->start, seg->end,
+		        seg->ok ? "done" : "FAILED", seg->attempts, seg->elapsed_ms);
+	}
+	double elapsed = (now_ms() - started) / 1000.0;
+
+	//the file must be exactly the advertised length with every range filled
+	struct stat st;
+	int length_ok = fstat(fd, &st) == 0 && st.st_size == total && written == total;
+	close(fd);
+	free(segs);
+	free(threads);
+
+	if (failed || !length_ok) {
+		fprintf(stderr, "Download incomplete: %d segment(s) failed, %lld of %lld bytes written\n", failed, written, total);
+		return 1;
+	}
+	fprintf(stderr, "Saved %lld bytes to output.dat over %d connections in %.3f s (%.1f MB/s)\n",
+	        total, count, elapsed, elapsed > 0 ? total / elapsed / 1e6 : 0.0);
+	return 0;
+}
+
+//repeat mode: many requests over one persistent connection, optionally pipelined
+typedef struct {
+	int sock;
+	char *data;
+	size_t start, end;         //unread bytes [start, end), possibly the next pipelined response
+} stream_buffer;
+
+//fill_stream(): move unread bytes to the front and receive more; returns what recv() returned
+ssize_t fill_stream(stream_buffer *b) {
+	if (b->start > 0) {
+		memmove(b->data, b->data + b->start, b->end - b->start);
+		b->end -= b->start;
+		b->start = 0;
+	}
+	if (b->end == RECV_BUFFER_SIZE) return -1;  //a single head larger than the buffer
+
+	ssize_t n;
+	do {
+		n = recv(b->sock, b->data + b->end, RECV_BUFFER_SIZE - b->end, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n > 0) b->end += n;
+	return n;
+}
+
+//read_framed_response(): consume exactly one response from the stream, writing its body to fd (if >= 0).
+//returns 1 on success, 0 if the server closed the connection before sending anything, -1 if it broke off mid-response,
+//-2 if the body could not be written to fd
+int read_framed_response(stream_buffer *b, int is_head, int fd, int *status, long long *body_bytes, int *keep_alive) {
+	char *head_end;
+	while (!(head_end = memmem(b->data + b->start, b->end - b->start, "\r\n\r\n", 4))) {
+		int had_bytes = b->end > b->start;
+		if (fill_stream(b) <= 0) return had_bytes ? -1 : 0;
+	}
+
+	char *head = b->data + b->start;
+	size_t head_len = head_end + 4 - head;
+	char saved = head[head_len];
+	head[head_len] = '\0';
+
+	int minor = 1;
+	*status = 0;
+	sscanf(head, "HTTP/1.%d %d", &minor, status);
+	const char *length_value = header_value(head, "Content-Length");
+	const char *encoding = header_value(head, "Transfer-Encoding");
+	const char *connection = header_value(head, "Connection");
+	int chunked = encoding && strncasecmp(encoding, "chunked", 7) == 0;
+	long long content_length = length_value && !chunked ? atoll(length_value) : -1;
+	//HTTP/1.1 stays open unless told otherwise; HTTP/1.0 only when it says keep-alive
+	*keep_alive = connection ? strncasecmp(connection, "keep-alive", 10) == 0 : minor >= 1;
+	if (connection && strncasecmp(connection, "close", 5) == 0) *keep_alive = 0;
+	if (is_head || *status == 204 || *status == 304 || (*status >= 100 && *status < 200)) {
+		content_length = 0;
+		chunked = 0;
+	}
+	head[head_len] = saved;
+	b->start += head_len;
+	*body_bytes = 0;
+
+	if (chunked) {
+		chunk_decoder decoder = { CHUNK_SIZE, 0, 0 };
+		while (decoder.state != CHUNK_DONE) {
+			if (b->start == b->end && fill_stream(b) <= 0) return -1;
+			size_t consumed;
+			size_t n = dechunk(&decoder, b->data + b->start, b->end - b->start, &consumed);
+			if (fd >= 0 && n > 0 && !write_all(fd, b->data + b->start, n)) return -2;
+			*body_bytes += n;
+			b->start += consumed;
+		}
+		return 1;
+	}
+
+	//without a length the body runs to the end of the connection, which then cannot be reused
+	if (content_length < 0) *keep_alive = 0;
+	while (content_length < 0 || *body_bytes < content_length) {
+		if (b->start == b->end) {
+			ssize_t n = fill_stream(b);
+			if (n <= 0) return content_length < 0 && n == 0 ? 1 : -1;
+		}
+		size_t n = b->end - b->start;
+		if (content_length >= 0 && (long long)n > content_length - *body_bytes) n = content_length - *body_bytes;
+		if (fd >= 0 && !write_all(fd, b->data + b->start, n)) return -2;
+		*body_bytes += n;
+		b->start += n;
+	}
+	return 1;
+}
+
+int run_repeat(const char *hostname, const char *ip, int port, const char *path, int count, int depth, int interval_ms, int is_head) {
+	char request[1024];
+	construct_request(request, sizeof(request), is_head ? "HEAD" : "GET", path, hostname, 1);
+	size_t request_len = strlen(request);
+
+	stream_buffer b = { -1, malloc(RECV_BUFFER_SIZE), 0, 0 };
+	double *sent_at = malloc(count * sizeof(double));
+	if (!b.data || !sent_at) {
+		perror("Out of memory");
 		exit(1);
 	}
+	int out_fd = is_head ? -1 : open("output.dat", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	signal(SIGPIPE, SIG_IGN);  //pipelined requests can hit a connection the server has just closed
+
+	int sent = 0, received = 0, connections = 0, failures = 0;
+	int codes[600] = {0};
+	double min_ms = 0, max_ms = 0, sum_ms = 0;
+	double started = now_ms();
+
+	while (received < count) {
+		if (b.sock < 0) {
+			b.sock = open_connection(ip, port);
+			if (b.sock < 0) {
+				fprintf(stderr, "Connection failed\n");
+				break;
+			}
+			connections++;
+			b.start = b.end = 0;
+			sent = received;  //requests left unanswered on the old connection go out again
+		}
+
+		//keep up to depth requests outstanding on the connection
+		while (sent < count && sent - received < depth) {
+			sent_at[sent] = now_ms();
+			if (!write_all(b.sock, request, request_len)) break;
+			sent++;
+		}
+
+		int status, keep_alive;
+		long long body_bytes;
+		//only the last body is kept; earlier ones are read past
+		if (out_fd >= 0 && received == count - 1) {
+			ftruncate(out_fd, 0);
+			lseek(out_fd, 0, SEEK_SET);
+		}
+		int result = read_framed_response(&b, is_head, received == count - 1 ? out_fd : -1, &status, &body_bytes, &keep_alive);
+		if (result == -2) {
+			perror("Failed to write output.dat");
+			break;
+		}
+		if (result <= 0) {
+			//a reused connection may have been closed by the server while idle: reconnect and resend
+			close(b.sock);
+			b.sock = -1;
+			if (result < 0 || ++failures > 3) {
+				fprintf(stderr, "Response %d broke off; giving up\n", received + 1);
+				break;
+			}
+			continue;
+		}
+		failures = 0;
+
+		double latency = now_ms() - sent_at[received];
+		printf("%5d  %3d  %10lld bytes  %8.2f ms  connection %d\n", received + 1, status, body_bytes, latency, connections);
+		if (status > 0 && status < 600) codes[status]++;
+		if (received == 0 || latency < min_ms) min_ms = latency;
+		if (latency > max_ms) max_ms = latency;
+		sum_ms += latency;
+		received++;
+
+		if (!keep_alive) {
+			close(b.sock);
+			b.sock = -1;
+		}
+		if (interval_ms > 0 && depth == 1 && received < count) usleep(interval_ms * 1000);
+	}
+	double elapsed_ms = now_ms() - started;
+
+	if (b.sock >= 0) close(b.sock);
+	if (out_fd >= 0) close(out_fd);
+	free(b.data);
+	free(sent_at);
+
+	printf("\n%d of %d responses over %d connection(s) in %.3f s (%.1f req/s)\n", received, count, connections,
+	       elapsed_ms / 1000.0, elapsed_ms > 0 ? received * 1000.0 / elapsed_ms : 0.0);
+	for (int code = 0; code < 600; code++) {
+		if (codes[code]) printf("  status %d: %d\n", code, codes[code]);
+	}
+	if (received > 0) printf("  latency: min %.2f ms  avg %.2f ms  max %.2f ms\n", min_ms, sum_ms / received, max_ms);
+	return received == count ? 0 : 1;
+}
+
+//benchmark mode: time a request N times (or for a duration at a target rate) on fresh connections
+typedef struct {
+	double connect_ms, first_byte_ms, total_ms;
+} bench_sample;
+
+int compare_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
 
-	int bytes_received;
-	while((bytes_received = recv(sock, buffer, sizeof(buffer) -1, 0)) > 0) {
-		buffer[bytes_received] = '\0';
-		
-		if (is_head) {
-			printf("%s", buffer);
+//percentile(): nearest-rank on a sorted array
+double percentile(const double *sorted, int n, double p) {
+	int rank = (int)(p / 100.0 * n + 0.999999);
+	if (rank < 1) rank = 1;
+	if (rank > n) rank = n;
+	return sorted[rank - 1];
+}
+
+typedef struct {
+	double min, p50, p90, p99, max;
+} latency_summary;
+
+latency_summary summarize(bench_sample *samples, int n, size_t field) {
+	latency_summary s = {0};
+	if (n == 0) return s;
+	double *values = malloc(n * sizeof(double));
+	for (int i = 0; i < n; i++) values[i] = *(double *)((char *)&samples[i] + field);
+	qsort(values, n, sizeof(double), compare_double);
+	s.min = values[0];
+	s.p50 = percentile(values, n, 50);
+	s.p90 = percentile(values, n, 90);
+	s.p99 = percentile(values, n, 99);
+	s.max = values[n - 1];
+	free(values);
+	return s;
+}
+
+//bench_once(): one request on a new connection; returns 1 with the sample filled in, 0 on failure
+int bench_once(const char *ip, int port, const char *request, size_t request_len, int is_head, stream_buffer *b,
+               double scheduled, bench_sample *sample, long long *body_bytes) {
+	double started = now_ms();
+	b->sock = open_connection(ip, port);
+	if (b->sock < 0) return 0;
+	double connected = now_ms();
+
+	int status = 0, keep_alive, ok = 0;
+	b->start = b->end = 0;
+	if (write_all(b->sock, request, request_len) && fill_stream(b) > 0) {
+		double first_byte = now_ms();
+		ok = read_framed_response(b, is_head, -1, &status, body_bytes, &keep_alive) == 1 && status > 0;
+		//with a target rate, latency counts from when the request was due, so a backlog shows up in the numbers
+		sample->connect_ms = connected - started;
+		sample->first_byte_ms = first_byte - scheduled;
+		sample->total_ms = now_ms() - scheduled;
+	}
+	close(b->sock);
+	b->sock = -1;
+	return ok;
+}
+
+void print_latency(const char *name, latency_summary s) {
+	printf("  %-11s min %8.2f  p50 %8.2f  p90 %8.2f  p99 %8.2f  max %8.2f ms\n", name, s.min, s.p50, s.p90, s.p99, s.max);
+}
+
+void append_csv(const char *csv_path, const char *url, int done, int errors, double elapsed_s, long long bytes,
+                latency_summary c, latency_summary f, latency_summary t) {
+	struct stat st;
+	int is_new = stat(csv_path, &st) != 0 || st.st_size == 0;
+	FILE *csv = fopen(csv_path, "a");
+	if (!csv) {
+		perror("Failed to open CSV file");
+		return;
+	}
+	if (is_new) {
+		fprintf(csv, "timestamp,url,requests,errors,seconds,req_per_s,mb_per_s,"
+		             "connect_min,connect_p50,connect_p90,connect_p99,connect_max,"
+		             "ttfb_min,ttfb_p50,ttfb_p90,ttfb_p99,ttfb_max,"
+		             "total_min,total_p50,total_p90,total_p99,total_max\n");
+	}
+	fprintf(csv, "%ld,%s,%d,%d,%.3f,%.1f,%.3f", (long)time(NULL), url, done, errors, elapsed_s,
+	        elapsed_s > 0 ? done / elapsed_s : 0.0, elapsed_s > 0 ? bytes / elapsed_s / 1e6 : 0.0);
+	latency_summary all[] = { c, f, t };
+	for (int i = 0; i < 3; i++) {
+		fprintf(csv, ",%.3f,%.3f,%.3f,%.3f,%.3f", all[i].min, all[i].p50, all[i].p90, all[i].p99, all[i].max);
+	}
+	fprintf(csv, "\n");
+	fclose(csv);
+}
+
+int run_bench(const char *hostname, const char *url, const char *ip, int port, const char *path, int count,
+              double duration_s, double rate, const char *csv_path, int is_head) {
+	char request[1024];
+	construct_request(request, sizeof(request), is_head ? "HEAD" : "GET", path, hostname, 0);
+	size_t request_len = strlen(request);
+	signal(SIGPIPE, SIG_IGN);
+
+	int capacity = count > 0 ? count : 1024;
+	bench_sample *samples = malloc(capacity * sizeof(bench_sample));
+	stream_buffer b = { -1, malloc(RECV_BUFFER_SIZE), 0, 0 };
+	if (!samples || !b.data) {
+		perror("Out of memory");
+		exit(1);
+	}
+
+	int done = 0, errors = 0;
+	long long bytes = 0;
+	double started = now_ms();
+	double deadline = duration_s > 0 ? started + duration_s * 1000.0 : 0;
+
+	for (int i = 0; count > 0 ? i < count : now_ms() < deadline; i++) {
+		//open loop at the target rate: wait for this request's slot, never skip it
+		double scheduled = rate > 0 ? started + i * 1000.0 / rate : now_ms();
+		double wait = scheduled - now_ms();
+		if (wait > 0) usleep((useconds_t)(wait * 1000));
+		if (count <= 0 && now_ms() >= deadline) break;
+
+		if (done == capacity) {
+			capacity *= 2;
+			samples = realloc(samples, capacity * sizeof(bench_sample));
+			if (!samples) {
+				perror("Out of memory");
+				exit(1);
+			}
+		}
+		long long body_bytes = 0;
+		if (bench_once(ip, port, request, request_len, is_head, &b, rate > 0 ? scheduled : now_ms(), &samples[done], &body_bytes)) {
+			done++;
+			bytes += body_bytes;
 		} else {
-			fprintf(output_file, "%s", buffer);
+			errors++;
+		}
+	}
+	double elapsed_s = (now_ms() - started) / 1000.0;
+
+	latency_summary connect = summarize(samples, done, offsetof(bench_sample, connect_ms));
+	latency_summary first_byte = summarize(samples, done, offsetof(bench_sample, first_byte_ms));
+	latency_summary total = summarize(samples, done, offsetof(bench_sample, total_ms));
+
+	printf("%d requests (%d errors) in %.3f s: %.1f req/s, %.3f MB/s of body\n", done, errors, elapsed_s,
+	       elapsed_s > 0 ? done / elapsed_s : 0.0, elapsed_s > 0 ? bytes / elapsed_s / 1e6 : 0.0);
+	if (done > 0) {
+		print_latency("connect", connect);
+		print_latency("first byte", first_byte);
+		print_latency("total", total);
+	}
+	if (csv_path) append_csv(csv_path, url, done, errors, elapsed_s, bytes, connect, first_byte, total);
+
+	free(samples);
+	free(b.data);
+	return errors > 0 || done == 0;
+}
+
+//batch mode: fetch every URL in a list from one epoll loop, many connections at once
+typedef enum { JOB_CONNECTING, JOB_SENDING, JOB_RECEIVING, JOB_DONE } job_state;
+
+typedef struct {
+	int line;                  //line number in the URL list, also names the output file
+	char hostname[256];
+	char url[256];
+	char ip[100], path[100];
+	int port;
+	int sock;
+	job_state state;
+	char request[1024];
+	size_t request_len, request_sent;
+	FILE *output;
+	char status_line[32];      //start of the response, enough to read the status code
+	size_t status_len;
+	int status;
+	const char *error;
+	long long bytes;
+	double start_ms, connect_ms, first_byte_ms, total_ms;
+} batch_job;
+
+//load_url_list(): each line is "<hostname> <IP:port/path>" or just "<IP:port/path>"
+batch_job *load_url_list(const char *list_path, int *count) {
+	FILE *list = fopen(list_path, "r");
+	if (!list) {
+		perror("Failed to open URL list");
+		exit(1);
+	}
+
+	batch_job *jobs = NULL;
+	int capacity = 0, line_no = 0;
+	char line[1024];
+	*count = 0;
+	while (fgets(line, sizeof(line), list)) {
+		char first[256], second[256];
+		line_no++;
+		int fields = sscanf(line, "%255s %255s", first, second);
+		if (fields < 1 || first[0] == '#') continue;
+
+		if (*count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			jobs = realloc(jobs, capacity * sizeof(batch_job));
+			if (!jobs) {
+				perror("Out of memory");
+				exit(1);
+			}
+		}
+		batch_job *job = &jobs[(*count)++];
+		memset(job, 0, sizeof(*job));
+		job->line = line_no;
+		job->sock = -1;
+		strcpy(job->url, fields == 2 ? second : first);
+		strcpy(job->hostname, first);
+	}
+	fclose(list);
+	return jobs;
+}
+
+void finish_job(batch_job *job, const char *error) {
+	if (job->sock >= 0) close(job->sock);  //closing also drops it from the epoll set
+	job->sock = -1;
+	if (job->output) fclose(job->output);
+	job->output = NULL;
+	job->error = error;
+	job->total_ms = now_ms() - job->start_ms;
+	job->state = JOB_DONE;
+}
+
+void start_job(batch_job *job, int epfd, const char *out_dir, int is_head) {
+	job->start_ms = now_ms();
+	if (!parse_url(job->url, job->ip, job->path, &job->port)) {
+		finish_job(job, "bad URL");
+		return;
+	}
+	if (strchr(job->hostname, ':') || strchr(job->hostname, '/')) {
+		strcpy(job->hostname, job->ip);  //line had no hostname: use the address
+	}
+
+	char output_path[512];
+	snprintf(output_path, sizeof(output_path), "%s/output_%d.dat", out_dir, job->line);
+	job->output = fopen(output_path, "wb");
+	if (!job->output) {
+		finish_job(job, "cannot open output");
+		return;
+	}
+
+	job->sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (job->sock < 0 || start_connect(job->sock, job->ip, job->port) < 0) {
+		finish_job(job, "connect failed");
+		return;
+	}
+
+	construct_request(job->request, sizeof(job->request), is_head ? "HEAD" : "GET", job->path, job->hostname, 0);
+	job->request_len = strlen(job->request);
+	job->state = JOB_CONNECTING;
+
+	struct epoll_event ev;
+	ev.events = EPOLLOUT;
+	ev.data.ptr = job;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, job->sock, &ev) < 0) {
+		finish_job(job, "epoll failed");
+	}
+}
+
+void handle_job(batch_job *job, int epfd) {
+	if (job->state == JOB_CONNECTING) {
+		int so_error = 0;
+		socklen_t len = sizeof(so_error);
+		if (getsockopt(job->sock, SOL_SOCKET, SO_ERROR, &so_error, &len) < 0 || so_error != 0) {
+			finish_job(job, so_error == ECONNREFUSED ? "connection refused" : "connect failed");
+			return;
+		}
+		job->connect_ms = now_ms() - job->start_ms;
+		job->state = JOB_SENDING;
+	}
+
+	if (job->state == JOB_SENDING) {
+		//the request goes out as soon as the socket is writable, without waiting on other jobs
+		while (job->request_sent < job->request_len) {
+			ssize_t n = send(job->sock, job->request + job->request_sent, job->request_len - job->request_sent, MSG_NOSIGNAL);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) {
+				finish_job(job, "send failed");
+				return;
+			}
+			job->request_sent += n;
 		}
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = job;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, job->sock, &ev);
+		job->state = JOB_RECEIVING;
+		return;
 	}
 
-	if (!is_head && output_file) {
-		fclose(output_file);
+	char buffer[65536];
+	while (1) {
+		ssize_t n = recv(job->sock, buffer, sizeof(buffer), 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			finish_job(job, "receive failed");
+			return;
+		}
+		if (n == 0) {
+			finish_job(job, job->status > 0 ? NULL : "no response");
+			return;
+		}
+
+		if (job->bytes == 0) job->first_byte_ms = now_ms() - job->start_ms;
+		if (job->status_len < sizeof(job->status_line) - 1) {
+			size_t take = sizeof(job->status_line) - 1 - job->status_len;
+			if (take > (size_t)n) take = n;
+			memcpy(job->status_line + job->status_len, buffer, take);
+			job->status_len += take;
+			job->status_line[job->status_len] = '\0';
+			if (job->status == 0) sscanf(job->status_line, "HTTP/%*s %d", &job->status);
+		}
+		fwrite(buffer, 1, n, job->output);
+		job->bytes += n;
 	}
-	if (bytes_received < 0) {
-		perror("Failed to receive response");
+}
+
+//raise the descriptor limit so hundreds of connections can be open at once
+void raise_fd_limit() {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
 	}
 }
 
+void print_batch_summary(batch_job *jobs, int count, double elapsed_ms) {
+	int codes[600] = {0};
+	int failed = 0, succeeded = 0;
+	double min_ms = 0, max_ms = 0, sum_ms = 0;
+
+	for (int i = 0; i < count; i++) {
+		batch_job *job = &jobs[i];
+		if (job->error) {
+			failed++;
+			printf("%5d  ERR  %-20s %s\n", job->line, job->error, job->url);
+			continue;
+		}
+		printf("%5d  %3d  connect %7.2f ms  first byte %7.2f ms  total %7.2f ms  %10lld bytes  %s\n",
+		       job->line, job->status, job->connect_ms, job->first_byte_ms, job->total_ms, job->bytes, job->url);
+		if (job->status > 0 && job->status < 600) codes[job->status]++;
+		if (succeeded == 0 || job->total_ms < min_ms) min_ms = job->total_ms;
+		if (job->total_ms > max_ms) max_ms = job->total_ms;
+		sum_ms += job->total_ms;
+		succeeded++;
+	}
+
+	printf("\n%d URLs in %.2f s (%.1f URLs/s), %d failed\n", count, elapsed_ms / 1000.0,
+	       elapsed_ms > 0 ? count * 1000.0 / elapsed_ms : 0.0, failed);
+	for (int code = 0; code < 600; code++) {
+		if (codes[code]) printf("  status %d: %d\n", code, codes[code]);
+	}
+	if (succeeded > 0) {
+		printf("  total time: min %.2f ms  avg %.2f ms  max %.2f ms\n", min_ms, sum_ms / succeeded, max_ms);
+	}
+}
+
+int run_batch(const char *list_path, int max_active, const char *out_dir, int is_head) {
+	int count;
+	batch_job *jobs = load_url_list(list_path, &count);
+	raise_fd_limit();
+
+	int epfd = epoll_create1(0);
+	if (epfd < 0) {
+		perror("epoll_create1 failed");
+		exit(1);
+	}
+
+	double started = now_ms();
+	int next = 0, active = 0, done = 0, oldest = 0;
+	struct epoll_event events[BATCH_MAX_EVENTS];
+
+	while (done < count) {
+		while (active < max_active && next < count) {
+			start_job(&jobs[next], epfd, out_dir, is_head);
+			if (jobs[next].state == JOB_DONE) done++;
+			else active++;
+			next++;
+		}
+
+		int ready = epoll_wait(epfd, events, BATCH_MAX_EVENTS, 100);
+		if (ready < 0 && errno != EINTR) {
+			perror("epoll_wait failed");
+			break;
+		}
+		for (int i = 0; i < ready; i++) {
+			batch_job *job = events[i].data.ptr;
+			handle_job(job, epfd);
+			if (job->state == JOB_DONE) {
+				active--;
+				done++;
+			}
+		}
+
+		//expire connects and responses that have taken too long
+		double now = now_ms();
+		while (oldest < next && jobs[oldest].state == JOB_DONE) oldest++;
+		for (int i = oldest; i < next; i++) {
+			batch_job *job = &jobs[i];
+			if (job->state == JOB_DONE) continue;
+			double limit = job->state == JOB_CONNECTING ? CONNECT_TIMEOUT_MS : RESPONSE_TIMEOUT_MS;
+			if (now - job->start_ms > limit) {
+				finish_job(job, job->state == JOB_CONNECTING ? "connection timed out" : "response timed out");
+				active--;
+				done++;
+			}
+		}
+	}
+
+	print_batch_summary(jobs, count, now_ms() - started);
+	close(epfd);
+
+	int failed = 0;
+	for (int i = 0; i < count; i++) failed += jobs[i].error != NULL;
+	free(jobs);
+	return failed ? 1 : 0;
+}
+
 int main(int argc, char const *argv[])
 {
-	if (argc < 3) {
-		fprintf(stderr, "Usage:%s <hostname> <IP:port/path> [-h]\n\n", argv[0]);
+	if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+		int max_active = BATCH_DEFAULT_CONNECTIONS;
+		const char *out_dir = ".";
+		int head = 0;
+		for (int i = 3; i < argc; i++) {
+			if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) max_active = atoi(argv[++i]);
+			else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) out_dir = argv[++i];
+			else if (strcmp(argv[i], "-h") == 0) head = 1;
+			else max_active = 0;
+		}
+		if (max_active <= 0) {
+			fprintf(stderr, "Usage:%s -b <url_list> [-c <connections>] [-o <output_dir>] [-h]\n\n", argv[0]);
+			return 1;
+		}
+		return run_batch(argv[2], max_active, out_dir, head);
+	}
+
+	int head = 0, segments = 0, repeat = 0, depth = 1, interval_ms = 0, bench_count = 0;
+	double bench_seconds = 0, bench_rate = 0;
+	const char *csv_path = NULL;
+	for (int i = 3; i < argc; i++) {
+		if (strcmp(argv[i], "-h") == 0) head = 1;
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) segments = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) repeat = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) depth = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) interval_ms = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) bench_count = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) bench_seconds = atof(argv[++i]);
+		else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) bench_rate = atof(argv[++i]);
+		else if (strcmp(argv[i], "-csv") == 0 && i + 1 < argc) csv_path = argv[++i];
+		else argc = 0;
+	}
+	if (argc < 3 || segments < 0 || repeat < 0 || depth < 1 || interval_ms < 0 ||
+	    bench_count < 0 || bench_seconds < 0 || bench_rate < 0) {
+		fprintf(stderr, "Usage:%s <hostname> <IP:port/path> [-h | -s <segments>]\n", argv[0]);
+		fprintf(stderr, "      %s <hostname> <IP:port/path> -r <count> [-P <pipeline_depth>] [-i <interval_ms>] [-h]\n", argv[0]);
+		fprintf(stderr, "      %s <hostname> <IP:port/path> (-n <requests> | -d <seconds> [-R <req/s>]) [-csv <file>] [-h]\n", argv[0]);
+		fprintf(stderr, "      %s -b <url_list> [-c <connections>] [-o <output_dir>] [-h]\n\n", argv[0]);
 		return 1;
 	}
 
 	char *hostname = strdup(argv[1]);
 	char *url = strdup(argv[2]);
-	int head = (argc == 4 && strcmp(argv[3], "-h") == 0);
 
 	char ip[100], path[100];
 	int port;
 
-	parse_url(url, ip, path, &port);
+	if (!parse_url(url, ip, path, &port)) {
+		exit(1);
+	}
+
+	if (bench_count > 0 || bench_seconds > 0) {
+		return run_bench(hostname, url, ip, port, path, bench_count, bench_seconds, bench_rate, csv_path, head);
+	}
+
+	if (repeat > 0) {
+		return run_repeat(hostname, ip, port, path, repeat, depth, interval_ms, head);
+	}
+
+	if (segments > 0 && !head) {
+		int result = run_segmented(hostname, ip, port, path, segments);
+		if (result >= 0) return result;
+	}
 	int sock = create_socket();
 
 	connect_to_server(sock, ip, port);
 
 	char request[1024];
-	construct_request(request, sizeof(request), head ? "HEAD" : "GET", path, hostname);
+	construct_request(request, sizeof(request), head ? "HEAD" : "GET", path, hostname, 0);
 
 	send_request(sock, request);
 
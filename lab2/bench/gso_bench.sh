@@ -0,0 +1,78 @@
+#!/bin/sh
+# CPU cost of UDP segmentation offload on loopback.
+# Round-trips the same file through myserver twice, once with plain per-packet
+# sends and once with -gso (UDP_SEGMENT on send, UDP_GRO on receive) on both the
+# client and the server, and reports each side's CPU time per GB the server
+# echoed (datagrams dropped on the way are not counted). Neither side prints per
+# packet, so the figures are socket and copy cost, not stdout formatting.
+#
+# Usage: bench/gso_bench.sh [-m mtu] [-s size_mb] [-p port]
+#   run from lab2/ after `make`; Linux only
+
+MTU=1400
+SIZE_MB=256
+PORT=19190
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        -m) MTU=$2; shift 2 ;;
+        -s) SIZE_MB=$2; shift 2 ;;
+        -p) PORT=$2; shift 2 ;;
+        *) echo "usage: $0 [-m mtu] [-s size_mb] [-p port]"; exit 1 ;;
+    esac
+done
+
+BIN=$(dirname "$0")/../bin
+WORK=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORK"' EXIT INT TERM
+
+head -c $((SIZE_MB * 1048576)) /dev/urandom > "$WORK/in.bin"
+TICKS=$(getconf CLK_TCK)
+
+server_cpu_ticks() {
+    # utime + stime of the server process
+    awk '{ print $14 + $15 }' /proc/$SERVER_PID/stat
+}
+
+client_cpu_ticks() {
+    # cutime + cstime of this shell: every client run it has waited for
+    awk '{ print $16 + $17 }' /proc/$$/stat
+}
+
+per_gb() {
+    awk -v t=$1 -v hz=$TICKS -v b=$2 'BEGIN { printf "%.2f", (b > 0) ? t / hz / (b / 1073741824) : 0 }'
+}
+
+echo "gso benchmark: mtu=$MTU file=${SIZE_MB}MB port=$PORT"
+for MODE in plain gso; do
+    FLAG=""
+    [ $MODE = gso ] && FLAG="-gso"
+
+    # One long-lived worker, so the server's CPU can be read while it is still running
+    "$BIN/myserver" $PORT -threads 1 $FLAG > "$WORK/server.out" 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+    if ! kill -0 $SERVER_PID 2>/dev/null; then
+        echo "benchmark: server failed to start"
+        cat "$WORK/server.out"
+        exit 1
+    fi
+
+    SERVER_BEFORE=$(server_cpu_ticks)
+    CLIENT_BEFORE=$(client_cpu_ticks)
+    START=$(date +%s.%N)
+    "$BIN/myclient" 127.0.0.1 $PORT $MTU "$WORK/in.bin" "$WORK/out.bin" $FLAG > /dev/null 2>&1
+    END=$(date +%s.%N)
+    CLIENT_AFTER=$(client_cpu_ticks)
+    SERVER_AFTER=$(server_cpu_ticks)
+    kill -INT $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+
+    ECHOED=$(sed -n 's/^Total.*Echoed [0-9]* packets (\([0-9]*\) bytes).*/\1/p' "$WORK/server.out")
+    RESULT=lost
+    cmp -s "$WORK/in.bin" "$WORK/out.bin" && RESULT=ok
+    SECONDS_TAKEN=$(awk -v s=$START -v e=$END 'BEGIN { printf "%.2f", e - s }')
+    echo "mode=$MODE result=$RESULT seconds=$SECONDS_TAKEN echoed_mb=$((${ECHOED:-0} / 1048576))" \
+         "server_cpu_s_per_gb=$(per_gb $((SERVER_AFTER - SERVER_BEFORE)) ${ECHOED:-0})" \
+         "client_cpu_s_per_gb=$(per_gb $((CLIENT_AFTER - CLIENT_BEFORE)) ${ECHOED:-0})"
+done
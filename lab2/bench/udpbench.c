@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// UDP echo load generator for myserver.
+// Every thread is one flow: its own socket (so its own source port) sending
+// sequenced datagrams that carry their send time, and reading the echoes back.
+// Closed loop keeps a fixed number of datagrams in flight per flow; open loop
+// sends at a fixed total rate. For each payload size in the sweep it reports
+// packets/s, goodput, loss, reordering and an RTT histogram's percentiles.
+//
+// Datagram layout: seq (4 bytes, never -1 so the server cannot mistake it for an
+// end-of-file marker), flow id (4 bytes), send time in ns (8 bytes), padding.
+
+#define HEADER_SIZE 16
+#define MAX_PAYLOAD 65507
+#define MAX_THREADS 64
+#define DRAIN_NS 200000000LL   // Wait this long after the last send for stragglers
+#define STALL_NS 200000000LL   // Closed loop: datagrams unanswered this long are written off
+
+// Log-linear histogram: 16 linear sub-buckets per power of two, so any value lands
+// in a bucket no more than 1/16 wide relative to its size
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_BUCKETS (SUB_COUNT + 60 * SUB_COUNT)
+
+typedef struct {
+    long long counts[HIST_BUCKETS];
+    long long total;
+    long long min, max;
+} histogram;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    int size;
+    long long sent, received, reordered, bytes;
+    histogram rtt;
+} flow;
+
+static struct sockaddr_in target;
+static int threads = 1;
+static int window = 64;
+static double rate = 0;          // Total datagrams per second; 0 means closed loop
+static double duration = 2;
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int bucket_of(long long v) {
+    if (v < SUB_COUNT) return v < 0 ? 0 : v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - SUB_BITS;
+    return SUB_COUNT + shift * SUB_COUNT + (int)((v >> shift) - SUB_COUNT);
+}
+
+// Midpoint of a bucket's value range
+static long long bucket_value(int b) {
+    if (b < SUB_COUNT) return b;
+    int shift = (b - SUB_COUNT) / SUB_COUNT;
+    long long low = (long long)(SUB_COUNT + (b - SUB_COUNT) % SUB_COUNT) << shift;
+    return low + ((1LL << shift) >> 1);
+}
+
+static void hist_record(histogram *h, long long v) {
+    h->counts[bucket_of(v)]++;
+    if (h->total == 0 || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+    h->total++;
+}
+
+static void hist_merge(histogram *into, const histogram *from) {
+    if (from->total == 0) return;
+    for (int i = 0; i < HIST_BUCKETS; i++) into->counts[i] += from->counts[i];
+    if (into->total == 0 || from->min < into->min) into->min = from->min;
+    if (from->max > into->max) into->max = from->max;
+    into->total += from->total;
+}
+
+static long long hist_percentile(const histogram *h, double p) {
+    long long rank = (long long)(p / 100.0 * h->total + 0.5);
+    if (rank < 1) rank = 1;
+    long long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            long long v = bucket_value(i);
+            return v > h->max ? h->max : v < h->min ? h->min : v;
+        }
+    }
+    return h->max;
+}
+
+static void read_echoes(int sock, flow *f, long long *highest) {
+    char buf[MAX_PAYLOAD];
+    while (1) {
+        ssize_t n = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0) return;
+        if (n < HEADER_SIZE) continue;
+
+        uint32_t seq, id;
+        long long sent_ns;
+        memcpy(&seq, buf, 4);
+        memcpy(&id, buf + 4, 4);
+        memcpy(&sent_ns, buf + 8, 8);
+        if ((int)id != f->id) continue;
+
+        hist_record(&f->rtt, now_ns() - sent_ns);
+        f->received++;
+        f->bytes += n;
+        if ((long long)seq < *highest) f->reordered++;
+        else *highest = seq;
+    }
+}
+
+static void *run_flow(void *arg) {
+    flow *f = arg;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&target, sizeof(target)) < 0) {
+        perror("flow socket");
+        return NULL;
+    }
+    int bufsize = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+    char *packet = calloc(1, f->size);
+    uint32_t id = f->id;
+    memcpy(packet + 4, &id, 4);
+
+    long long start = now_ns();
+    long long end = start + (long long)(duration * 1e9);
+    long long interval = rate > 0 ? (long long)(1e9 * threads / rate) : 0;
+    long long next_send = start;
+    long long last_progress = start;
+    long long written_off = 0;   // Closed loop: in-flight datagrams given up on
+    long long highest = -1;
+
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    while (1) {
+        long long now = now_ns();
+        if (now >= end) break;
+
+        int in_flight = f->sent - f->received - written_off;
+        int can_send = interval > 0 ? now >= next_send : in_flight < window;
+        if (can_send) {
+            uint32_t seq = f->sent & 0x7fffffff;
+            memcpy(packet, &seq, 4);
+            memcpy(packet + 8, &now, 8);
+            if (send(sock, packet, f->size, 0) == f->size) f->sent++;
+            next_send += interval;
+            continue;
+        }
+
+        // Wait for echoes until the next send is due (open loop) or one arrives (closed loop)
+        int timeout_ms = interval > 0 ? (int)((next_send - now) / 1000000) : 10;
+        if (poll(&pfd, 1, timeout_ms) > 0) {
+            long long before = f->received;
+            read_echoes(sock, f, &highest);
+            if (f->received > before) last_progress = now_ns();
+        } else if (interval == 0 && now_ns() - last_progress > STALL_NS) {
+            written_off = f->sent - f->received;
+            last_progress = now_ns();
+        }
+    }
+
+    // Collect the echoes still on their way
+    long long drain_end = now_ns() + DRAIN_NS;
+    while (f->received < f->sent) {
+        long long left = drain_end - now_ns();
+        if (left <= 0 || poll(&pfd, 1, (int)(left / 1000000) + 1) <= 0) break;
+        read_echoes(sock, f, &highest);
+    }
+
+    free(packet);
+    close(sock);
+    return NULL;
+}
+
+static void run_size(int size) {
+    flow flows[MAX_THREADS];
+    memset(flows, 0, sizeof(flows));
+    for (int i = 0; i < threads; i++) {
+        flows[i].id = i;
+        flows[i].size = size;
+        pthread_create(&flows[i].thread, NULL, run_flow, &flows[i]);
+    }
+
+    static histogram rtt;
+    memset(&rtt, 0, sizeof(rtt));
+    long long sent = 0, received = 0, reordered = 0, bytes = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(flows[i].thread, NULL);
+        sent += flows[i].sent;
+        received += flows[i].received;
+        reordered += flows[i].reordered;
+        bytes += flows[i].bytes;
+        hist_merge(&rtt, &flows[i].rtt);
+    }
+    double seconds = duration;
+    long long lost = sent - received;
+    printf("%6d %10lld %10.0f %10.0f %9.2f %7.3f %9lld", size, sent, sent / seconds, received / seconds,
+           bytes / seconds / 1e6, sent ? 100.0 * (lost < 0 ? 0 : lost) / sent : 0.0, reordered);
+    if (rtt.total > 0) {
+        printf(" %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n", rtt.min / 1e3, hist_percentile(&rtt, 50) / 1e3,
+               hist_percentile(&rtt, 90) / 1e3, hist_percentile(&rtt, 99) / 1e3,
+               hist_percentile(&rtt, 99.9) / 1e3, rtt.max / 1e3);
+    } else {
+        printf(" %8s %8s %8s %8s %8s %8s\n", "-", "-", "-", "-", "-", "-");
+    }
+    fflush(stdout);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-a ip:port] [-t flows] [-s size,size,...] [-r datagrams/s] [-w window] [-d seconds]\n"
+                    "  -a  echo server (default 127.0.0.1:9090)\n"
+                    "  -t  flows, one thread and socket each (default 1, max %d)\n"
+                    "  -s  payload sizes to sweep, %d..%d bytes (default 64,256,512,1024,1400,4096,8192)\n"
+                    "  -r  total send rate; without it each flow keeps -w datagrams in flight\n"
+                    "  -w  closed-loop datagrams in flight per flow (default 64)\n"
+                    "  -d  seconds per size (default 2)\n",
+            prog, MAX_THREADS, HEADER_SIZE, MAX_PAYLOAD);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *address = "127.0.0.1:9090";
+    char sizes[256] = "64,256,512,1024,1400,4096,8192";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:t:s:r:w:d:")) != -1) {
+        switch (opt) {
+        case 'a': address = optarg; break;
+        case 't': threads = atoi(optarg); break;
+        case 's': snprintf(sizes, sizeof(sizes), "%s", optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'w': window = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (threads < 1 || threads > MAX_THREADS || window < 1 || duration <= 0 || rate < 0) usage(argv[0]);
+
+    char host[64];
+    int port;
+    if (sscanf(address, "%63[^:]:%d", host, &port) != 2) usage(argv[0]);
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &target.sin_addr) != 1) usage(argv[0]);
+
+    printf("udpbench: server=%s flows=%d %s duration=%.1fs\n", address, threads,
+           rate > 0 ? "open loop" : "closed loop", duration);
+    if (rate > 0) printf("rate=%.0f datagrams/s\n", rate);
+    else printf("window=%d per flow\n", window);
+    printf("%6s %10s %10s %10s %9s %7s %9s %8s %8s %8s %8s %8s %8s\n", "size", "sent", "sent/s", "echoed/s",
+           "MB/s", "loss%", "reordered", "min_us", "p50_us", "p90_us", "p99_us", "p999_us", "max_us");
+
+    for (char *token = strtok(sizes, ","); token; token = strtok(NULL, ",")) {
+        int size = atoi(token);
+        if (size < HEADER_SIZE || size > MAX_PAYLOAD) {
+            fprintf(stderr, "skipping size %s: must be %d..%d bytes\n", token, HEADER_SIZE, MAX_PAYLOAD);
+            continue;
+        }
+        run_size(size);
+    }
+    return 0;
+}
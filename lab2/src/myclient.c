@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // UDP_SEGMENT/UDP_GRO
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,8 +10,76 @@
 #include <libgen.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
 
 #define MAX_PACKET_SIZE 65535
+#define MAX_GSO_SEGMENTS 64      // Kernel limit on segments in one UDP_SEGMENT send
+#define MAX_GSO_BYTES 65000      // One send must still fit in a single UDP datagram
+#define SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+#define PACKET_OVERHEAD 1024     // Rough kernel bookkeeping per queued datagram
+#define STALL_TIMEOUT_SEC 1      // Give up on outstanding echoes after this long without progress
+
+// Sender and receiver thread share these counts, so the sender never has more packets
+// in flight than the socket buffers can hold and nothing is dropped for lack of room
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	long long sent;       // Packets handed to the kernel
+	long long echoed;     // Packets that came back (or were given up on)
+	long long window;     // Packets allowed in flight
+	int waiting;
+} flow_control;
+
+// One bit per sequence number, so even a multi-GB file needs only a few KB to track
+typedef struct {
+	uint64_t *words;
+	uint64_t bits;
+} seq_bitmap;
+
+typedef struct {
+	int sock;
+	int mtu;
+	int gso;
+	flow_control *fc;
+	char *map;            // Output file, mapped and already at its final size
+	uint64_t file_size;
+	seq_bitmap *received;
+	long long duplicates;
+	long long packets;    // Echoed packets handled, duplicates included
+} receiver_args;
+
+void bitmap_init(seq_bitmap *b, uint64_t bits) {
+	b->bits = bits;
+	b->words = calloc(bits / 64 + 1, sizeof(uint64_t));
+	if (!b->words) {
+		perror("Failed to allocate packet bitmap");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Returns the previous value of the bit
+int bitmap_test_and_set(seq_bitmap *b, uint64_t bit) {
+	uint64_t mask = 1ULL << (bit % 64);
+	int was_set = (b->words[bit / 64] & mask) != 0;
+	b->words[bit / 64] |= mask;
+	return was_set;
+}
+
+// First clear bit below `count`, or -1 if all are set; full words are skipped whole
+long long bitmap_first_missing(const seq_bitmap *b, uint64_t count) {
+	for (uint64_t word = 0; word * 64 < count; word++) {
+		if (b->words[word] == UINT64_MAX) continue;
+		for (uint64_t bit = word * 64; bit < count && bit < (word + 1) * 64; bit++) {
+			if (!(b->words[word] & (1ULL << (bit % 64)))) return bit;
+		}
+	}
+	return -1;
+}
 
 int create_socket() {
 	int sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -40,6 +109,55 @@ void connect_to_server(int sock, struct sockaddr_in *server_addr, const char *ip
 			//close(sock);
 			exit(EXIT_FAILURE);
 		}
+
+	// Echoes queue here while the sender keeps going; the kernel caps this at net.core.rmem_max
+	int size = SOCKET_BUFFER_SIZE;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+// Size the in-flight window from the receive buffer the kernel actually granted, leaving half as slack
+void flow_init(flow_control *fc, int sock, int mtu) {
+	int rcvbuf = 0;
+	socklen_t len = sizeof(rcvbuf);
+	getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+
+	memset(fc, 0, sizeof(*fc));
+	pthread_mutex_init(&fc->lock, NULL);
+	pthread_cond_init(&fc->cond, NULL);
+	fc->window = rcvbuf / 2 / (mtu + PACKET_OVERHEAD);
+	if (fc->window < 4) fc->window = 4;
+}
+
+// Block until `count` more packets fit in the window. If echoes stop coming back
+// the outstanding ones are written off as lost, so a dropped datagram cannot stall the transfer.
+void flow_wait(flow_control *fc, long long count) {
+	pthread_mutex_lock(&fc->lock);
+	while (fc->sent + count - fc->echoed > fc->window) {
+		long long before = fc->echoed;
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += STALL_TIMEOUT_SEC;
+
+		fc->waiting = 1;
+		int rc = 0;
+		while (fc->echoed == before && rc == 0) rc = pthread_cond_timedwait(&fc->cond, &fc->lock, &deadline);
+		fc->waiting = 0;
+
+		if (fc->echoed == before) {
+			fprintf(stderr, "No echo for %d second(s), %lld packets presumed lost.\n", STALL_TIMEOUT_SEC, fc->sent - fc->echoed);
+			fc->echoed = fc->sent;
+		}
+	}
+	fc->sent += count;
+	pthread_mutex_unlock(&fc->lock);
+}
+
+void flow_echoed(flow_control *fc, long long count) {
+	pthread_mutex_lock(&fc->lock);
+	fc->echoed += count;
+	if (fc->waiting) pthread_cond_signal(&fc->cond);
+	pthread_mutex_unlock(&fc->lock);
 }
 
 void construct_packet(char *packet, int seq_num, const char *data, size_t data_len) {
@@ -52,102 +170,205 @@ void construct_packet(char *packet, int seq_num, const char *data, size_t data_l
 }
 
 
-void send_file(int sock, struct sockaddr_in *server_addr, socklen_t addr_len, FILE *file, int mtu) {
+// Send one buffer of back-to-back packets, each `segment` bytes except possibly the last,
+// as a single UDP_SEGMENT send; the kernel cuts it into separate datagrams
+int send_segments(int sock, struct sockaddr_in *server_addr, socklen_t addr_len, char *buffer, size_t len, int segment) {
+    struct iovec iov = { buffer, len };
+    char control[CMSG_SPACE(sizeof(uint16_t))] = {0};
+    struct msghdr msg = {0};
+    msg.msg_name = server_addr;
+    msg.msg_namelen = addr_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (len > (size_t)segment) {
+        uint16_t size = segment;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(size));
+        memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+    }
+    return sendmsg(sock, &msg, 0) < 0 ? -1 : 0;
+}
+
+long long send_file(int sock, struct sockaddr_in *server_addr, socklen_t addr_len, FILE *file, int mtu, int gso, flow_control *fc) {
     char packet[mtu];
     char data[mtu - sizeof(int)];
     int seq_num = 0;
     size_t bytes_read;  // Track the actual number of bytes read from the file
 
+    // GSO batches whole packets into one buffer; every packet but the file's last is exactly mtu bytes
+    int per_send = gso ? MAX_GSO_BYTES / mtu : 0;
+    if (per_send > MAX_GSO_SEGMENTS) per_send = MAX_GSO_SEGMENTS;
+    if (per_send > fc->window) per_send = fc->window;
+    if (gso && per_send < 2) {
+        fprintf(stderr, "MTU too large for segmentation offload, sending packets one by one.\n");
+        per_send = 0;
+    }
+    char *batch = per_send ? malloc((size_t)per_send * mtu) : NULL;
+    size_t batched = 0;
+
     while ((bytes_read = fread(data, 1, sizeof(data), file)) > 0) {
         construct_packet(packet, seq_num++, data, bytes_read);  // Use bytes_read for packet construction
-        printf("Sending packet with seq_num: %d, size: %zu bytes, data: %.*s\n",
-               seq_num - 1,
-               bytes_read + sizeof(int),  // Log total size (seq_num + data)
-               (int)bytes_read,
-               data);
 
+        if (batch) {
+            memcpy(batch + batched, packet, bytes_read + sizeof(int));
+            batched += bytes_read + sizeof(int);
+            if (batched < (size_t)per_send * mtu && bytes_read == sizeof(data)) continue;
+            flow_wait(fc, (batched + mtu - 1) / mtu);
+            if (send_segments(sock, server_addr, addr_len, batch, batched, mtu) < 0) {
+                perror("Failed to send packets");
+                exit(EXIT_FAILURE);
+            }
+            batched = 0;
+            continue;
+        }
+
+        flow_wait(fc, 1);
         if (sendto(sock, packet, bytes_read + sizeof(int), 0, (struct sockaddr *)server_addr, addr_len) < 0) {
             perror("Failed to send packet");
             exit(EXIT_FAILURE);
         }
     }
+    free(batch);
 
     // Send EOF marker
     int eof_marker = -1;
     sendto(sock, &eof_marker, sizeof(int), 0, (struct sockaddr *)server_addr, addr_len);
     printf("Sent end-of-file marker.\n");
+    return seq_num;
 }
 
 
-void receive_file(int sock, struct sockaddr_in *server_addr, socklen_t addr_len, FILE *output, int mtu) {
-    char packet[mtu];
-    char data[mtu - sizeof(int)];
-    int seq_num;
+// Store one echoed packet straight into the mapped output file; returns 0 once the end-of-file marker arrives.
+// The 4-byte seq_num is read as unsigned, so offsets go past 2 GB packets; only 0xffffffff (-1) is the marker.
+int handle_packet(char *packet, int received, receiver_args *rx) {
+    uint32_t seq_num;
+    memcpy(&seq_num, packet, sizeof(seq_num));  // Extract sequence number
+
+    if (seq_num == UINT32_MAX) {
+        printf("End of file received. Stopping packet reception.\n");
+        return 0;
+    }
+
+    // Calculate the actual data size
+    uint64_t data_size = received - sizeof(int);
+    uint64_t offset = (uint64_t)seq_num * (rx->mtu - sizeof(int));
+    if (seq_num >= rx->received->bits || offset + data_size > rx->file_size) {
+        fprintf(stderr, "Ignoring packet with out-of-range seq_num %u\n", seq_num);
+        return 1;
+    }
+    if (bitmap_test_and_set(rx->received, seq_num)) {
+        rx->duplicates++;
+        return 1;
+    }
+
+    if (data_size > 0) memcpy(rx->map + offset, packet + sizeof(int), data_size);
+    return 1;
+}
+
+// Receiver thread: runs alongside send_file(), so echoes are drained as fast as they arrive
+void *receive_file(void *arg) {
+    receiver_args *rx = arg;
+    int sock = rx->sock, mtu = rx->mtu, gso = rx->gso;
+    // With GRO one receive can hold many packets, so the buffer must fit a whole coalesced run
+    static char packet[MAX_PACKET_SIZE];
+    char control[CMSG_SPACE(sizeof(int))];
     struct sockaddr_in recv_addr;
-    socklen_t recv_addr_len = sizeof(recv_addr);
-    int received_seq[100000] = {0};
-    int total_packets = 0;
 
-    while (1) {
-        printf("Waiting to receive packet...\n");
-        int received = recvfrom(sock, packet, sizeof(packet), 0, (struct sockaddr *)&recv_addr, &recv_addr_len);
+    int on = 1;
+    if (gso && setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+        perror("UDP_GRO not supported, receiving packets one by one");
+        gso = 0;
+    }
+
+    int running = 1;
+    while (running) {
+        struct iovec iov = { packet, gso ? sizeof(packet) : (size_t)mtu };
+        struct msghdr msg = {0};
+        msg.msg_name = &recv_addr;
+        msg.msg_namelen = sizeof(recv_addr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = gso ? sizeof(control) : 0;
+        int received = recvmsg(sock, &msg, 0);
 
         if (received < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 printf("Timeout reached while waiting for packets.\n");
                 break;
             }
+            if (errno == EINTR) continue;
             perror("Failed to receive packet");
             exit(EXIT_FAILURE);
         }
 
-        memcpy(&seq_num, packet, sizeof(int));  // Extract sequence number
-
-        if (seq_num == -1) {
-            printf("End of file received. Stopping packet reception.\n");
-            break;
+        // A coalesced buffer is a run of equal-sized packets, only the last one may be shorter
+        int segment = received;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); gso && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) memcpy(&segment, CMSG_DATA(cmsg), sizeof(int));
         }
+        if (segment <= 0) segment = received;
 
-        printf("Received packet with seq_num: %d, size: %d bytes, data: %.*s\n",
-               seq_num, received, (int)(received - sizeof(int)), packet + sizeof(int));
-
-        received_seq[seq_num] = 1;
-        total_packets++;
-
-        // Calculate the actual data size
-        int data_size = received - sizeof(int);
-        if (data_size > 0) {
-            memcpy(data, packet + sizeof(int), data_size);  // Copy only the valid data
-            long offset = (long)seq_num * (mtu - sizeof(int));
-            fseek(output, offset, SEEK_SET);  // Seek to the correct offset
-            fwrite(data, 1, data_size, output);  // Write valid data to the file
-            fflush(output);  // Flush the buffer to ensure data is written to disk
-
-            printf("Reconstructed data for seq_num %d at offset %ld: %.*s\n",
-                   seq_num, offset, data_size, packet + sizeof(int));
+        int packets = 0;
+        for (int offset = 0; running && offset < received; offset += segment) {
+            int size = received - offset < segment ? received - offset : segment;
+            running = handle_packet(packet + offset, size, rx);
+            packets += running;
         }
+        flow_echoed(rx->fc, packets);
+        rx->packets += packets;
     }
+    return NULL;
+}
 
-    // Validate if all packets were received
-    for (int i = 0; i < total_packets; i++) {
-        if (received_seq[i] == 0) {
-            fprintf(stderr, "Packet loss detected: Missing seq_num %d\n", i);
-            exit(EXIT_FAILURE);
-        }
+// Validate that every packet the sender sent came back
+void check_received(const seq_bitmap *received, long long sent) {
+    long long missing = bitmap_first_missing(received, sent);
+    if (missing >= 0) {
+        fprintf(stderr, "Packet loss detected: Missing seq_num %lld\n", missing);
+        exit(EXIT_FAILURE);
     }
     printf("File successfully reconstructed.\n");
 }
 
+// The output ends up exactly as long as the input, so size it up front and map it;
+// every packet is then a memcpy to seq_num * payload with no seek or write calls
+char *map_output(const char *path, uint64_t size, int *fd) {
+    *fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (*fd < 0) {
+        perror("Failed to open output file");
+        exit(EXIT_FAILURE);
+    }
+    if (ftruncate(*fd, size) < 0) {
+        perror("Failed to size output file");
+        exit(EXIT_FAILURE);
+    }
+    if (size == 0) return NULL;
+
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map output file");
+        exit(EXIT_FAILURE);
+    }
+    return map;
+}
 
 
-void parse_input(int argc, char *argv[], char *ip, int *port, int *mtu, char *in_file, char *out_file) {
+
+void parse_input(int argc, char *argv[], char *ip, int *port, int *mtu, char *in_file, char *out_file, int *gso) {
 	printf("argc: %d\n", argc);
 	for (int i = 0; i < argc; i++) {
 		printf("argv[%d]: %s\n", i, argv[i]);
 	}
 
-	if (argc != 6) {
-		fprintf(stderr, "Usage: %s <server_ip> <server_port> <mtu> <in_file> <out_file>\n", argv[0]);
+	*gso = argc == 7 && strcmp(argv[6], "-gso") == 0;
+	if (argc != 6 && !*gso) {
+		fprintf(stderr, "Usage: %s <server_ip> <server_port> <mtu> <in_file> <out_file> [-gso]\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
@@ -194,8 +415,9 @@ int main(int argc, char *argv[]) {
 	int mtu;
 	char in_file[256];
 	char out_file[256];
+	int gso;
 
-	parse_input(argc, argv, ip, &port, &mtu, in_file, out_file);
+	parse_input(argc, argv, ip, &port, &mtu, in_file, out_file, &gso);
 
 	int sock = create_socket();
 	struct sockaddr_in server_addr;
@@ -207,20 +429,43 @@ int main(int argc, char *argv[]) {
 		exit(EXIT_FAILURE);
 	}
 
-	FILE *output_file = fopen(out_file, "wb");
-	if (!output_file) {
-		perror("Failed to open output file");
-		fclose(input_file);
+	struct stat st;
+	fstat(fileno(input_file), &st);
+	int output_fd;
+	char *map = map_output(out_file, st.st_size, &output_fd);
+
+	printf("Files opened successfully.\n");
+
+	seq_bitmap received;
+	bitmap_init(&received, st.st_size / (mtu - sizeof(int)) + 1);
+
+	// Receive on a second thread while this one sends, paced by the flow-control window
+	flow_control fc;
+	flow_init(&fc, sock, mtu);
+	receiver_args rx = { sock, mtu, gso, &fc, map, st.st_size, &received, 0, 0 };
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_t receiver;
+	if (pthread_create(&receiver, NULL, receive_file, &rx) != 0) {
+		perror("Failed to start receiver thread");
 		exit(EXIT_FAILURE);
 	}
 
-	printf("Files opened successfully.\n");
+	long long sent = send_file(sock, &server_addr, sizeof(server_addr), input_file, mtu, gso, &fc);
+	pthread_join(receiver, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-	send_file(sock, &server_addr, sizeof(server_addr), input_file, mtu);
-	receive_file(sock, &server_addr, sizeof(server_addr), output_file, mtu);
+	// One line for the whole transfer; per-packet output would cost more than the transfer itself
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Sent %lld packets (%lld bytes), %lld echoed, in %.2f s (%.1f MB/s).\n", sent, (long long)st.st_size,
+	       rx.packets, seconds, seconds > 0 ? st.st_size / seconds / 1e6 : 0.0);
+	if (rx.duplicates > 0) printf("Ignored %lld duplicate packets.\n", rx.duplicates);
+	check_received(&received, sent);
+	free(received.words);
 
+	if (map) munmap(map, st.st_size);
+	close(output_fd);
 	fclose(input_file);
-	fclose(output_file);
 	close(sock);
 
 	return 0;
@@ -1,18 +1,29 @@
+#define _GNU_SOURCE  // recvmmsg/sendmmsg, pthread_setaffinity_np
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <netinet/udp.h>
 
 #define MAX_PACKET_SIZE 65535
+#define MAX_BATCH 1024
+#define DEFAULT_BATCH 64
+#define MAX_THREADS 256
+#define SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+#define IDLE_TIMEOUT_SEC 30
 //#define MAX_SEQ_NUM 100000
 
-void start_server(int port) {
+int create_server_socket(int port, int reuse_port) {
     int sock;
-    struct sockaddr_in server_addr, client_addr;
-    char buffer[MAX_PACKET_SIZE];
-    socklen_t client_addr_len = sizeof(client_addr);
+    struct sockaddr_in server_addr;
 
     // Create socket
     sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -21,6 +32,19 @@ void start_server(int port) {
         exit(EXIT_FAILURE);
     }
 
+    // Every worker binds its own socket to the same port; the kernel hashes each flow to one of them
+    int on = 1;
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        perror("Failed to set SO_REUSEPORT");
+        close(sock);
+        exit(EXIT_FAILURE);
+    }
+
+    // Room for bursts while the echo loop catches up; the kernel caps this at net.core.rmem_max
+    int size = SOCKET_BUFFER_SIZE;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
     // Configure server address
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -36,7 +60,7 @@ void start_server(int port) {
 
     // Set socket timeout
     struct timeval timeout;
-    timeout.tv_sec = 30;  // 30-second timeout
+    timeout.tv_sec = IDLE_TIMEOUT_SEC;
     timeout.tv_usec = 0;
 
     if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
@@ -44,6 +68,31 @@ void start_server(int port) {
         close(sock);
         exit(EXIT_FAILURE);
     }
+    return sock;
+}
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Rate over the span from the first packet to the last one, so the idle timeout is not counted
+void print_echo_rate(long long packets, long long bytes, double first, double last) {
+    double seconds = last - first;
+    printf("Echoed %lld packets (%lld bytes) in %.3f s: %.0f packets/s, %.1f MB/s\n",
+           packets, bytes, seconds,
+           seconds > 0 ? packets / seconds : 0.0,
+           seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+}
+
+void start_server(int port) {
+    int sock = create_server_socket(port, 0);
+    struct sockaddr_in client_addr;
+    char buffer[MAX_PACKET_SIZE];
+    socklen_t client_addr_len = sizeof(client_addr);
+    long long packets = 0, bytes = 0;
+    double first = 0, last = 0;
 
     printf("Server is listening on port %d\n", port);
 
@@ -83,6 +132,9 @@ void start_server(int port) {
         if (sent < 0) {
             perror("Failed to send packet");
         } else {
+            if (packets++ == 0) first = now_seconds();
+            last = now_seconds();
+            bytes += sent;
             printf("Echoed packet with seq_num: %d, size: %d bytes, data: %.*s\n",
                    seq_num,
                    sent,
@@ -98,23 +150,340 @@ void start_server(int port) {
         printf("Sent end-of-file marker to client.\n");
     }
 
+    print_echo_rate(packets, bytes, first, last);
     close(sock);
 }
 
+#define CONTROL_SIZE CMSG_SPACE(sizeof(int))
+
+// Read the GRO segment size of a received message (0 if it arrived as a single datagram)
+// and turn its control data into the matching UDP_SEGMENT request for the echo
+int take_gro_size(struct msghdr *msg) {
+    int size = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) memcpy(&size, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (size <= 0) {
+        msg->msg_controllen = 0;
+        return 0;
+    }
+
+    uint16_t segment = size;
+    struct cmsghdr *cmsg = (struct cmsghdr *)msg->msg_control;
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(segment));
+    memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+    msg->msg_controllen = CMSG_SPACE(sizeof(segment));
+    return size;
+}
+
+typedef struct {
+    int id;
+    int sock;
+    int batch;
+    int cpu;           // Core the worker is pinned to, -1 if not pinned
+    int stop_on_eof;   // Single-socket mode ends with the client's session
+    int gso;           // Receive coalesced datagrams with UDP_GRO and echo them with UDP_SEGMENT
+    pthread_t thread;
+    atomic_llong packets, bytes, calls, sessions;
+    double first, last;
+} echo_worker;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+// Batched echo loop: up to `batch` datagrams per recvmmsg, echoed back with one sendmmsg.
+// Buffers, iovecs and address slots are allocated once, and nothing is formatted per packet.
+void batch_echo_loop(echo_worker *w) {
+    int batch = w->batch;
+    char *buffers = malloc((size_t)batch * MAX_PACKET_SIZE);
+    struct mmsghdr *msgs = calloc(batch, sizeof(struct mmsghdr));
+    struct iovec *iovecs = calloc(batch, sizeof(struct iovec));
+    struct sockaddr_in *addrs = calloc(batch, sizeof(struct sockaddr_in));
+    if (!buffers || !msgs || !iovecs || !addrs) {
+        perror("Failed to allocate message vectors");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < batch; i++) {
+        iovecs[i].iov_base = buffers + (size_t)i * MAX_PACKET_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+    }
+
+    // With GRO the kernel hands over runs of same-sized datagrams as one buffer plus the segment size
+    char *controls = NULL;
+    if (w->gso) {
+        int on = 1;
+        if (setsockopt(w->sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+            perror("UDP_GRO not supported, echoing without offload");
+            w->gso = 0;
+        } else {
+            controls = calloc(batch, CONTROL_SIZE);
+            if (!controls) {
+                perror("Failed to allocate message vectors");
+                exit(EXIT_FAILURE);
+            }
+            for (int i = 0; i < batch; i++) msgs[i].msg_hdr.msg_control = controls + (size_t)i * CONTROL_SIZE;
+        }
+    }
+
+    int received_eof = 0;
+    while (!stop_requested && !(received_eof && w->stop_on_eof)) {
+        // Lengths are overwritten by the previous echo, so reset them before every receive
+        for (int i = 0; i < batch; i++) {
+            iovecs[i].iov_len = MAX_PACKET_SIZE;
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            if (controls) msgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+        }
+
+        // MSG_WAITFORONE: block for the first datagram, then take whatever else is already queued
+        int count = recvmmsg(w->sock, msgs, batch, MSG_WAITFORONE, NULL);
+        if (stop_requested) break;  // Socket was shut down to stop the worker
+        if (count < 0) {
+            // A worker leaving on its own would keep its SO_REUSEPORT socket bound and drop the flows hashed to it,
+            // so in threaded mode only the main thread decides when the whole server has gone idle
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && w->stop_on_eof) {
+                printf("Receive timed out. No packets received in the last %d seconds.\n", IDLE_TIMEOUT_SEC);
+                break;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("Failed to receive packets");
+            continue;
+        }
+        atomic_fetch_add_explicit(&w->calls, 1, memory_order_relaxed);
+
+        // An end-of-file marker is echoed like any other datagram, which is exactly the reply the client expects
+        int markers = 0, segments = 0;
+        for (int i = 0; i < count; i++) {
+            int seq_num;
+            unsigned int len = msgs[i].msg_len;
+            int size = controls ? take_gro_size(&msgs[i].msg_hdr) : 0;
+            iovecs[i].iov_len = len;
+
+            // Only the last segment can be shorter than the rest, so that is where a marker would be
+            unsigned int last = 0;
+            if (size > 0) {
+                last = (len - 1) / size * size;
+                segments += (len + size - 1) / size;
+            } else {
+                segments++;
+            }
+            if (len - last != sizeof(int)) continue;
+            memcpy(&seq_num, (char *)iovecs[i].iov_base + last, sizeof(int));
+            if (seq_num == -1) markers++;
+        }
+
+        // sendmmsg may stop early when the send buffer fills; carry on from where it stopped
+        int done = 0;
+        long long bytes = 0;
+        while (done < count) {
+            int sent = sendmmsg(w->sock, msgs + done, count - done, 0);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                perror("Failed to send packets");
+                break;
+            }
+            for (int i = done; i < done + sent; i++) bytes += msgs[i].msg_len;
+            done += sent;
+        }
+
+        if (done < count) segments = done;  // Only reachable after a send error; counts are approximate
+        if (markers > 0) {
+            received_eof = 1;
+            atomic_fetch_add_explicit(&w->sessions, markers, memory_order_relaxed);
+            segments -= markers;
+            bytes -= markers * sizeof(int);
+        }
+        if (segments > 0) {
+            if (w->packets == 0) w->first = now_seconds();
+            w->last = now_seconds();
+            atomic_fetch_add_explicit(&w->packets, segments, memory_order_relaxed);
+            atomic_fetch_add_explicit(&w->bytes, bytes, memory_order_relaxed);
+        }
+    }
+
+    free(buffers);
+    free(msgs);
+    free(iovecs);
+    free(addrs);
+    free(controls);
+}
+
+void start_batch_server(int port, int batch, int gso) {
+    echo_worker w = { .sock = create_server_socket(port, 0), .batch = batch, .cpu = -1, .stop_on_eof = 1, .gso = gso };
+
+    printf("Server is listening on port %d (batches of up to %d packets%s)\n", port, batch, gso ? ", GRO/GSO" : "");
+    batch_echo_loop(&w);
+    if (w.sessions > 0) {
+        printf("Received end-of-file marker from client.\n");
+        printf("Sent end-of-file marker to client.\n");
+    }
+
+    print_echo_rate(w.packets, w.bytes, w.first, w.last);
+    printf("Used %lld receive calls, %.1f packets per call\n", (long long)w.calls,
+           w.calls ? (double)w.packets / w.calls : 0.0);
+    close(w.sock);
+}
+
+// Pin to the id-th core this process may run on, wrapping around when there are more workers than cores
+int pick_core(int id) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return -1;
+    int count = CPU_COUNT(&allowed);
+    if (count == 0) return -1;
+
+    int wanted = id % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && wanted-- == 0) return cpu;
+    }
+    return -1;
+}
+
+void *echo_worker_main(void *arg) {
+    echo_worker *w = arg;
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) w->cpu = -1;
+    }
+    batch_echo_loop(w);
+    return NULL;
+}
+
+void handle_stop(int signo) {
+    stop_requested = 1;
+}
+
+// SO_REUSEPORT mode: one socket and one thread per worker, each pinned to a core.
+// Workers keep serving after a client's end-of-file marker; the server stops on Ctrl-C
+// or once no worker has echoed anything for IDLE_TIMEOUT_SEC, and prints per-worker and total rates.
+void start_threaded_server(int port, int threads, int batch, int gso) {
+    echo_worker *workers = calloc(threads, sizeof(echo_worker));
+    if (!workers) {
+        perror("Failed to allocate workers");
+        exit(EXIT_FAILURE);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // Bind every socket before any thread starts, so the kernel's flow hash sees the full group
+    for (int i = 0; i < threads; i++) {
+        workers[i].id = i;
+        workers[i].sock = create_server_socket(port, 1);
+        workers[i].batch = batch;
+        workers[i].cpu = pick_core(i);
+        workers[i].gso = gso;
+    }
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, echo_worker_main, &workers[i]) != 0) {
+            perror("Failed to start worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("Server is listening on port %d with %d SO_REUSEPORT workers (batches of up to %d packets%s)\n",
+           port, threads, batch, gso ? ", GRO/GSO" : "");
+
+    // Aggregate view: once a second, total packets/s and each worker's share
+    long long previous[MAX_THREADS] = {0};
+    double last_report = now_seconds();
+    double last_activity = last_report;
+    while (!stop_requested) {
+        sleep(1);
+
+        long long total = 0;
+        long long delta[MAX_THREADS];
+        for (int i = 0; i < threads; i++) {
+            long long packets = atomic_load(&workers[i].packets);
+            delta[i] = packets - previous[i];
+            previous[i] = packets;
+            total += delta[i];
+        }
+
+        double now = now_seconds();
+        if (total > 0) {
+            printf("%.0f packets/s:", total / (now - last_report));
+            for (int i = 0; i < threads; i++) printf(" w%d=%lld", i, delta[i]);
+            printf("\n");
+            fflush(stdout);
+            last_activity = now;
+        }
+        last_report = now;
+        if (now - last_activity >= IDLE_TIMEOUT_SEC) {
+            printf("No packets received by any worker in the last %d seconds.\n", IDLE_TIMEOUT_SEC);
+            break;
+        }
+    }
+
+    // shutdown() wakes a worker blocked in recvmmsg, which then returns 0
+    stop_requested = 1;
+    for (int i = 0; i < threads; i++) shutdown(workers[i].sock, SHUT_RDWR);
+
+    long long packets = 0, bytes = 0, sessions = 0;
+    double first = 0, last = 0;
+    for (int i = 0; i < threads; i++) {
+        echo_worker *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        close(w->sock);
+
+        double seconds = w->last - w->first;
+        printf("Worker %d (cpu %d): %lld packets, %lld bytes, %.0f packets/s, %.1f packets per call, %lld sessions\n",
+               w->id, w->cpu, (long long)w->packets, (long long)w->bytes,
+               seconds > 0 ? w->packets / seconds : 0.0,
+               w->calls ? (double)w->packets / w->calls : 0.0, (long long)w->sessions);
+
+        if (w->packets == 0) continue;
+        if (packets == 0 || w->first < first) first = w->first;
+        if (w->last > last) last = w->last;
+        packets += w->packets;
+        bytes += w->bytes;
+        sessions += w->sessions;
+    }
+    printf("Total over %d workers, %lld sessions: ", threads, sessions);
+    print_echo_rate(packets, bytes, first, last);
+    free(workers);
+}
+
 
 
 int main(int argc, char *argv[]) {
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+	int batch = 0, threads = 0, gso = 0;
+	int bad = argc < 2;
+	for (int i = 2; !bad && i < argc; i++) {
+		if (strcmp(argv[i], "-gso") == 0) gso = 1;
+		else if (strcmp(argv[i], "-batch") == 0 && i + 1 < argc) batch = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+		else bad = 1;
+	}
+	if (bad) {
+		fprintf(stderr, "Usage: %s <port> [-batch <packets_per_call>] [-threads <workers>] [-gso]\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
-
 	int port = atoi(argv[1]);
 	if (port <= 0 || port > 65535) {
 		fprintf(stderr, "Invalid port number. Must be between 1 and 65535.\n");
 		exit(EXIT_FAILURE);
 	}
+	if (batch < 0 || batch > MAX_BATCH) {
+		fprintf(stderr, "Invalid batch size. Must be between 1 and %d.\n", MAX_BATCH);
+		exit(EXIT_FAILURE);
+	}
+	if (threads < 0 || threads > MAX_THREADS) {
+		fprintf(stderr, "Invalid worker count. Must be between 1 and %d.\n", MAX_THREADS);
+		exit(EXIT_FAILURE);
+	}
 
-	start_server(port);
+	// Offload runs on the batched loop
+	if (gso && batch == 0) batch = DEFAULT_BATCH;
+	if (threads > 0) start_threaded_server(port, threads, batch > 0 ? batch : DEFAULT_BATCH, gso);
+	else if (batch > 0) start_batch_server(port, batch, gso);
+	else start_server(port);
 	return 0;
 }
@@ -13,8 +13,15 @@
 #define MAX_PAYLOAD_SIZE 512
 #define MAX_PACKETS 10000
 #define MAX_WINDOW_SIZE 100
-#define TIMEOUT_SEC 1
 #define MAX_RETRIES 5
+#define MAX_RETRANSMITS 10     // Give up on a data packet after this many timeouts
+
+// Retransmission timer, RFC 6298 style. The floor is 200 ms rather than the RFC's 1 s
+// so a lost packet on a fast link costs a fraction of a second, not a whole one.
+#define RTO_INITIAL_MS 1000.0
+#define RTO_MIN_MS 200.0
+#define RTO_MAX_MS 60000.0
+#define CLOCK_GRANULARITY_MS 1.0
 
 typedef struct {
     int seq_num;
@@ -81,8 +88,8 @@ void parse_input(int argc, char *argv[], char *ip, int *port, int *mss, int *win
 
     // Parse Window Size
     *win_size = atoi(argv[4]);
-    if (*win_size <= 0) {
-        fprintf(stderr, "Invalid window size. Must be greater than 0.\n");
+    if (*win_size <= 0 || *win_size > MAX_WINDOW_SIZE) {
+        fprintf(stderr, "Invalid window size. Must be between 1 and %d.\n", MAX_WINDOW_SIZE);
         exit(EXIT_FAILURE);
     }
 
@@ -115,6 +122,77 @@ void get_rfc_time(char *buffer, size_t len) {
              ts.tv_nsec / 1000000);
 }
 
+typedef struct {
+    double srtt;      // Smoothed round-trip time, ms
+    double rttvar;    // Round-trip time variation, ms
+    double rto;       // Current retransmission timeout, ms
+    bool has_sample;
+} RttEstimator;
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+void rtt_init(RttEstimator *est) {
+    est->srtt = 0;
+    est->rttvar = 0;
+    est->rto = RTO_INITIAL_MS;
+    est->has_sample = false;
+}
+
+double clamp_rto(double rto) {
+    if (rto < RTO_MIN_MS) return RTO_MIN_MS;
+    if (rto > RTO_MAX_MS) return RTO_MAX_MS;
+    return rto;
+}
+
+// Feed one RTT measurement. Callers only pass samples from packets that were sent once
+// (Karn's rule): an ACK for a retransmitted packet cannot say which copy it answers.
+// A fresh sample also replaces any backed-off RTO.
+void rtt_sample(RttEstimator *est, double rtt, int seq_num) {
+    if (!est->has_sample) {
+        est->srtt = rtt;
+        est->rttvar = rtt / 2;
+        est->has_sample = true;
+    } else {
+        double error = est->srtt > rtt ? est->srtt - rtt : rtt - est->srtt;
+        est->rttvar = 0.75 * est->rttvar + 0.25 * error;
+        est->srtt = 0.875 * est->srtt + 0.125 * rtt;
+    }
+    double variation = 4 * est->rttvar;
+    est->rto = clamp_rto(est->srtt + (variation > CLOCK_GRANULARITY_MS ? variation : CLOCK_GRANULARITY_MS));
+
+    char timestamp[30];
+    get_rfc_time(timestamp, sizeof(timestamp));
+    fprintf(stdout, "%s, RTT, %d, %.3f, %.3f, %.3f, %.3f\n", timestamp, seq_num, rtt, est->srtt, est->rttvar, est->rto);
+    fflush(stdout);
+}
+
+// The timer expired: double the RTO until an unambiguous sample arrives
+void rtt_backoff(RttEstimator *est, int seq_num) {
+    est->rto = clamp_rto(est->rto * 2);
+
+    char timestamp[30];
+    get_rfc_time(timestamp, sizeof(timestamp));
+    fprintf(stdout, "%s, RTO, %d, %.3f\n", timestamp, seq_num, est->rto);
+    fflush(stdout);
+}
+
+// Wait up to timeout_ms for an ACK; returns 1 with *ack set, 0 on timeout
+int wait_for_ack(int sockfd, struct sockaddr_in *server_addr, double timeout_ms, int *ack) {
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(sockfd, &readfds);
+    if (timeout_ms < 0) timeout_ms = 0;
+    struct timeval timeout = { .tv_sec = (long)(timeout_ms / 1000), .tv_usec = (long)(timeout_ms * 1000) % 1000000 };
+
+    socklen_t addr_len = sizeof(*server_addr);
+    if (select(sockfd + 1, &readfds, NULL, NULL, &timeout) <= 0) return 0;
+    return recvfrom(sockfd, ack, sizeof(int), 0, (struct sockaddr *)server_addr, &addr_len) == sizeof(int);
+}
+
 void send_file(int sockfd, struct sockaddr_in* server_addr, int mss, int win_size, const char* in_file_path, const char* out_file_path) {
     FILE *file = fopen(in_file_path, "rb");
     if (!file) {
@@ -131,21 +209,27 @@ void send_file(int sockfd, struct sockaddr_in* server_addr, int mss, int win_siz
 
     int ack;
     socklen_t addr_len = sizeof(*server_addr);
-
-    struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    RttEstimator est;
+    rtt_init(&est);
 
     int retries = 0;
     while (retries < MAX_RETRIES) {
         sendto(sockfd, &filename, sizeof(Packet), 0, (struct sockaddr *)server_addr, addr_len);
         printf("Sent filename packet: %s\n", filename.payload);
 
-        if (recvfrom(sockfd, &ack, sizeof(int), 0, (struct sockaddr *)server_addr, &addr_len) > 0 && ack == 0) {
+        double sent_at = now_ms();
+        bool got_ack = false;
+        while (!got_ack && now_ms() - sent_at < est.rto) {
+            got_ack = wait_for_ack(sockfd, server_addr, sent_at + est.rto - now_ms(), &ack) && ack == 0;
+        }
+        if (got_ack) {
+            if (retries == 0) rtt_sample(&est, now_ms() - sent_at, 0);
             printf("Received ACK for filename. Starting file transfer...\n");
             break;
         }
 
         printf("Timeout waiting for filename ACK, retrying...\n");
+        rtt_backoff(&est, 0);
         retries++;
     }
     if (retries == MAX_RETRIES) {
@@ -155,69 +239,106 @@ void send_file(int sockfd, struct sockaddr_in* server_addr, int mss, int win_siz
         exit(EXIT_FAILURE);
     }
 
-    // Sliding window setup
+    // Sliding window setup; every unacknowledged packet keeps its copy and send time for retransmission
     int base = 1, next_seq_num = 1;
-    //Packet packet_buffer[MAX_WINDOW_SIZE];
+    Packet packet_buffer[MAX_WINDOW_SIZE];
     bool acked[MAX_WINDOW_SIZE] = {false};
-    //int retries_buffer[MAX_WINDOW_SIZE] = {0};
+    double sent_at[MAX_WINDOW_SIZE];
+    int transmissions[MAX_WINDOW_SIZE] = {0};
     char timestamp[30];
 
     while (!feof(file) || base < next_seq_num) {
         while (!feof(file) && next_seq_num < base + win_size) {
-            Packet pck;
-            memset(&pck, 0, sizeof(Packet));
-            pck.seq_num = next_seq_num;
-            pck.payload_len = fread(pck.payload, 1, mss, file);
+            int slot = next_seq_num % win_size;
+            Packet *pck = &packet_buffer[slot];
+            memset(pck, 0, sizeof(Packet));
+            pck->seq_num = next_seq_num;
+            pck->payload_len = fread(pck->payload, 1, mss, file);
 
-            if (pck.payload_len == 0) break;
+            if (pck->payload_len == 0) break;
 
-            //packet_buffer[next_seq_num % win_size] = pck;
-            acked[next_seq_num % win_size] = false;
-            //retries_buffer[next_seq_num % win_size] = 0;
+            acked[slot] = false;
+            transmissions[slot] = 1;
+            sent_at[slot] = now_ms();
 
-            sendto(sockfd, &pck, sizeof(Packet), 0, (struct sockaddr *)server_addr, sizeof(*server_addr));
+            sendto(sockfd, pck, sizeof(Packet), 0, (struct sockaddr *)server_addr, sizeof(*server_addr));
             get_rfc_time(timestamp, sizeof(timestamp));
-            fprintf(stdout, "%s, DATA, %d, %d, %d, %d\n", timestamp, pck.seq_num, base, next_seq_num, base + win_size);
+            fprintf(stdout, "%s, DATA, %d, %d, %d, %d\n", timestamp, pck->seq_num, base, next_seq_num, base + win_size);
             fflush(stdout);
 
             next_seq_num++;
         }
 
-        // Wait for ACK
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(sockfd, &readfds);
-        timeout = (struct timeval){ .tv_sec = 1, .tv_usec = 0 };
-
-        int select_ret = select(sockfd + 1, &readfds, NULL, NULL, &timeout);
-        if (select_ret > 0) {
-            if (recvfrom(sockfd, &ack, sizeof(int), 0, (struct sockaddr *)server_addr, &addr_len) > 0) {
-                if (ack >= base && ack < next_seq_num) {
-                    acked[ack % win_size] = true;
-                    get_rfc_time(timestamp, sizeof(timestamp));
-                    fprintf(stdout, "%s, ACK, %d, %d, %d, %d\n", timestamp, ack, base, next_seq_num, base + win_size);
-                    fflush(stdout);
-                    
-                    while (acked[base % win_size] && base < next_seq_num) {
-                        base++;
-                    }
+        // Wait for an ACK, but no longer than until the oldest outstanding packet times out
+        double deadline = -1;
+        for (int seq = base; seq < next_seq_num; seq++) {
+            int slot = seq % win_size;
+            if (!acked[slot] && (deadline < 0 || sent_at[slot] + est.rto < deadline)) deadline = sent_at[slot] + est.rto;
+        }
+        if (deadline < 0) continue;
+
+        if (wait_for_ack(sockfd, server_addr, deadline - now_ms(), &ack)) {
+            if (ack >= base && ack < next_seq_num && !acked[ack % win_size]) {
+                int slot = ack % win_size;
+                acked[slot] = true;
+                if (transmissions[slot] == 1) rtt_sample(&est, now_ms() - sent_at[slot], ack);
+
+                get_rfc_time(timestamp, sizeof(timestamp));
+                fprintf(stdout, "%s, ACK, %d, %d, %d, %d\n", timestamp, ack, base, next_seq_num, base + win_size);
+                fflush(stdout);
+
+                while (acked[base % win_size] && base < next_seq_num) {
+                    base++;
                 }
             }
         }
+
+        // Resend every packet whose timer ran out, then back the timer off once for this expiry
+        bool expired = false;
+        double now = now_ms(), rto = est.rto;
+        for (int seq = base; seq < next_seq_num; seq++) {
+            int slot = seq % win_size;
+            if (acked[slot] || now - sent_at[slot] < rto) continue;
+
+            if (transmissions[slot] > MAX_RETRANSMITS) {
+                fprintf(stderr, "Error: Packet %d was not acknowledged after %d retransmissions. Exiting.\n", seq, MAX_RETRANSMITS);
+                fclose(file);
+                close(sockfd);
+                exit(EXIT_FAILURE);
+            }
+            if (!expired) rtt_backoff(&est, seq);
+            expired = true;
+
+            sendto(sockfd, &packet_buffer[slot], sizeof(Packet), 0, (struct sockaddr *)server_addr, sizeof(*server_addr));
+            transmissions[slot]++;
+            sent_at[slot] = now_ms();
+            get_rfc_time(timestamp, sizeof(timestamp));
+            fprintf(stdout, "%s, RETX DATA, %d, %d, %d, %d\n", timestamp, seq, base, next_seq_num, base + win_size);
+            fflush(stdout);
+        }
     }
 
     Packet eof_packet;
     memset(&eof_packet, 0, sizeof(Packet));
     eof_packet.seq_num = next_seq_num;
     eof_packet.payload_len = 0;
-    sendto(sockfd, &eof_packet, sizeof(Packet), 0, (struct sockaddr *)server_addr, sizeof(*server_addr));
-    printf("Sent EOF packet with seq_num %d\n", next_seq_num);
 
     bool eof_sent = false;
-    while (!eof_sent) {
-        if (recvfrom(sockfd, &ack, sizeof(int), 0, (struct sockaddr *)server_addr, &addr_len) > 0 && ack == next_seq_num) {
-            eof_sent = true;
+    for (retries = 0; !eof_sent && retries < MAX_RETRIES; retries++) {
+        sendto(sockfd, &eof_packet, sizeof(Packet), 0, (struct sockaddr *)server_addr, sizeof(*server_addr));
+        printf("Sent EOF packet with seq_num %d\n", next_seq_num);
+
+        double sent_at_eof = now_ms();
+        while (!eof_sent && now_ms() - sent_at_eof < est.rto) {
+            eof_sent = wait_for_ack(sockfd, server_addr, sent_at_eof + est.rto - now_ms(), &ack) && ack == next_seq_num;
         }
+        if (!eof_sent) rtt_backoff(&est, next_seq_num);
+    }
+    if (!eof_sent) {
+        fprintf(stderr, "Error: No ACK Received for EOF. Exiting.\n");
+        fclose(file);
+        close(sockfd);
+        exit(EXIT_FAILURE);
     }
 
     printf("File transfer complete.\n");
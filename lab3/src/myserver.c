@@ -161,6 +161,11 @@ void receive_packets(int sockfd, int drop_rate) {
         if (!client) continue;
 
         if (packet.seq_num == 0) { 
+            // A resent filename means our ACK was lost; the file is already open
+            if (client->file) {
+                send_ack(sockfd, &client_addr, 0, drop_rate);
+                continue;
+            }
             strncpy(client->outfile, packet.payload, sizeof(client->outfile) -1);
             client->outfile[sizeof(client->outfile) -1] = '\0';
 
@@ -177,8 +182,11 @@ void receive_packets(int sockfd, int drop_rate) {
         }
 
         if (packet.payload_len == 0) {
-            fclose(client->file);
-            printf("File transfer complete for client.\n");
+            if (client->file) {
+                fclose(client->file);
+                client->file = NULL;
+                printf("File transfer complete for client.\n");
+            }
             send_ack(sockfd, &client_addr, packet.seq_num, drop_rate);
             continue;
         }
@@ -190,6 +198,9 @@ void receive_packets(int sockfd, int drop_rate) {
             fprintf(stdout, "%s, DATA, %d\n", timestamp, packet.seq_num);
             fflush(stdout);
 
+            send_ack(sockfd, &client_addr, packet.seq_num, drop_rate);
+        } else {
+            // Duplicate: the sender timed out on it, so the earlier ACK was lost or late
             send_ack(sockfd, &client_addr, packet.seq_num, drop_rate);
         }
 
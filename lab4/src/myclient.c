@@ -8,13 +8,21 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 
 #define MAX_PAYLOAD_SIZE 512
 #define MAX_WINDOW_SIZE 10
 #define MAX_RETRIES 5
-#define TIMEOUT_SEC 3
+#define MAX_RETRANSMITS 10     // Give up on a data packet after this many timeouts, as the lab3 sender does
 #define MAX_SERVERS 10
 
+// Retransmission timer per server connection, RFC 6298 style, with a 200 ms floor
+// instead of the RFC's 1 s so losses on a fast link are repaired quickly
+#define RTO_INITIAL_MS 1000.0
+#define RTO_MIN_MS 200.0
+#define RTO_MAX_MS 60000.0
+#define CLOCK_GRANULARITY_MS 1.0
+
 typedef struct {
     int seq_num;
     int payload_len;
@@ -41,6 +49,70 @@ void log_event(const char *event, int seq_num, int base_sn, int next_sn, int win
     fflush(stdout);
 }
 
+typedef struct {
+    double srtt;      // Smoothed round-trip time, ms
+    double rttvar;    // Round-trip time variation, ms
+    double rto;       // Current retransmission timeout, ms
+    bool has_sample;
+} RttEstimator;
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+double clamp_rto(double rto) {
+    if (rto < RTO_MIN_MS) return RTO_MIN_MS;
+    if (rto > RTO_MAX_MS) return RTO_MAX_MS;
+    return rto;
+}
+
+// Same CSV layout as log_event, with the estimates after the sequence number
+void log_rtt(const char *event, int seq_num, double sample, RttEstimator *est, struct sockaddr_in *server_addr) {
+    char timestamp[30];
+    time_t now = time(NULL);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    fprintf(stdout, "%s,%d,%s,%d,%s,%d,%.3f,%.3f,%.3f,%.3f\n",
+            timestamp, ntohs(server_addr->sin_port), inet_ntoa(server_addr->sin_addr),
+            ntohs(server_addr->sin_port), event, seq_num, sample, est->srtt, est->rttvar, est->rto);
+    fflush(stdout);
+}
+
+// Only samples from packets sent once may be passed in (Karn's rule); a fresh sample replaces any backed-off RTO
+void rtt_sample(RttEstimator *est, double rtt, int seq_num, struct sockaddr_in *server_addr) {
+    if (!est->has_sample) {
+        est->srtt = rtt;
+        est->rttvar = rtt / 2;
+        est->has_sample = true;
+    } else {
+        double error = est->srtt > rtt ? est->srtt - rtt : rtt - est->srtt;
+        est->rttvar = 0.75 * est->rttvar + 0.25 * error;
+        est->srtt = 0.875 * est->srtt + 0.125 * rtt;
+    }
+    double variation = 4 * est->rttvar;
+    est->rto = clamp_rto(est->srtt + (variation > CLOCK_GRANULARITY_MS ? variation : CLOCK_GRANULARITY_MS));
+    log_rtt("RTT", seq_num, rtt, est, server_addr);
+}
+
+void rtt_backoff(RttEstimator *est, int seq_num, struct sockaddr_in *server_addr) {
+    est->rto = clamp_rto(est->rto * 2);
+    log_rtt("RTO", seq_num, 0, est, server_addr);
+}
+
+// Wait up to timeout_ms for an ACK; returns 1 with *ack_sn set, 0 on timeout
+int wait_for_ack(int sockfd, double timeout_ms, int *ack_sn) {
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(sockfd, &readfds);
+    if (timeout_ms < 0) timeout_ms = 0;
+    struct timeval timeout = { (long)(timeout_ms / 1000), (long)(timeout_ms * 1000) % 1000000 };
+
+    if (select(sockfd + 1, &readfds, NULL, NULL, &timeout) <= 0) return 0;
+    return recvfrom(sockfd, ack_sn, sizeof(int), 0, NULL, NULL) == sizeof(int);
+}
+
 void *send_file_to_server(void *args) {
     ThreadArgs *targs = (ThreadArgs *)args;
     FILE *file = fopen(targs->in_file, "rb");
@@ -55,7 +127,8 @@ void *send_file_to_server(void *args) {
     int base_sn = 1, next_sn = 1;
     socklen_t addr_len = sizeof(targs->server_addr);
     
-    struct timeval timeouts[MAX_WINDOW_SIZE];
+    double sent_at[MAX_WINDOW_SIZE];
+    RttEstimator est = { 0, 0, RTO_INITIAL_MS, false };
     Packet filename_packet;
     memset(&filename_packet, 0, sizeof(Packet));
     filename_packet.seq_num = 0;
@@ -70,19 +143,22 @@ void *send_file_to_server(void *args) {
                (struct sockaddr *)&targs->server_addr, sizeof(targs->server_addr));
         fprintf(stdout, "Sent filename packet (attempt %d)\n", filename_retries + 1);
 
-        struct timeval timeout = {TIMEOUT_SEC, 0};
-        setsockopt(targs->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-        if (recvfrom(targs->sockfd, &ack_sn, sizeof(int), 0, (struct sockaddr *)&targs->server_addr, &addr_len) > 0) {
+        double filename_sent = now_ms();
+        bool got_ack = false;
+        while (!got_ack && now_ms() - filename_sent < est.rto) {
+            if (!wait_for_ack(targs->sockfd, filename_sent + est.rto - now_ms(), &ack_sn)) continue;
             if (ack_sn == -20) {
                 fprintf(stderr, "File is in progress by another client.\n");
                 exit(20);
             }
-            if (ack_sn == 0) {
-                fprintf(stdout, "Received ACK for filename packet\n");
-                break;
-            }
+            got_ack = ack_sn == 0;
         }
+        if (got_ack) {
+            if (filename_retries == 0) rtt_sample(&est, now_ms() - filename_sent, 0, &targs->server_addr);
+            fprintf(stdout, "Received ACK for filename packet\n");
+            break;
+        }
+        rtt_backoff(&est, 0, &targs->server_addr);
         filename_retries++;
         
         if (time(NULL) - start_time >= 30) {
@@ -108,38 +184,53 @@ void *send_file_to_server(void *args) {
                    (struct sockaddr *)&targs->server_addr, addr_len);
             log_event("DATA", next_sn, base_sn, next_sn, targs->win_size, &targs->server_addr);
             
-            gettimeofday(&timeouts[index], NULL);
+            sent_at[index] = now_ms();
+            retries[index] = 0;
             next_sn++;
         }
 
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(targs->sockfd, &readfds);
-        struct timeval timeout = {TIMEOUT_SEC, 0};
+        // Wait for an ACK, but no longer than until the oldest outstanding packet times out
+        double deadline = -1;
+        for (int i = base_sn; i < next_sn; i++) {
+            int index = i % targs->win_size;
+            if (!acked[index] && (deadline < 0 || sent_at[index] + est.rto < deadline)) deadline = sent_at[index] + est.rto;
+        }
 
-        int select_ret = select(targs->sockfd + 1, &readfds, NULL, NULL, &timeout);
-        if (select_ret > 0) {
-            int ack_sn;
-            recvfrom(targs->sockfd, &ack_sn, sizeof(int), 0, NULL, NULL);
+        int ack_sn;
+        if (deadline >= 0 && wait_for_ack(targs->sockfd, deadline - now_ms(), &ack_sn)) {
             if (ack_sn >= base_sn && ack_sn < next_sn) {
                 int index = ack_sn % targs->win_size;
                 if (!acked[index]) {
+                    if (retries[index] == 0) rtt_sample(&est, now_ms() - sent_at[index], ack_sn, &targs->server_addr);
                     log_event("ACK", ack_sn, base_sn, next_sn, targs->win_size, &targs->server_addr);
                     acked[index] = true;
                     retries[index] = 0;
                 }
             }
-        } else {
-            fprintf(stderr, "⚠Timeout! Retransmitting lost packets\n");
-            for (int i = base_sn; i < next_sn; i++) {
-                int index = i % targs->win_size;
-                if (!acked[index] && retries[index] < MAX_RETRIES) {
-                    fprintf(stderr, "Packet loss detected. Retransmitting seq_num %d, attempt %d\n", i, retries[index] + 1);
-                    sendto(targs->sockfd, &window[index], sizeof(Packet), 0,
-                           (struct sockaddr *)&targs->server_addr, addr_len);
-                    retries[index]++;
-                }
+        }
+
+        // Resend every packet whose timer ran out, then back the timer off once for this expiry
+        bool expired = false;
+        double now = now_ms(), rto = est.rto;
+        for (int i = base_sn; i < next_sn; i++) {
+            int index = i % targs->win_size;
+            if (acked[index] || now - sent_at[index] < rto) continue;
+
+            if (retries[index] >= MAX_RETRANSMITS) {
+                fprintf(stderr, "Error: Packet %d was not acknowledged after %d retransmissions. Aborting.\n", i, MAX_RETRANSMITS);
+                exit(4);
             }
+            if (!expired) {
+                fprintf(stderr, "⚠Timeout! Retransmitting lost packets\n");
+                rtt_backoff(&est, i, &targs->server_addr);
+            }
+            expired = true;
+
+            fprintf(stderr, "Packet loss detected. Retransmitting seq_num %d, attempt %d\n", i, retries[index] + 1);
+            sendto(targs->sockfd, &window[index], sizeof(Packet), 0,
+                   (struct sockaddr *)&targs->server_addr, addr_len);
+            retries[index]++;
+            sent_at[index] = now_ms();
         }
 
         while (base_sn < next_sn && acked[base_sn % targs->win_size]) {